@@ -0,0 +1,40 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+std::atomic<u64> allocations { 0 };
+std::atomic<u64> bytes { 0 };
+thread_local AllocStats thread_stats;
+
+} // namespace
+
+AllocStats alloc_stats() {
+    return { allocations.load(std::memory_order_relaxed), bytes.load(std::memory_order_relaxed) };
+}
+
+AllocStats thread_alloc_stats() {
+    return thread_stats;
+}
+
+// The array and nothrow versions forward to these
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    thread_stats.allocations++;
+    thread_stats.bytes += size;
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "types.h"
+
+// Every operator new in the program is counted, so we can check that the dispatch
+// loop runs cached blocks without touching the heap.
+struct AllocStats {
+    u64 allocations = 0;
+    u64 bytes = 0;
+};
+
+AllocStats alloc_stats();
+AllocStats thread_alloc_stats(); // Only the calling thread's, leaving out background threads
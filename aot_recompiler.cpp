@@ -0,0 +1,315 @@
+// firerecomp: Ahead-of-time recompiler.
+//
+// Walks the code reachable from the reset/NMI/IRQ vectors of a ROM, emits each block
+// through m65816::emit and prints the IR as straight-line C++, along with a
+// table of blocks sorted by PC (see m65816_aot.h).
+// Build the output into firesnes with -DFIRESNES_AOT=<file>.
+//
+// Only code in ROM is recompiled. Exits we can't follow statically (indirect jumps,
+// returns, code in RAM) are left for the runtime path.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <climits>
+#include <array>
+
+#include "m65816.h"
+#include "m65816_cache.h"
+#include "ir_passes.h"
+#include "ir_base.h"
+#include "nes_rom.h"
+
+namespace {
+
+// The 64KB CPU address space as loaded from the ROM, which EmitBlock reads code from, and a
+// register file with only the E/M/X flags of the block being emitted, for StaticLoad
+std::array<u64, 32> registers {};
+std::array<u8, 0x10000> memory {};
+
+bool InRom(u64 addr, int bytes) {
+    return addr >= 0x8000 && addr + bytes <= 0x10000;
+}
+
+bool LoadRom(const char* path) {
+    if (const char* error = LoadNesRom(path, memory.data())) {
+        printf("%s: %s\n", path, error);
+        return false;
+    }
+    return true;
+}
+
+u16 Vector(u16 addr) {
+    return memory[addr] | memory[addr + 1] << 8;
+}
+
+// Loads that can be known ahead of time: the E/M/X flags the block was emitted under, and ROM
+std::optional<u64> StaticLoad(u64 space, u64 offset, int bits) {
+    if (space == 0) {
+        if (offset == m65816::Flag_E || offset == m65816::Flag_M || offset == m65816::Flag_X)
+            return registers[offset];
+        return {};
+    }
+    if (space == 1 && InRom(offset, bits / 8)) {
+        u64 value = 0;
+        for (int i = bits / 8; i-- > 0; )
+            value = value << 8 | memory[offset + i];
+        return value;
+    }
+    return {};
+}
+
+// Finds the value Finalize() stored to a register, if it was changed
+std::optional<ssa> FinalValue(const std::vector<IR_Base>& ir, m65816::Reg reg) {
+    for (size_t i = ir.size(); i-- > 0; ) {
+        const IR_Base& node = ir[i];
+        if (node.id < store64 || node.id > store8 || !IsRegisterAccess(ir, node))
+            continue;
+        const IR_Base& offset = ir[node.arg_2];
+        if (offset.id == Const && offset.arg_32 == reg)
+            return ssa { u16(node.arg_3) };
+    }
+    return {};
+}
+
+// Collects every value a node might have, following both sides of branches.
+// Returns false if any of them depends on runtime state.
+bool PossibleValues(const std::vector<IR_Base>& ir, u16 node, std::set<u64>& values) {
+    if (ir[node].id == Ternary) {
+        bool a = PossibleValues(ir, ir[node].arg_2, values);
+        bool b = PossibleValues(ir, ir[node].arg_3, values);
+        return a && b;
+    }
+    auto value = evaluate(ir, ssa { node }, StaticLoad);
+    if (value)
+        values.insert(*value);
+    return value.has_value();
+}
+
+std::string Operand(const std::vector<IR_Base>& ir, u16 arg) {
+    char buf[32];
+    if (ir[arg].id == Const)
+        snprintf(buf, sizeof(buf), "0x%xull", (unsigned)ir[arg].arg_32);
+    else
+        snprintf(buf, sizeof(buf), "s%u", arg);
+    return buf;
+}
+
+std::string Mask(int bits) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%llxull", (unsigned long long)(0xffffffffffffffff >> (64 - bits)));
+    return buf;
+}
+
+// Prints a block as a C++ function. Follows the interpreter's semantics exactly, but with
+// the widths the emitter recorded. Returns false if the block can't be translated.
+bool PrintBlock(FILE* out, const char* name, const std::vector<IR_Base>& ir, const std::vector<u8>& width) {
+    std::string body;
+    char line[512];
+
+    for (size_t i = 0; i < ir.size(); i++) {
+        const IR_Base& node = ir[i];
+        auto a = [&] { return Operand(ir, node.arg_1); };
+        auto b = [&] { return Operand(ir, node.arg_2); };
+        auto c = [&] { return Operand(ir, node.arg_3); };
+        auto constant = [&] (u16 arg) { return (unsigned)ir[arg].arg_32; };
+
+        std::string expr;
+        switch (node.id) {
+        case Const:
+        case memState:
+        case Assert:
+            continue;
+        case Not: expr = "~" + a() + " & " + Mask(width[i]); break;
+        case Add: expr = "(" + a() + " + " + b() + ") & " + Mask(width[i]); break;
+        case Sub: expr = "(" + a() + " - " + b() + ") & " + Mask(width[i]); break;
+        case And: expr = a() + " & " + b(); break;
+        case Or:  expr = a() + " | " + b(); break;
+        case Xor: expr = a() + " ^ " + b(); break;
+        case ShiftLeft:  expr = a() + " << " + std::to_string(constant(node.arg_2)); break;
+        case ShiftRight: expr = a() + " >> " + std::to_string(constant(node.arg_2)); break;
+        case Cat:
+            if (width[node.arg_2] >= 64)
+                return false;
+            expr = "(" + a() + " << " + std::to_string(width[node.arg_2]) + ") | " + b();
+            break;
+        case Extract:
+            expr = "(" + a() + " >> " + std::to_string(constant(node.arg_2)) + ") & " + Mask(width[i]);
+            break;
+        case Zext: expr = a(); break;
+        case Eq:   expr = a() + " == " + b(); break;
+        case Neq:  expr = a() + " != " + b(); break;
+        case Ternary: expr = a() + " ? " + b() + " : " + c(); break;
+        case load8:
+        case load16:
+        case load32:
+        case load64:
+        case store8:
+        case store16:
+        case store32:
+        case store64: {
+            const IR_Base& mem = ir[node.arg_1];
+            if (ir[mem.arg_1].id != Const)
+                return false;
+            bool is_load = node.id <= load8;
+            int bits = is_load ? 8 << (load8 - node.id) : 8 << (store8 - node.id);
+            std::string cond = Operand(ir, mem.arg_3);
+            std::string ptr = "*(u" + std::to_string(bits) + "*)";
+            if (ir[mem.arg_1].arg_32 == 0) {
+                ptr += "&regs[" + b() + "]";
+            } else {
+                ptr += "&mem[" + b() + "]";
+                snprintf(line, sizeof(line), "    assert(!%s || %s <= 0xffff);\n", cond.c_str(), b().c_str());
+                body += line;
+            }
+            if (is_load)
+                snprintf(line, sizeof(line), "    u64 s%zu = %s ? %s : 0;\n", i, cond.c_str(), ptr.c_str());
+            else
+                snprintf(line, sizeof(line), "    if (%s) %s = %s;\n", cond.c_str(), ptr.c_str(), c().c_str());
+            body += line;
+            continue;
+        }
+        default:
+            return false;
+        }
+        snprintf(line, sizeof(line), "    u64 s%zu = %s;\n", i, expr.c_str());
+        body += line;
+    }
+
+    fprintf(out, "void %s(u64*, u64* regs, u8* mem) {\n%s}\n\n", name, body.c_str());
+    return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        printf("Usage: %s <rom.nes> <output.cpp>\n", argv[0]);
+        return 1;
+    }
+
+    if (!LoadRom(argv[1]))
+        return 1;
+
+    FILE* out = fopen(argv[2], "w");
+    if (!out) {
+        printf("Can't open %s\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(out, "// Generated by firerecomp from %s, do not edit.\n\n", argv[1]);
+    fprintf(out, "#include \"m65816_aot.h\"\n\n#include <cassert>\n\nnamespace {\n\n");
+
+    struct Compiled {
+        int instructions;
+        std::string name;
+        size_t guards;
+    };
+    std::map<std::pair<u32, u8>, Compiled> compiled;
+    std::set<std::pair<u32, u8>> seen;
+    std::deque<std::pair<u32, u8>> worklist;
+    int dynamic_exits = 0, skipped = 0;
+
+    // The CPU starts in emulation mode
+    const u8 emulation = m65816::Mode_E | m65816::Mode_M | m65816::Mode_X;
+    for (u16 vector : { 0xfffc, 0xfffa, 0xfffe })
+        worklist.push_back({ Vector(vector), emulation });
+
+    while (!worklist.empty()) {
+        auto [pc, mode] = worklist.front();
+        worklist.pop_front();
+        if (!seen.insert({ pc, mode }).second)
+            continue;
+
+        if ((pc >> 16) != 0 || !InRom(pc, 1)) {
+            dynamic_exits++; // Code in RAM is left for the runtime
+            continue;
+        }
+
+        registers[m65816::Flag_E] = (mode & m65816::Mode_E) != 0;
+        registers[m65816::Flag_M] = (mode & m65816::Mode_M) != 0;
+        registers[m65816::Flag_X] = (mode & m65816::Mode_X) != 0;
+
+        m65816::Block block = m65816::EmitBlock(pc, mode, INT_MAX, memory.data());
+        if (block.instructions == 0) {
+            skipped++;
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "block_%06x_%x", pc, mode);
+        if (PrintBlock(out, name, block.ir, block.widths)) {
+            // The instruction bytes the block was built from, so the runtime can tell if the code
+            // in memory isn't what firerecomp saw any more
+            fprintf(out, "const m65816::AotGuard %s_guards[] = {\n", name);
+            for (auto [address, byte] : block.guards)
+                fprintf(out, "    { 0x%06x, 0x%02x },\n", address, byte);
+            fprintf(out, "};\n\n");
+            compiled[{ pc, mode }] = { block.instructions, name, block.guards.size() };
+        } else
+            skipped++;
+
+        // Follow the exits
+        std::set<u64> pcs, pbrs;
+        bool resolved = true;
+        if (auto next_pc = FinalValue(block.ir, m65816::PC))
+            resolved &= PossibleValues(block.ir, next_pc->offset, pcs);
+        else
+            pcs.insert(pc & 0xffff);
+        if (auto next_pbr = FinalValue(block.ir, m65816::PBR))
+            resolved &= PossibleValues(block.ir, next_pbr->offset, pbrs);
+        else
+            pbrs.insert(pc >> 16);
+
+        u8 next_mode = 0;
+        bool mode_known = true;
+        for (auto [reg, bit] : { std::make_pair(m65816::Flag_E, m65816::Mode_E),
+                                 std::make_pair(m65816::Flag_M, m65816::Mode_M),
+                                 std::make_pair(m65816::Flag_X, m65816::Mode_X) }) {
+            std::optional<u64> value = registers[reg];
+            if (auto final_value = FinalValue(block.ir, reg))
+                value = evaluate(block.ir, *final_value, StaticLoad);
+            if (!value)
+                mode_known = false;
+            else if (*value & 1)
+                next_mode |= bit;
+        }
+        if (!resolved || !mode_known)
+            dynamic_exits++;
+
+        if (mode_known) {
+            for (u64 pbr : pbrs)
+                for (u64 next : pcs)
+                    worklist.push_back({ u32(pbr << 16 | next), next_mode });
+        }
+
+        // Subroutine calls will (probably) return to the next instruction.
+        // The block might have followed the call, so check every instruction.
+        for (u32 instruction_pc : block.instruction_pcs) {
+            u8 opcode = memory[instruction_pc & 0xffff];
+            if (opcode == 0x20 || opcode == 0xfc)
+                worklist.push_back({ instruction_pc + 3, mode });
+            else if (opcode == 0x22)
+                worklist.push_back({ instruction_pc + 4, mode });
+        }
+    }
+
+    fprintf(out, "}\n\nnamespace m65816 {\n\n");
+    if (compiled.empty()) {
+        fprintf(out, "const AotBlock aot_blocks[1] = {};\nconst size_t aot_block_count = 0;\n\n}\n");
+    } else {
+        fprintf(out, "const AotBlock aot_blocks[] = {\n");
+        for (auto& [key, block] : compiled)
+            fprintf(out, "    { 0x%06x, 0x%x, %i, %s, %s_guards, %zu },\n", key.first, key.second, block.instructions,
+                block.name.c_str(), block.name.c_str(), block.guards);
+        fprintf(out, "};\nconst size_t aot_block_count = sizeof(aot_blocks) / sizeof(aot_blocks[0]);\n\n}\n");
+    }
+    fclose(out);
+
+    printf("Recompiled %zu blocks, %i skipped, %i exits left for the runtime\n",
+        compiled.size(), skipped, dynamic_exits);
+    return 0;
+}
@@ -0,0 +1,410 @@
+// firebatch: Runs a list of NES ROMs headless, spread over a pool of threads (one Machine
+// each), and writes a JSON summary for CI.
+//
+// usage: firebatch <manifest> [-o summary.json] [-j threads] [--engine name] [--no-pin]
+//
+// The manifest has one ROM per line, followed by key=value options. # starts a comment.
+//
+//     nestest.nes start=C000 cycles=30000 mem[0002]=00 mem[0003]=00
+//
+// How to run it:
+//   cycles=N, frames=N   Budget, in CPU cycles or NTSC frames (29780.5 cycles). Defaults to 60 frames
+//   start=HHHH           Start here rather than at the reset vector
+//   stop=HHHH            Finish early when a block starts here (see Machine::stop_at)
+//
+// What it should end with, all in hex:
+//   pc=HHHH a=HH x=HHHH y=HHHH s=HHHH mem[HHHH]=HH
+//   stopped              Got to stop before the budget ran out
+//
+// A ROM passes if it doesn't hit an unimplemented opcode and everything it should end with holds.
+// ROM paths are relative to the manifest. Exits with 1 if any ROM failed.
+//
+// Each worker is pinned to a CPU of its own, unless --no-pin is given. Tiered runs aren't pinned,
+// and each of their machines compiles on one background thread, so -j N runs 2N threads.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "m65816.h"
+#include "m65816_cache.h"
+#include "m65816_machine.h"
+#include "nes_rom.h"
+#include "nes.h"
+
+namespace {
+
+using m65816::Engine;
+
+constexpr u64 frame_cycles_x2 = 59561; // NTSC CPU cycles in two frames
+
+struct Expect {
+    enum Kind { Register, Memory, Stopped } kind;
+    u32 where = 0; // Register or address
+    u64 value = 0;
+    std::string text; // As written in the manifest
+};
+
+struct Job {
+    std::string name; // As written in the manifest
+    std::string path;
+    u64 cycles = 60 * frame_cycles_x2 / 2;
+    std::optional<u32> start;
+    std::optional<u32> stop;
+    std::vector<Expect> expects;
+};
+
+struct Result {
+    bool passed = false;
+    std::string reason; // Why it failed
+    u64 cycles = 0;
+    u64 instructions = 0;
+    double seconds = 0; // Wall time, including emitting blocks
+    int cpu = -1;       // The worker's CPU, if it was pinned
+};
+
+bool ParseHex(const std::string& text, u64& value) {
+    char* end;
+    value = strtoull(text.c_str(), &end, 16);
+    return !text.empty() && *end == '\0';
+}
+
+bool ParseDecimal(const std::string& text, u64& value) {
+    char* end;
+    value = strtoull(text.c_str(), &end, 10);
+    return !text.empty() && *end == '\0';
+}
+
+// Parses one key=value option (or a bare flag) from the manifest into job.
+// Returns nullptr, or what's wrong with it.
+const char* ParseOption(const std::string& option, Job& job) {
+    size_t equals = option.find('=');
+    std::string key = option.substr(0, equals);
+    std::string text = equals == std::string::npos ? "" : option.substr(equals + 1);
+    u64 value = 0;
+
+    if (equals == std::string::npos) {
+        if (key != "stopped")
+            return "unknown flag";
+        job.expects.push_back({ Expect::Stopped, 0, 0, option });
+        return nullptr;
+    }
+
+    if (key == "cycles" || key == "frames") {
+        if (!ParseDecimal(text, value))
+            return "expected a decimal number";
+        job.cycles = key == "cycles" ? value : value * frame_cycles_x2 / 2;
+        return nullptr;
+    }
+
+    if (!ParseHex(text, value))
+        return "expected a hex number";
+
+    if (key == "start") {
+        job.start = u32(value);
+    } else if (key == "stop") {
+        job.stop = u32(value);
+    } else if (key.compare(0, 4, "mem[") == 0 && key.back() == ']') {
+        u64 address;
+        if (!ParseHex(key.substr(4, key.size() - 5), address) || address > 0xffff)
+            return "bad address";
+        job.expects.push_back({ Expect::Memory, u32(address), value, option });
+    } else {
+        static const std::pair<const char*, m65816::Reg> registers[] = {
+            { "pc", m65816::PC }, { "a", m65816::A }, { "x", m65816::X }, { "y", m65816::Y }, { "s", m65816::S },
+        };
+        for (auto [name, reg] : registers) {
+            if (key == name) {
+                job.expects.push_back({ Expect::Register, u32(reg), value, option });
+                return nullptr;
+            }
+        }
+        return "unknown option";
+    }
+    return nullptr;
+}
+
+bool ParseManifest(const char* path, std::vector<Job>& jobs) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+
+    std::string dir = path;
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "" : dir.substr(0, slash + 1);
+
+    char line[4096];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+        if (char* comment = strchr(line, '#'))
+            *comment = '\0';
+
+        std::vector<std::string> words;
+        for (char* word = strtok(line, " \t\r\n"); word; word = strtok(nullptr, " \t\r\n"))
+            words.push_back(word);
+        if (words.empty())
+            continue;
+
+        Job job;
+        job.name = words[0];
+        job.path = words[0][0] == '/' ? words[0] : dir + words[0];
+        for (size_t i = 1; i < words.size(); i++) {
+            if (const char* error = ParseOption(words[i], job)) {
+                printf("%s:%i: %s: %s\n", path, line_number, words[i].c_str(), error);
+                ok = false;
+            }
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    fclose(f);
+    return ok;
+}
+
+Result RunJob(const Job& job, Engine engine, const PlainMemoryFn& plain_memory) {
+    Result result;
+    auto start = std::chrono::steady_clock::now();
+    char text[128];
+
+    // Tiered machines get one compile thread each, as the workers already keep every CPU busy
+    auto machine = std::make_unique<m65816::Machine>(engine, 1);
+    machine->plain_memory = plain_memory;
+    if (const char* error = LoadNesRom(job.path.c_str(), machine->memory.data())) {
+        result.reason = error;
+        return result;
+    }
+
+    u32 pc = job.start ? *job.start : machine->memory[0xfffc] | machine->memory[0xfffd] << 8;
+    machine->Reset(pc);
+    machine->stop_at = job.stop;
+    result.cycles = machine->run_for(job.cycles);
+    result.instructions = machine->stats.instructions;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (machine->Halted()) {
+        snprintf(text, sizeof(text), "unimplemented opcode %02X at %06X",
+            machine->memory[machine->registers[m65816::PC]],
+            u32(machine->registers[m65816::PBR] << 16 | machine->registers[m65816::PC]));
+        result.reason = text;
+        return result;
+    }
+
+    for (const Expect& expect : job.expects) {
+        if (expect.kind == Expect::Stopped) {
+            if (!machine->Stopped()) {
+                result.reason = "didn't stop in time";
+                return result;
+            }
+            continue;
+        }
+
+        u64 actual = expect.kind == Expect::Register ? machine->registers[expect.where] : machine->memory[expect.where];
+        if (actual != expect.value) {
+            snprintf(text, sizeof(text), "expected %s, got %llX", expect.text.c_str(), (unsigned long long)actual);
+            result.reason = text;
+            return result;
+        }
+    }
+
+    result.passed = true;
+    return result;
+}
+
+// The CPUs we are allowed to run on, so workers can be pinned to one each
+std::vector<int> AvailableCpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+    return cpus;
+}
+
+// Keeps the calling thread on one CPU, so its caches (and its machine's JIT code) stay warm
+bool PinToCpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+std::string JsonString(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (u8(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+bool WriteSummary(const char* path, const char* manifest, Engine engine, int threads, bool pinned, double seconds,
+                  const std::vector<Job>& jobs, const std::vector<Result>& results) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        printf("Can't write %s\n", path);
+        return false;
+    }
+
+    int passed = 0;
+    u64 cycles = 0;
+    for (const Result& result : results) {
+        passed += result.passed;
+        cycles += result.cycles;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"manifest\": %s,\n", JsonString(manifest).c_str());
+    fprintf(out, "  \"engine\": \"%s\",\n", m65816::EngineName(engine));
+    fprintf(out, "  \"threads\": %i,\n", threads);
+    fprintf(out, "  \"pinned\": %s,\n", pinned ? "true" : "false");
+    fprintf(out, "  \"wall_ms\": %.3f,\n", seconds * 1e3);
+    fprintf(out, "  \"cycles\": %llu,\n", (unsigned long long)cycles);
+    fprintf(out, "  \"cycles_per_sec\": %.0f,\n", seconds > 0 ? cycles / seconds : 0.0);
+    fprintf(out, "  \"passed\": %i,\n", passed);
+    fprintf(out, "  \"failed\": %i,\n", int(results.size()) - passed);
+    fprintf(out, "  \"roms\": [");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Result& result = results[i];
+        fprintf(out, "%s\n    {\"name\": %s, \"passed\": %s, \"reason\": %s, \"cycles\": %llu, \"instructions\": %llu, "
+            "\"wall_ms\": %.3f, \"cycles_per_sec\": %.0f, \"cpu\": %i}", i ? "," : "",
+            JsonString(jobs[i].name).c_str(), result.passed ? "true" : "false",
+            result.passed ? "null" : JsonString(result.reason).c_str(),
+            (unsigned long long)result.cycles, (unsigned long long)result.instructions, result.seconds * 1e3,
+            result.seconds > 0 ? result.cycles / result.seconds : 0.0, result.cpu);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    return true;
+}
+
+void Usage() {
+    printf("usage: firebatch <manifest> [-o summary.json] [-j threads] [--engine interpreter|threaded|jit|tiered] [--no-pin]\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const char* manifest = nullptr;
+    const char* summary = "firebatch.json";
+    int threads = 0;
+    bool pin = true;
+    Engine engine = Engine::Jit;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-o") == 0 && has_value) {
+            summary = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && has_value) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--engine") == 0 && has_value) {
+            const char* name = argv[++i];
+            bool found = false;
+            for (Engine e : { Engine::Interpreter, Engine::Threaded, Engine::Jit, Engine::Tiered }) {
+                if (strcmp(name, m65816::EngineName(e)) == 0) {
+                    engine = e;
+                    found = true;
+                }
+            }
+            if (!found) {
+                Usage();
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--no-pin") == 0) {
+            pin = false;
+        } else if (argv[i][0] != '-' && !manifest) {
+            manifest = argv[i];
+        } else {
+            Usage();
+            return 2;
+        }
+    }
+    if (!manifest) {
+        Usage();
+        return 2;
+    }
+
+    std::vector<Job> jobs;
+    if (!ParseManifest(manifest, jobs))
+        return 2;
+
+    std::vector<int> cpus = AvailableCpus();
+    if (threads <= 0)
+        threads = cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : cpus.size();
+    threads = std::max(1, std::min(threads, int(jobs.size())));
+    // Compile threads inherit their machine's affinity, so with Tiered they would share its CPU
+    pin = pin && !cpus.empty() && engine != Engine::Tiered;
+
+    // Keeps the memory passes off the PPU and APU registers. Built once, the workers share it.
+    const PlainMemoryFn plain_memory = NesPlainMemory();
+
+    std::vector<Result> results(jobs.size());
+    std::atomic<size_t> next { 0 };
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&] (int index) {
+        int cpu = -1;
+        if (pin && PinToCpu(cpus[index % cpus.size()]))
+            cpu = cpus[index % cpus.size()];
+
+        for (size_t job; (job = next.fetch_add(1)) < jobs.size(); ) {
+            results[job] = RunJob(jobs[job], engine, plain_memory);
+            results[job].cpu = cpu;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++)
+        pool.emplace_back(worker, i);
+    for (std::thread& thread : pool)
+        thread.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Result& result = results[i];
+        printf("%-4s %-40s %12llu cycles %10.3f ms  %s\n", result.passed ? "ok" : "FAIL", jobs[i].name.c_str(),
+            (unsigned long long)result.cycles, result.seconds * 1e3, result.reason.c_str());
+        failed += !result.passed;
+    }
+    printf("%zu passed, %i failed in %.3f s on %i threads (%s)\n", jobs.size() - failed, failed, seconds, threads,
+        m65816::EngineName(engine));
+
+    if (!WriteSummary(summary, manifest, engine, threads, pin, seconds, jobs, results))
+        return 2;
+    return failed ? 1 : 0;
+}
@@ -205,11 +205,18 @@ static_assert(sizeof(IR_Const32) == sizeof(IR_Base));
 };*/
 
 #include <vector>
+#include <functional>
 
-void partial_interpret(std::vector<IR_Base> irlist, std::vector<u64> &ssalist, std::vector<u8> &ssatype, int offset);
-void interpret(std::vector<IR_Base> ir);
+// widths holds the width of every node, as recorded by the emitter (and checked by VerifyWidths).
+// memState namespace 0 is the register file regs, and 1 is the 64KB of guest memory mem.
+void partial_interpret(const std::vector<IR_Base> &irlist, const std::vector<u8> &widths, std::vector<u64> &ssalist, int offset,
+                       u64* regs, u8* mem);
+void interpret(const std::vector<IR_Base> &ir, const std::vector<u8> &widths, u64* regs, u8* mem);
 
-#include <array>
+// Evaluates against the register file regs. Bus reads might have side effects, so they are never evaluated.
+std::optional<u64> evaluate(const std::vector<IR_Base> &irlist, ssa node, const u64* regs);
 
-extern std::array<u64, 32> registers;
-extern std::array<u8, 0xffff> memory;
+// Supplies the value of a load during evaluate(). Gets the memState namespace (0 is the register file),
+// the offset and the width in bits. Returns nothing if the value isn't known.
+using EvaluateLoadFn = std::function<std::optional<u64>(u64 space, u64 offset, int bits)>;
+std::optional<u64> evaluate(const std::vector<IR_Base> &irlist, ssa node, const EvaluateLoadFn &load);
@@ -0,0 +1,104 @@
+#include "ir_compile_queue.h"
+
+#include <algorithm>
+
+CompileQueue::CompileQueue(unsigned threads) {
+    if (threads == 0)
+        threads = std::clamp(std::thread::hardware_concurrency(), 2u, 5u) - 1;
+
+    for (unsigned i = 0; i < threads; i++)
+        jits.push_back(std::make_unique<JitX64>());
+    for (auto& jit : jits)
+        workers.emplace_back([this, &jit] { Worker(*jit); });
+}
+
+CompileQueue::~CompileQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        jobs.clear();
+    }
+    work_ready.notify_all();
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+void CompileQueue::Push(u64 key, u64 serial, u32 guest_pc, std::vector<IR_Base> ir, std::vector<u8> widths) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back({ key, serial, guest_pc, std::move(ir), std::move(widths), std::chrono::steady_clock::now() });
+        stats.queued++;
+        stats.peak_depth = std::max(stats.peak_depth, jobs.size());
+    }
+    work_ready.notify_one();
+}
+
+void CompileQueue::TakeResults(std::vector<Result>& out) {
+    out.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    std::swap(out, results);
+    ready.store(0, std::memory_order_release);
+}
+
+void CompileQueue::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return jobs.empty() && busy == 0; });
+}
+
+void CompileQueue::Reset() {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobs.clear();
+    idle.wait(lock, [this] { return busy == 0; });
+
+    // No worker is compiling, and they only touch their JIT while busy
+    for (auto& jit : jits)
+        jit->Reset();
+    results.clear();
+    ready.store(0, std::memory_order_release);
+    stats.resets++;
+}
+
+size_t CompileQueue::Depth() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.size();
+}
+
+CompileQueue::Stats CompileQueue::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void CompileQueue::Worker(JitX64& jit) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (stopping)
+            return;
+
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        busy++;
+        lock.unlock();
+
+        // The JIT is only touched by this thread, so compiling doesn't need the lock
+        size_t used = jit.Used();
+        auto start = std::chrono::steady_clock::now();
+        JitX64::BlockFn fn = jit.Compile(job.ir, job.widths, job.guest_pc);
+        auto end = std::chrono::steady_clock::now();
+
+        lock.lock();
+        busy--;
+        bool full = !fn && jit.Full();
+        (fn ? stats.compiled : full ? stats.exhausted : stats.unsupported)++;
+        stats.code_bytes += jit.Used() - used;
+        u64 latency = std::chrono::duration_cast<std::chrono::nanoseconds>(end - job.pushed).count();
+        stats.latency_ns += latency;
+        stats.max_latency_ns = std::max(stats.max_latency_ns, latency);
+        stats.compile_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+        results.push_back({ job.key, job.serial, fn, full });
+        ready.store(results.size(), std::memory_order_release);
+        if (jobs.empty() && busy == 0)
+            idle.notify_all();
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "ir_base.h"
+#include "ir_jit_x64.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Compiles IR blocks with JitX64 on a pool of worker threads, so emulation doesn't stall
+// while hot blocks are compiled.
+//
+// Each worker has its own JitX64, and the code they produce lives until Reset, or as long as the queue.
+// Jobs carry copies of their IR, so the caller can free or replace the block meanwhile.
+// The key and serial are the caller's, and come back with the result so it can tell whether
+// the block it was compiled from is still around.
+class CompileQueue {
+public:
+    struct Result {
+        u64 key;
+        u64 serial;
+        JitX64::BlockFn fn; // nullptr if the JIT couldn't compile the block
+        bool full;          // The worker ran out of code space, the caller should Reset
+    };
+
+    struct Stats {
+        u64 queued = 0;
+        u64 compiled = 0;
+        u64 unsupported = 0;
+        u64 exhausted = 0;       // Blocks that didn't fit in their worker's code space
+        u64 resets = 0;
+        size_t peak_depth = 0;   // Most jobs waiting for a worker at once
+        u64 latency_ns = 0;      // Total time from Push to the result being ready
+        u64 max_latency_ns = 0;
+        u64 compile_ns = 0;      // Total time spent in JitX64::Compile
+        size_t code_bytes = 0;
+    };
+
+    // threads defaults to one less than the number of cores, up to 4
+    explicit CompileQueue(unsigned threads = 0);
+    ~CompileQueue(); // Jobs that haven't started are dropped
+
+    CompileQueue(const CompileQueue&) = delete;
+    CompileQueue& operator=(const CompileQueue&) = delete;
+
+    void Push(u64 key, u64 serial, u32 guest_pc, std::vector<IR_Base> ir, std::vector<u8> widths);
+
+    // Cheap enough to check before every block
+    bool Ready() const { return ready.load(std::memory_order_acquire) != 0; }
+
+    // Swaps out every result finished since the last call, oldest first. Doesn't block
+    void TakeResults(std::vector<Result>& out);
+
+    // Blocks until every job pushed so far is finished
+    void Wait();
+
+    // Drops the jobs that haven't started and every result not taken yet, waits for the rest,
+    // then frees all the code compiled so far. Every fn handed out before becomes invalid.
+    void Reset();
+
+    size_t Depth() const;
+    Stats GetStats() const;
+    size_t Threads() const { return workers.size(); }
+
+private:
+    struct Job {
+        u64 key;
+        u64 serial;
+        u32 guest_pc;
+        std::vector<IR_Base> ir;
+        std::vector<u8> widths;
+        std::chrono::steady_clock::time_point pushed;
+    };
+
+    void Worker(JitX64& jit);
+
+    mutable std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable idle;
+    std::deque<Job> jobs;
+    std::vector<Result> results;
+    std::atomic<size_t> ready { 0 }; // results.size(), readable without the lock
+    int busy = 0;
+    bool stopping = false;
+    Stats stats;
+
+    std::vector<std::unique_ptr<JitX64>> jits;
+    std::vector<std::thread> workers;
+};
@@ -1,34 +1,232 @@
 #pragma once
 
 #include "ir_base.h"
+#include "ir_passes.h"
 
-#include <map>
+#include <array>
+#include <algorithm>
+
+// Open addressed map from packed u64 keys to nodes, for sharing nodes within a block.
+// Clear() keeps the capacity, so an emitter that gets reused stops allocating.
+class SsaTable {
+    static constexpr u64 empty = ~0ull; // Never a valid key
+    std::vector<std::pair<u64, ssa>> table = std::vector<std::pair<u64, ssa>>(64, { empty, {} });
+    size_t count = 0;
+
+    ssa& Find(u64 key) {
+        size_t mask = table.size() - 1;
+        size_t i = (key * 0x9e3779b97f4a7c15) >> 32 & mask;
+        while (table[i].first != empty && table[i].first != key)
+            i = (i + 1) & mask;
+        if (table[i].first == empty) {
+            table[i] = { key, ssa { 0xffff } };
+            count++;
+        }
+        return table[i].second;
+    }
+
+    void Grow() {
+        std::vector<std::pair<u64, ssa>> old(table.size() * 2, { empty, {} });
+        std::swap(old, table);
+        count = 0;
+        for (auto [key, value] : old) {
+            if (key != empty)
+                Find(key) = value;
+        }
+    }
+
+public:
+    // The node for key, or ssa { 0xffff } if there isn't one yet, to be filled in by the caller.
+    // The reference is valid until the next lookup.
+    ssa& operator[](u64 key) {
+        if (count * 2 >= table.size())
+            Grow();
+        return Find(key);
+    }
+
+    void Clear() {
+        std::fill(table.begin(), table.end(), std::pair<u64, ssa> { empty, {} });
+        count = 0;
+    }
+};
 
 class BaseEmitter {
+    bool isConst(u16 arg) const {
+        return arg != 0xffff && buffer[arg].id == Opcode::Const;
+    }
+
+    // Evaluates operations on constants at emit time.
+    // Results must match what the interpreter would calculate, including widths.
+    std::optional<ssa> fold(const IR_Base& ir) {
+        auto value = [&] (u16 arg) -> u64 { return buffer[arg].arg_32; };
+        auto width = [&] (u16 arg) -> int { return buffer[arg].num_bits; };
+        auto mask  = [] (int w) { return 0xffffffffffffffff >> (64 - w); };
+
+        // Results have to fit back into a 32bit constant
+        auto result = [&] (u64 value, int w) -> std::optional<ssa> {
+            if (value > 0xffffffff || w > 64)
+                return {};
+            return Const(u32(value), w);
+        };
+
+        switch (ir.id) {
+        case Opcode::Ternary:
+            // Selects with a constant condition collapse to one side
+            if (isConst(ir.arg_1))
+                return ssa { u16(value(ir.arg_1) ? ir.arg_2 : ir.arg_3) };
+            if (ir.arg_2 == ir.arg_3)
+                return ssa { u16(ir.arg_2) };
+            return {};
+        case Opcode::load8:
+        case Opcode::load16:
+        case Opcode::load32:
+        case Opcode::load64:
+        case Opcode::store8:
+        case Opcode::store16:
+        case Opcode::store32:
+        case Opcode::store64: {
+            // Memory operations on a path that is never taken don't exist.
+            // Loads read as zero, like the interpreter does.
+            u16 cond = buffer[ir.arg_1].arg_3;
+            if (!isConst(cond) || value(cond) != 0)
+                return {};
+            switch (ir.id) {
+            case Opcode::load8:  return Const(0, 8);
+            case Opcode::load16: return Const(0, 16);
+            case Opcode::load32: return Const(0, 32);
+            case Opcode::load64: return Const(0, 64);
+            default:     return ssa { u16(ir.arg_3) };
+            }
+        }
+        default:
+            break;
+        }
+
+        if (ir.id > Opcode::Neq || !isConst(ir.arg_1))
+            return {};
+        if (ir.id != Opcode::Not && !isConst(ir.arg_2))
+            return {};
+        if (ir.id == Opcode::Extract && !isConst(ir.arg_3))
+            return {};
+
+        u64 a = value(ir.arg_1);
+        u64 b = ir.id == Opcode::Not ? 0 : value(ir.arg_2);
+        int w = width(ir.arg_1);
+
+        // Shifts past the operand are left for the engines, like the JIT leaves them to the interpreter
+        bool shift = ir.id == Opcode::ShiftLeft || ir.id == Opcode::ShiftRight || ir.id == Opcode::Extract;
+        if (shift && b >= 64)
+            return {};
+        if (ir.id == Opcode::ShiftRight && b >= u64(w))
+            return {};
+
+        switch (ir.id) {
+        case Opcode::Not:        return result(~a & mask(w), w);
+        case Opcode::Add:        return result((a + b) & mask(w), w);
+        case Opcode::Sub:        return result((a - b) & mask(w), w);
+        case Opcode::And:        return result(a & b, w);
+        case Opcode::Or:         return result(a | b, w);
+        case Opcode::Xor:        return result(a ^ b, w);
+        case Opcode::ShiftLeft:  return result(a << b, w + b);
+        case Opcode::ShiftRight: return result(a >> b, w - b);
+        case Opcode::Cat:        return result(b | (a << width(ir.arg_2)), w + width(ir.arg_2));
+        case Opcode::Extract:    return result((a >> b) & mask(value(ir.arg_3)), value(ir.arg_3));
+        case Opcode::Zext:       return result(a, b);
+        case Opcode::Eq:         return result(a == b, 1);
+        case Opcode::Neq:        return result(a != b, 1);
+        default:         return {};
+        }
+    }
+
+    // Pure nodes have no side effects and no dependency on memory, so identical nodes
+    // always produce identical values and can be shared.
+    static bool isPure(u16 id) {
+        return id <= Opcode::Neq || id == Opcode::Ternary;
+    }
+
 protected:
     ssa push(IR_Base&& ir) {
+        if (auto folded = fold(ir))
+            return *folded;
+
+        // Value numbering: If an identical pure node exists, reuse it.
+        // The args are already value numbered, so comparing the packed node is enough.
+        bool pure = isPure(ir.id);
+        ssa* number = nullptr;
+        if (pure) {
+            number = &value_numbers[ir.hex];
+            if (number->offset != 0xffff)
+                return *number;
+        }
+
+        // Widths are known at emit time, so they are recorded here instead of being tracked while running.
+        widths.push_back(NodeWidth(buffer, widths, ir));
         buffer.push_back(std::move(ir));
-        return { u16(buffer.size() - 1) };
+        ssa result = { u16(buffer.size() - 1) };
+
+        if (pure)
+            *number = result;
+        return result;
     }
 
-    std::map<u64, ssa> consts_cache;
+    SsaTable value_numbers;
+
+    // Constants are shared within a block. Small ones of the common widths (register offsets,
+    // Extract/Zext widths, flag values) are found without hashing, the rest go in an
+    // open addressed table of (value | bits << 32) keys.
+    static constexpr u32 small_const_limit = 64;
+
+    static int SmallConstWidth(int bits) {
+        switch (bits) {
+        case 1:  return 0;
+        case 8:  return 1;
+        case 16: return 2;
+        case 24: return 3;
+        case 32: return 4;
+        case 64: return 5;
+        default: return -1;
+        }
+    }
+
+    std::array<ssa, 6 * small_const_limit> small_consts;
+    SsaTable consts;
 
 public:
     std::vector<IR_Base> buffer;
+    std::vector<u8> widths; // Width in bits of every node in buffer, 0 for nodes without a value
     bool ending = false;
 
     std::optional<ssa> zero_lower; // Bit of a hack to make emitting 16bit zero flag checks easier
 
-    ssa Const(u32 a, int bits) {
-         // Cache constants to make our IR smaller
-        u64 index = a | u64(bits) << 32;
+    BaseEmitter() {
+        small_consts.fill(ssa { 0xffff });
+    }
+
+    // Starts a new block, keeping the capacity of everything
+    void Reset() {
+        buffer.clear();
+        widths.clear();
+        value_numbers.Clear();
+        consts.Clear();
+        small_consts.fill(ssa { 0xffff });
+        ending = false;
+        zero_lower.reset();
+    }
 
-        if (consts_cache.find(index) != consts_cache.end()) {
-            return consts_cache[index];
+    ssa Const(u32 a, int bits) {
+        // Cache constants to make our IR smaller
+        int small = SmallConstWidth(bits);
+        if (small >= 0 && a < small_const_limit) {
+            ssa& slot = small_consts[small * small_const_limit + a];
+            if (slot.offset == 0xffff)
+                slot = push(IR_Const<false>(a, bits));
+            return slot;
         }
-        ssa constant = push(IR_Const<false>(a, bits));
-        consts_cache[index] = constant;
-        return constant;
+
+        ssa& slot = consts[a | u64(bits) << 32];
+        if (slot.offset == 0xffff)
+            slot = push(IR_Const<false>(a, bits));
+        return slot;
     }
 
     template<u8 bits>
@@ -100,6 +298,13 @@ public:
     }
 
     ssa Ternary(ssa cond, ssa a, ssa b) {
+        // Both sides need the same width. When they differ (like A with an unknown M flag)
+        // the narrow side is zero extended, which doesn't change its value.
+        u8 wa = widths[a.offset], wb = widths[b.offset];
+        if (wa && wb && wa < wb)
+            a = push(IR_Zext(a, Const<32>(wb)));
+        else if (wa && wb && wb < wa)
+            b = push(IR_Zext(b, Const<32>(wa)));
         return push(IR_Ternary(cond, a, b));
     }
     ssa Neq(ssa a, ssa b) {
@@ -1,32 +1,30 @@
 #include "ir_base.h"
+#include "ir_trace.h"
 
 #include <vector>
 #include <cassert>
 #include <array>
 #include <stdio.h>
+#include <optional>
 
-std::array<u64, 32> registers;
-std::array<u8, 0xffff> memory;
-
-// Allows us to interpte an incomplete IR list, continuing it as it is built.
-void partial_interpret(std::vector<IR_Base> irlist, std::vector<u64> &ssalist, std::vector<u8> &ssatype, int offset) {
+template<TraceLevel level>
+static void partial_interpret_impl(const std::vector<IR_Base> &irlist, const std::vector<u8> &widths, std::vector<u64> &ssalist, int offset,
+                                   u64* regs, u8* mem) {
     ssalist.resize(irlist.size());
-    ssatype.resize(irlist.size());
 
-    bool print = true;
+    constexpr bool trace = level >= TraceLevel::IR;
 
     for (int i=offset; i < irlist.size(); i++) {
 
 
 
-        auto write = [&] (u64 value, u8 type) {
+        auto write = [&] (u64 value) {
             ssalist[i] = value;
-            ssatype[i] = type;
         };
 
 
         auto ir = irlist[i];
-        u8 width = ssatype[ir.arg_1];
+        u8 width = widths[i]; // Checked by VerifyWidths when the block was emitted
 
         auto mem_address = [&] () {
             // TODO: This only works with raw memory
@@ -38,12 +36,12 @@ void partial_interpret(std::vector<IR_Base> irlist, std::vector<u64> &ssalist, s
             int mem_type = ssalist[mem_ir.arg_1];
 
             if (mem_type == 0) {
-                return (void *)(&registers[offset]);
+                return (void *)(&regs[offset]);
             }
             if (mem_type == 1) {
                 assert(offset <= 0xffff);
                 u64 address = ssalist[ir.arg_1];
-                return (void*)(&memory[offset]);
+                return (void*)(&mem[offset]);
             }
 
             assert(false);
@@ -54,115 +52,77 @@ void partial_interpret(std::vector<IR_Base> irlist, std::vector<u64> &ssalist, s
             return ssalist[mem_ir.arg_3];
         };
 
-        auto printarg = [&] (u16 arg) {
-            // exclude null args
-            if (arg == 0xffff) return;
-
-            auto ir = irlist[arg];
-
-            if (ir.is<IR_Const32>()) {
-                auto value = ir.cast<IR_Const32>();
-                printf(" ssa%i-%c%i(%i)", arg, value->is_signed ? 's' : 'u', value->num_bits, value->arg_32);
-            }
-            else {
-                printf(" ssa%i", arg);
-            }
-        };
-
-        if (print) {
-            if (ir.id < 0x8000) {
-                printf("% 5i: %s", i, OpcodeName(ir.id));
-                printarg(ir.arg_1);
-                printarg(ir.arg_2);
-                printarg(ir.arg_3);
-                //printf("\n");
-            } else if (ir.id == 0x8000) {
-                printf("const48 %x\n", ir.arg_48);
-            } else if (ir.id == Const) {
-                // Don't print consts, because printarg inlines them
-                printf("% 5i: const%i %x", i, ir.num_bits, ir.arg_32);
-            }
-        }
-
         switch(ir.id) {
         case Not: { // ~A
             u64 mask = 0xffffffffffffffff >> (64 - width);
-            write((~ssalist[ir.arg_1]) & mask, width);
+            write((~ssalist[ir.arg_1]) & mask);
             break;
         }
         case Add: { // A + B
-            //assert(width == ssatype[ir.arg_2]);
             u64 mask =  0xffffffffffffffff >> (64 - width);
-            write((ssalist[ir.arg_1] + ssalist[ir.arg_2]) & mask, width);
+            write((ssalist[ir.arg_1] + ssalist[ir.arg_2]) & mask);
             break;
         }
         case Sub: { // A - B
-            assert(width == ssatype[ir.arg_2]);
             u64 mask =  0xffffffffffffffff >> (64 - width);
             u64 value = ssalist[ir.arg_1] - ssalist[ir.arg_2];
-            write(value & mask, width);
+            write(value & mask);
             break;
         }
         case And: {// A & B
-            assert(width == ssatype[ir.arg_2]);
-            write(ssalist[ir.arg_1] & ssalist[ir.arg_2], width);
+            write(ssalist[ir.arg_1] & ssalist[ir.arg_2]);
             break;
         }
         case Or: { // A | B
-            assert(width == ssatype[ir.arg_2]);
-            write(ssalist[ir.arg_1] | ssalist[ir.arg_2], width);
+            write(ssalist[ir.arg_1] | ssalist[ir.arg_2]);
             break;
         }
         case Xor: {// A ^ B
-            assert(width == ssatype[ir.arg_2]);
-            write(ssalist[ir.arg_1] ^ ssalist[ir.arg_2], width);
+            write(ssalist[ir.arg_1] ^ ssalist[ir.arg_2]);
             break;
         }
         case ShiftLeft: { // A << b OR A >> -b
             int shift = ssalist[ir.arg_2];
-            write(ssalist[ir.arg_1] << shift, width + shift);
+            write(ssalist[ir.arg_1] << shift);
             break;
         }
         case ShiftRight: { // A << b OR A >> -b
             int shift = ssalist[ir.arg_2];
-            write(ssalist[ir.arg_1] >> shift, width - shift);
+            write(ssalist[ir.arg_1] >> shift);
             break;
         }
         case Cat: { // A << sizeof(B) | B
-            int width2 = ssatype[ir.arg_2];
+            int width2 = widths[ir.arg_2];
             u64 a = ssalist[ir.arg_1];
             u64 b = ssalist[ir.arg_2];
-            write(b | (a << width2), width + width2);
+            write(b | (a << width2));
             break;
         }
         case Extract: { // (A >> B) & mask(C)
             int shift = ssalist[ir.arg_2];
             int out_width = ssalist[ir.arg_3];
-            assert(width >= out_width + shift);
             u64 mask = 0xffffffffffffffff >> (64 - out_width);
             u64 a = ssalist[ir.arg_1];
-            write((a >> shift) & mask, out_width);
+            write((a >> shift) & mask);
             break;
         }
         case Zext: {
-            write(ssalist[ir.arg_1], ssalist[ir.arg_2]);
+            write(ssalist[ir.arg_1]);
             break;
         }
         case Eq: { // A == B
-            assert(width <= ssatype[ir.arg_2]);
-            write(ssalist[ir.arg_1] == ssalist[ir.arg_2], 1);
+            write(ssalist[ir.arg_1] == ssalist[ir.arg_2]);
             break;
         }
         case Neq: { // A != B
-            assert(width <= ssatype[ir.arg_2]);
-            write(ssalist[ir.arg_1] != ssalist[ir.arg_2], 1);
+            write(ssalist[ir.arg_1] != ssalist[ir.arg_2]);
             break;
         }
         case Ternary: { // condition, true, false
             if (ssalist[ir.arg_1] != 0) {
-                write(ssalist[ir.arg_2], ssatype[ir.arg_2]);
+                write(ssalist[ir.arg_2]);
             } else {
-                write(ssalist[ir.arg_3], ssatype[ir.arg_3]);
+                write(ssalist[ir.arg_3]);
             }
             break;
         }
@@ -170,7 +130,7 @@ void partial_interpret(std::vector<IR_Base> irlist, std::vector<u64> &ssalist, s
             // Not needed during interpretation.
             break;
         case Const: // 8: num_bits, 8: is_signed, 32: data
-            write(ir.arg_32, ir.num_bits);
+            write(ir.arg_32);
             break;
 
         case memState:
@@ -180,68 +140,64 @@ void partial_interpret(std::vector<IR_Base> irlist, std::vector<u64> &ssalist, s
         case load8: { // mem, offset
             if (mem_cond()) {
                 u64 value = *(u8*)(mem_address());
-                write(value, 8);
+                write(value);
             } else {
-                write(0, 8);
+                write(0);
             }
             break;
         }
         case load16: { // mem, offset
             if (mem_cond()) {
                 u64 value = *(u16*)(mem_address());
-                write(value, 16);
+                write(value);
             } else {
-                write(0, 16);
+                write(0);
             }
             break;
         }
         case load32: { // mem, offset
             if (mem_cond()) {
                 u64 value = *(u32*)(mem_address());
-                write(value, 32);
+                write(value);
             } else {
-                write(0, 32);
+                write(0);
             }
             break;
         }
         case load64: { // mem, offset
             if (mem_cond()) {
                 u64 value = *(u64*)(mem_address());
-                write(value, 64);
+                write(value);
             } else {
-                write(0, 64);
+                write(0);
             }
             break;
         }
         case store8: { // mem, offset, data
             if (mem_cond()) {
-                assert(ssatype[ir.arg_3] == 8);
                 *(u8*)(mem_address())  = ssalist[ir.arg_3];
-                write(ssalist[ir.arg_3], 8); // for debugging only
+                write(ssalist[ir.arg_3]); // for debugging only
             }
             break;
         }
         case store16: { // mem, offset, data
             if (mem_cond()) {
-                assert(ssatype[ir.arg_3] == 16);
                 *(u16*)(mem_address()) = ssalist[ir.arg_3];
-                write(ssalist[ir.arg_3], 16); // for debugging only
+                write(ssalist[ir.arg_3]); // for debugging only
             }
             break;
         }
         case store32: { // mem, offset, data
             if (mem_cond()) {
-                assert(ssatype[ir.arg_3] == 32);
                 *(u32*)(mem_address()) = ssalist[ir.arg_3];
-                write(ssalist[ir.arg_3], 32); // for debugging only
+                write(ssalist[ir.arg_3]); // for debugging only
             }
             break;
         }
         case store64: { // mem, offset, data
             if (mem_cond()) {
-                //assert(ssatype[ir.arg_3] == 64);
                 *(u64*)(mem_address()) = ssalist[ir.arg_3];
-                write(ssalist[ir.arg_3], 64); // for debugging only
+                write(ssalist[ir.arg_3]); // for debugging only
             }
             break;
         }
@@ -250,14 +206,135 @@ void partial_interpret(std::vector<IR_Base> irlist, std::vector<u64> &ssalist, s
             assert(false); // Not implemented
         }
 
-        if (print)
-            printf(" = %x:%i\n", ssalist[i], ssatype[i]);
+        if constexpr (trace) {
+            TraceNode record;
+            record.width = widths[i];
+            record.id = ir.id;
+            record.index = i;
+            record.args[0] = ir.arg_1;
+            record.args[1] = ir.arg_2;
+            record.args[2] = ir.arg_3;
+            record.value = ssalist[i];
+            trace_sink.Write(record);
+        }
+    }
+}
+
+// Allows us to interpte an incomplete IR list, continuing it as it is built.
+void partial_interpret(const std::vector<IR_Base> &irlist, const std::vector<u8> &widths, std::vector<u64> &ssalist, int offset,
+                       u64* regs, u8* mem) {
+    partial_interpret_impl<trace_level>(irlist, widths, ssalist, offset, regs, mem);
+}
+
+static bool evaluate_node(const std::vector<IR_Base> &irlist, u16 i, std::vector<u64> &ssalist, std::vector<u8> &ssatype,
+                          const EvaluateLoadFn &load) {
+    if (ssatype[i] != 0)
+        return true;
+
+    auto ir = irlist[i];
+    if (ir.id == Const) {
+        ssalist[i] = ir.arg_32;
+        ssatype[i] = ir.num_bits;
+        return true;
     }
+    bool is_load = ir.id >= load64 && ir.id <= load8;
+    if (ir.id > Neq && ir.id != Ternary && !is_load)
+        return false;
+
+    // Operands first. Loads check their memState themselves
+    u16 args[] = { u16(ir.arg_1), u16(ir.arg_2), u16(ir.arg_3) };
+    for (int n = is_load ? 1 : 0; n < 3; n++) {
+        if (args[n] != 0xffff && !evaluate_node(irlist, args[n], ssalist, ssatype, load))
+            return false;
+    }
+
+    u8 width = ssatype[ir.arg_1];
+    u64 a = ssalist[ir.arg_1];
+    u64 b = ir.arg_2 != 0xffff ? ssalist[ir.arg_2] : 0;
+    auto mask = [] (int w) { return 0xffffffffffffffff >> (64 - w); };
+
+    // Same as BaseEmitter::fold, shifts past the operand aren't worked out ahead of time
+    bool shift = ir.id == ShiftLeft || ir.id == ShiftRight || ir.id == Extract;
+    if ((shift && b >= 64) || (ir.id == ShiftRight && b >= width) || (ir.id == ShiftLeft && width + b > 64))
+        return false;
+
+    auto write = [&] (u64 value, u8 type) {
+        ssalist[i] = value;
+        ssatype[i] = type;
+        return true;
+    };
+
+    switch (ir.id) {
+    case Not:        return write(~a & mask(width), width);
+    case Add:        return write((a + b) & mask(width), width);
+    case Sub:        return write((a - b) & mask(width), width);
+    case And:        return write(a & b, width);
+    case Or:         return write(a | b, width);
+    case Xor:        return write(a ^ b, width);
+    case ShiftLeft:  return write(a << b, width + b);
+    case ShiftRight: return write(a >> b, width - b);
+    case Cat:        return write(b | (a << ssatype[ir.arg_2]), width + ssatype[ir.arg_2]);
+    case Extract: {
+        int out_width = ssalist[ir.arg_3];
+        return write((a >> b) & mask(out_width), out_width);
+    }
+    case Zext:       return write(a, b);
+    case Eq:         return write(a == b, 1);
+    case Neq:        return write(a != b, 1);
+    case Ternary:    return write(a ? b : ssalist[ir.arg_3], a ? ssatype[ir.arg_2] : ssatype[ir.arg_3]);
+    case load8:
+    case load16:
+    case load32:
+    case load64: {
+        auto mem_ir = irlist[ir.arg_1];
+        if (!evaluate_node(irlist, mem_ir.arg_1, ssalist, ssatype, load))
+            return false;
+        if (!evaluate_node(irlist, mem_ir.arg_3, ssalist, ssatype, load))
+            return false;
+
+        int bits = 8 << (load8 - ir.id);
+        u64 value = 0;
+        if (ssalist[mem_ir.arg_3]) {
+            auto loaded = load(ssalist[mem_ir.arg_1], b, bits);
+            if (!loaded)
+                return false;
+            value = *loaded & mask(bits);
+        }
+        return write(value, bits);
+    }
+    default:
+        return false;
+    }
+}
+
+// Works out the value of a single node ahead of time, without running the rest of the block.
+// Only pure nodes and loads that the load function knows about can be evaluated, so this has no side effects.
+std::optional<u64> evaluate(const std::vector<IR_Base> &irlist, ssa node, const EvaluateLoadFn &load) {
+    // Emitting a block evaluates PC after every instruction, which is almost always a constant
+    if (irlist[node.offset].id == Const)
+        return irlist[node.offset].arg_32;
+
+    // Reused between calls, only the types need clearing
+    static thread_local std::vector<u64> ssalist;
+    static thread_local std::vector<u8> ssatype;
+    ssalist.resize(irlist.size());
+    ssatype.assign(irlist.size(), 0);
+
+    if (evaluate_node(irlist, node.offset, ssalist, ssatype, load))
+        return ssalist[node.offset];
+    return {};
+}
+
+std::optional<u64> evaluate(const std::vector<IR_Base> &irlist, ssa node, const u64* regs) {
+    return evaluate(irlist, node, [regs] (u64 space, u64 offset, int) -> std::optional<u64> {
+        if (space != 0)
+            return {};
+        return regs[offset];
+    });
 }
 
-void interpret(std::vector<IR_Base> ir) {
+void interpret(const std::vector<IR_Base> &ir, const std::vector<u8> &widths, u64* regs, u8* mem) {
     std::vector<u64> ssalist;
-    std::vector<u8> ssatype;
 
-    partial_interpret(ir, ssalist, ssatype, 0);
+    partial_interpret(ir, widths, ssalist, 0, regs, mem);
 }
\ No newline at end of file
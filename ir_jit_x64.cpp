@@ -0,0 +1,611 @@
+#include "ir_jit_x64.h"
+#include "ir_passes.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <algorithm>
+#include <mutex>
+
+namespace {
+
+enum HostReg : u8 {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3, // slots
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11,
+    R12 = 12, // registers
+    R13 = 13, // memory
+    R14 = 14,
+    R15 = 15,
+};
+
+// Where JitX64::pinned registers live, in order. Nothing is called from JIT code, so the caller
+// saved ones are free once the arguments have been moved out of rsi and rdi.
+constexpr HostReg pin_regs[JitX64::max_pinned] = { R8, R9, R10, R11, RSI, RDI, R14, R15 };
+
+enum Cond : u8 {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+};
+
+// Just enough of an x86-64 assembler for lowering IR nodes
+struct Assembler {
+    std::vector<u8> buf;
+
+    void byte(u8 b) { buf.push_back(b); }
+    void dword(u32 d) { for (int i = 0; i < 4; i++) byte(d >> (i * 8)); }
+    void qword(u64 q) { for (int i = 0; i < 8; i++) byte(q >> (i * 8)); }
+
+    void rex(bool w, u8 reg, u8 rm) {
+        u8 prefix = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (prefix != 0x40)
+            byte(prefix);
+    }
+    void modrm(u8 mod, u8 reg, u8 rm) { byte(mod << 6 | (reg & 7) << 3 | (rm & 7)); }
+
+    // mov r, [rbx + slot * 8]
+    void load_slot(u8 r, u16 slot) { rex(true, r, RBX); byte(0x8b); modrm(2, r, RBX); dword(slot * 8); }
+    // mov [rbx + slot * 8], r
+    void store_slot(u16 slot, u8 r) { rex(true, r, RBX); byte(0x89); modrm(2, r, RBX); dword(slot * 8); }
+
+    void mov_imm(u8 r, u64 value) {
+        if (value <= 0xffffffff) {
+            rex(false, 0, r); byte(0xb8 + (r & 7)); dword(value); // zero extends
+        } else {
+            rex(true, 0, r); byte(0xb8 + (r & 7)); qword(value);
+        }
+    }
+    void mov(u8 dst, u8 src) { rex(true, src, dst); byte(0x89); modrm(3, src, dst); }
+
+    // [base + disp32]. rsp and r12 bases need a SIB byte
+    void mem(u8 reg, u8 base, s32 disp) { modrm(2, reg, base); if ((base & 7) == 4) byte(0x24); dword(disp); }
+    // mov r, [base + disp]
+    void load(u8 r, u8 base, s32 disp) { rex(true, r, base); byte(0x8b); mem(r, base, disp); }
+    // mov [base + disp], r
+    void store(u8 base, s32 disp, u8 r) { rex(true, r, base); byte(0x89); mem(r, base, disp); }
+    // cmp r, [base + disp]
+    void cmp_mem(u8 r, u8 base, s32 disp) { rex(true, r, base); byte(0x3b); mem(r, base, disp); }
+    // sub [base + disp], r
+    void sub_mem(u8 base, s32 disp, u8 r) { rex(true, r, base); byte(0x29); mem(r, base, disp); }
+    // inc qword [base + disp]
+    void inc_mem(u8 base, s32 disp) { rex(true, 0, base); byte(0xff); mem(0, base, disp); }
+    // mov qword [base + disp], imm32 (sign extended)
+    void store_imm(u8 base, s32 disp, u32 imm) { rex(true, 0, base); byte(0xc7); mem(0, base, disp); dword(imm); }
+    // cmp byte [base + disp], imm8
+    void cmp_byte(u8 base, s32 disp, u8 imm) { rex(false, 0, base); byte(0x80); mem(7, base, disp); byte(imm); }
+    // cmp [base + disp], r
+    void cmp_mem_r(u8 base, s32 disp, u8 r) { rex(true, r, base); byte(0x39); mem(r, base, disp); }
+
+    // op dst, src
+    void alu(u8 op, u8 dst, u8 src) { rex(true, src, dst); byte(op); modrm(3, src, dst); }
+    void add(u8 dst, u8 src) { alu(0x01, dst, src); }
+    void or_(u8 dst, u8 src) { alu(0x09, dst, src); }
+    void and_(u8 dst, u8 src) { alu(0x21, dst, src); }
+    void sub(u8 dst, u8 src) { alu(0x29, dst, src); }
+    void xor_(u8 dst, u8 src) { alu(0x31, dst, src); }
+    void cmp(u8 dst, u8 src) { alu(0x39, dst, src); }
+    void test(u8 dst, u8 src) { alu(0x85, dst, src); }
+
+    void not_(u8 r) { rex(true, 0, r); byte(0xf7); modrm(3, 2, r); }
+    void shl(u8 r, u8 n) { rex(true, 0, r); byte(0xc1); modrm(3, 4, r); byte(n); }
+    void shr(u8 r, u8 n) { rex(true, 0, r); byte(0xc1); modrm(3, 5, r); byte(n); }
+
+    // Truncate r to the low `bits` bits. Uses rdx when the mask doesn't fit in an immediate
+    void mask(u8 r, int bits) {
+        if (bits >= 64)
+            return;
+        if (bits == 32) {
+            rex(false, r, r); byte(0x89); modrm(3, r, r); // mov r32, r32
+        } else if (bits < 32) {
+            rex(true, 0, r); byte(0x81); modrm(3, 4, r); dword((1u << bits) - 1); // and r, imm32
+        } else {
+            mov_imm(RDX, 0xffffffffffffffff >> (64 - bits));
+            and_(r, RDX);
+        }
+    }
+
+    // setcc al; movzx eax, al
+    void setcc(u8 cc) { byte(0x0f); byte(0x90 + cc); byte(0xc0); byte(0x0f); byte(0xb6); byte(0xc0); }
+    // cmovz dst, src
+    void cmovz(u8 dst, u8 src) { rex(true, dst, src); byte(0x0f); byte(0x44); modrm(3, dst, src); }
+
+    // jcc rel32, returns the location to patch
+    size_t jcc(u8 cc) { byte(0x0f); byte(0x80 + cc); dword(0); return buf.size(); }
+    // jmp rel32, returns the location to patch
+    size_t jmp() { byte(0xe9); dword(0); return buf.size(); }
+    void patch(size_t location) { patch(location, buf.size()); }
+    void patch(size_t location, size_t target) {
+        u32 rel = target - location;
+        memcpy(&buf[location - 4], &rel, 4);
+    }
+
+    void push(u8 r) { rex(false, 0, r); byte(0x50 + (r & 7)); }
+    void pop(u8 r) { rex(false, 0, r); byte(0x58 + (r & 7)); }
+    void ret() { byte(0xc3); }
+    void ud2() { byte(0x0f); byte(0x0b); }
+};
+
+// Every JitX64 writes to the same map, CompileQueue workers included
+struct PerfMap {
+    std::mutex lock;
+    FILE* file = nullptr;
+} perf_map;
+
+bool PerfMapEnabled() {
+    std::lock_guard<std::mutex> guard(perf_map.lock);
+    return perf_map.file != nullptr;
+}
+
+// perf can't be told an address range holds something else now. With the map on, code addresses
+// stay reserved (with nothing behind them) once their code is gone, so nothing else lands there.
+void ReleaseCode(u8* code, size_t capacity) {
+    if (PerfMapEnabled())
+        mmap(code, capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    else
+        munmap(code, capacity);
+}
+
+// Maps capacity bytes twice, from the same anonymous file. Returns false if that fails
+bool MapRegion(size_t capacity, u8*& code, u8*& writable) {
+    int fd = memfd_create("firesnes-jit", MFD_CLOEXEC);
+    bool mapped = false;
+    if (fd >= 0 && ftruncate(fd, capacity) == 0) {
+        void* rw = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        void* rx = mmap(nullptr, capacity, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        if (rw != MAP_FAILED && rx != MAP_FAILED) {
+            writable = (u8*)rw;
+            code = (u8*)rx;
+            mapped = true;
+        } else {
+            if (rw != MAP_FAILED)
+                munmap(rw, capacity);
+            if (rx != MAP_FAILED)
+                munmap(rx, capacity);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return mapped;
+}
+
+} // namespace
+
+JitX64::JitX64(size_t capacity) {
+    if (MapRegion(capacity, code, writable))
+        this->capacity = capacity;
+}
+
+JitX64::~JitX64() {
+    if (code) {
+        ReleaseCode(code, capacity);
+        munmap(writable, capacity);
+    }
+}
+
+void JitX64::Reset() {
+    // With the perf map on, new code goes somewhere the map hasn't listed yet
+    if (code && PerfMapEnabled()) {
+        ReleaseCode(code, capacity);
+        munmap(writable, capacity);
+        code = writable = nullptr;
+        if (!MapRegion(capacity, code, writable))
+            capacity = 0;
+    }
+
+    used = 0;
+    full = false;
+    stats.resets++;
+}
+
+void JitX64::EnablePerfMap() {
+    std::lock_guard<std::mutex> guard(perf_map.lock);
+    if (perf_map.file)
+        return;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    perf_map.file = fopen(path, "w");
+}
+
+JitX64::BlockFn JitX64::Compile(const std::vector<IR_Base>& ir, const std::vector<u8>& width, u32 guest_pc,
+                                const ChainSpec* chain, Chained* where) {
+    if (!code) {
+        stats.unsupported++;
+        return nullptr;
+    }
+
+    Assembler a;
+
+    auto is_const = [&] (u16 arg) { return ir[arg].id == Const; };
+    auto operand = [&] (u8 r, u16 arg) {
+        if (is_const(arg))
+            a.mov_imm(r, ir[arg].arg_32);
+        else
+            a.load_slot(r, arg);
+    };
+
+    // Leaves the host address of a memory operation in rcx
+    auto address = [&] (const IR_Base& node) {
+        const IR_Base& mem = ir[node.arg_1];
+        operand(RCX, node.arg_2);
+        if (ir[mem.arg_1].arg_32 == 0) {
+            // Register file is an array of u64
+            a.shl(RCX, 3);
+            a.add(RCX, R12);
+        } else {
+            // Same bounds as the interpreter's assert
+            a.mov_imm(RDX, 0xffff);
+            a.cmp(RCX, RDX);
+            a.byte(0x76); a.byte(0x02); // jbe +2
+            a.ud2();
+            a.add(RCX, R13);
+        }
+    };
+
+    // Memory operations are skipped when their memState condition is false.
+    // Returns the jump to patch, if the condition isn't constant
+    auto skip_unless_enabled = [&] (const IR_Base& node) -> size_t {
+        u16 cond = ir[node.arg_1].arg_3;
+        if (is_const(cond))
+            return 0;
+        operand(RDX, cond);
+        a.test(RDX, RDX);
+        return a.jcc(CC_E);
+    };
+
+    // Register file entries held in host registers, see pinned
+    auto pinned_reg = [&] (const IR_Base& node) -> int {
+        const IR_Base& mem = ir[node.arg_1];
+        if (ir[mem.arg_1].arg_32 != 0 || !is_const(node.arg_2))
+            return -1;
+        for (size_t n = 0; n < pinned.size(); n++) {
+            if (pinned[n] == ir[node.arg_2].arg_32)
+                return pin_regs[n];
+        }
+        return -1;
+    };
+    auto spill = [&] {
+        for (size_t n = 0; n < pinned.size(); n++)
+            a.store(R12, pinned[n] * 8, pin_regs[n]);
+    };
+    auto reload = [&] {
+        for (size_t n = 0; n < pinned.size(); n++)
+            a.load(pin_regs[n], R12, pinned[n] * 8);
+    };
+
+    // The chain checks read the register file, so they can't use pinned registers
+    auto is_pinned = [&] (int reg) { return std::find(pinned.begin(), pinned.end(), reg) != pinned.end(); };
+    if (chain) {
+        bool checks_pinned = is_pinned(chain->cycle) || is_pinned(chain->retired);
+        for (const RegTest& test : chain->entry)
+            checks_pinned |= is_pinned(test.reg);
+        for (const auto& tests : chain->exits) {
+            for (const RegTest& test : tests)
+                checks_pinned |= is_pinned(test.reg);
+        }
+        if (checks_pinned || pinned.size() > max_pinned) {
+            stats.unsupported++;
+            return nullptr;
+        }
+    }
+
+    // ChainState lives just before the slots
+    auto state = [] (size_t offset) { return s32(offset - sizeof(ChainState)); };
+
+    // Jumps to the location returned if the test fails
+    auto reg_test = [&] (const RegTest& test) {
+        a.load(RAX, R12, test.reg * 8);
+        if (test.mask != ~u64(0)) {
+            a.mov_imm(RCX, test.mask);
+            a.and_(RAX, RCX);
+        }
+        a.mov_imm(RCX, test.value);
+        a.cmp(RAX, RCX);
+        return a.jcc(test.equal ? CC_NE : CC_E);
+    };
+
+    // Prologue: (slots, regs, mem) arrive in rdi, rsi, rdx
+    a.push(RBX);
+    a.push(R12);
+    a.push(R13);
+    a.push(R14);
+    a.push(R15);
+    a.mov(RBX, RDI);
+    a.mov(R12, RSI);
+    a.mov(R13, RDX);
+    reload();
+
+    // Other blocks jump in here with everything already set up, and the chain entry checks
+    // anything the caller would have
+    std::vector<size_t> bail;
+    size_t entry = 0;
+    if (chain) {
+        size_t body = a.jmp();
+        entry = a.buf.size();
+
+        a.load(RAX, RBX, state(offsetof(ChainState, instructions_left)));
+        a.mov_imm(RCX, chain->instructions);
+        a.cmp(RAX, RCX);
+        bail.push_back(a.jcc(CC_B));
+        a.load(RAX, R12, chain->cycle * 8);
+        a.cmp_mem(RAX, RBX, state(offsetof(ChainState, cycle_limit)));
+        bail.push_back(a.jcc(CC_AE));
+        for (const RegTest& test : chain->entry)
+            bail.push_back(reg_test(test));
+
+        // Runs of guard bytes are compared 8 at a time
+        std::vector<std::pair<u32, u8>> guards;
+        for (auto [address, value] : chain->guards)
+            guards.emplace_back(address & 0xffff, value);
+        std::sort(guards.begin(), guards.end());
+        guards.erase(std::unique(guards.begin(), guards.end()), guards.end());
+        for (size_t i = 0; i < guards.size();) {
+            size_t run = 1;
+            while (run < 8 && i + run < guards.size() && guards[i + run].first == guards[i].first + run)
+                run++;
+            if (run == 8) {
+                u64 bytes = 0;
+                for (size_t j = 0; j < 8; j++)
+                    bytes |= u64(guards[i + j].second) << (j * 8);
+                a.mov_imm(RAX, bytes);
+                a.cmp_mem_r(R13, guards[i].first, RAX);
+                bail.push_back(a.jcc(CC_NE));
+                i += 8;
+            } else {
+                a.cmp_byte(R13, guards[i].first, guards[i].second);
+                bail.push_back(a.jcc(CC_NE));
+                i++;
+            }
+        }
+
+        a.inc_mem(RBX, state(offsetof(ChainState, chained)));
+        a.patch(body);
+    }
+
+    for (size_t i = 0; i < ir.size(); i++) {
+        const IR_Base& node = ir[i];
+        u16 slot = i;
+
+        switch (node.id) {
+        case Const:
+        case memState:
+        case Assert: // Not needed during execution, same as the interpreter
+            continue;
+
+        case Not:
+            operand(RAX, node.arg_1);
+            a.not_(RAX);
+            a.mask(RAX, width[i]);
+            break;
+        case Add:
+        case Sub:
+        case And:
+        case Or:
+        case Xor:
+            operand(RAX, node.arg_1);
+            operand(RCX, node.arg_2);
+            switch (node.id) {
+            case Add: a.add(RAX, RCX); a.mask(RAX, width[i]); break;
+            case Sub: a.sub(RAX, RCX); a.mask(RAX, width[i]); break;
+            case And: a.and_(RAX, RCX); break;
+            case Or:  a.or_(RAX, RCX); break;
+            case Xor: a.xor_(RAX, RCX); break;
+            }
+            break;
+        case ShiftLeft:
+        case ShiftRight:
+        case Extract:
+            // Shift amounts are encoded as immediates
+            if (!is_const(node.arg_2) || ir[node.arg_2].arg_32 >= 64) {
+                stats.unsupported++;
+                return nullptr;
+            }
+            operand(RAX, node.arg_1);
+            if (node.id == ShiftLeft)
+                a.shl(RAX, ir[node.arg_2].arg_32);
+            else
+                a.shr(RAX, ir[node.arg_2].arg_32);
+            if (node.id == Extract)
+                a.mask(RAX, width[i]);
+            break;
+        case Cat:
+            operand(RAX, node.arg_1);
+            operand(RCX, node.arg_2);
+            if (width[node.arg_2] < 64)
+                a.shl(RAX, width[node.arg_2]);
+            else
+                a.mov_imm(RAX, 0);
+            a.or_(RAX, RCX);
+            break;
+        case Zext:
+            operand(RAX, node.arg_1);
+            break;
+        case Eq:
+        case Neq:
+            operand(RAX, node.arg_1);
+            operand(RCX, node.arg_2);
+            a.cmp(RAX, RCX);
+            a.setcc(node.id == Eq ? CC_E : CC_NE);
+            break;
+        case Ternary:
+            operand(RDX, node.arg_1);
+            operand(RAX, node.arg_2);
+            operand(RCX, node.arg_3);
+            a.test(RDX, RDX);
+            a.cmovz(RAX, RCX);
+            break;
+
+        case load8:
+        case load16:
+        case load32:
+        case load64: {
+            a.mov_imm(RAX, 0); // Disabled loads read as zero
+            size_t skip = skip_unless_enabled(node);
+            if (int host = pinned_reg(node); host >= 0) {
+                a.mov(RAX, host);
+                a.mask(RAX, 8 << (load8 - node.id));
+                stats.pinned++;
+                if (skip)
+                    a.patch(skip);
+                break;
+            }
+
+            // Register file entries the block computes might be pinned
+            bool sync = ir[ir[node.arg_1].arg_1].arg_32 == 0 && !is_const(node.arg_2) && !pinned.empty();
+            if (sync)
+                spill();
+            address(node);
+            switch (node.id) {
+            case load8:  a.byte(0x0f); a.byte(0xb6); a.byte(0x01); break; // movzx eax, byte [rcx]
+            case load16: a.byte(0x0f); a.byte(0xb7); a.byte(0x01); break; // movzx eax, word [rcx]
+            case load32: a.byte(0x8b); a.byte(0x01); break;               // mov eax, [rcx]
+            case load64: a.byte(0x48); a.byte(0x8b); a.byte(0x01); break; // mov rax, [rcx]
+            }
+            if (sync)
+                reload();
+            if (skip)
+                a.patch(skip);
+            break;
+        }
+        case store8:
+        case store16:
+        case store32:
+        case store64: {
+            size_t skip = skip_unless_enabled(node);
+            if (int host = pinned_reg(node); host >= 0) {
+                operand(RAX, node.arg_3);
+                if (node.id == store64) {
+                    a.mov(host, RAX);
+                } else {
+                    // Only the low bytes change, like a store to the register file
+                    int bits = 8 << (store8 - node.id);
+                    a.mask(RAX, bits);
+                    a.mov_imm(RCX, ~(0xffffffffffffffff >> (64 - bits)));
+                    a.and_(RCX, host);
+                    a.or_(RCX, RAX);
+                    a.mov(host, RCX);
+                }
+                stats.pinned++;
+                if (skip)
+                    a.patch(skip);
+                continue;
+            }
+
+            bool sync = ir[ir[node.arg_1].arg_1].arg_32 == 0 && !is_const(node.arg_2) && !pinned.empty();
+            if (sync)
+                spill();
+            address(node);
+            operand(RAX, node.arg_3);
+            switch (node.id) {
+            case store8:  a.byte(0x88); a.byte(0x01); break;               // mov [rcx], al
+            case store16: a.byte(0x66); a.byte(0x89); a.byte(0x01); break; // mov [rcx], ax
+            case store32: a.byte(0x89); a.byte(0x01); break;               // mov [rcx], eax
+            case store64: a.byte(0x48); a.byte(0x89); a.byte(0x01); break; // mov [rcx], rax
+            }
+            if (sync)
+                reload();
+            if (skip)
+                a.patch(skip);
+            continue; // No result
+        }
+        default:
+            stats.unsupported++;
+            return nullptr;
+        }
+
+        a.store_slot(slot, RAX);
+    }
+
+    std::vector<size_t> exits;
+    if (chain) {
+        if (chain->retired >= 0) {
+            a.load(RAX, R12, chain->retired * 8);
+        } else {
+            a.mov_imm(RAX, chain->instructions);
+        }
+        a.sub_mem(RBX, state(offsetof(ChainState, instructions_left)), RAX);
+        a.store_imm(RBX, state(offsetof(ChainState, last)), chain->key);
+
+        // Unpatched exits jump to the next instruction, ending up back at the caller
+        for (const auto& tests : chain->exits) {
+            std::vector<size_t> next;
+            for (const RegTest& test : tests)
+                next.push_back(reg_test(test));
+            exits.push_back(a.jmp());
+            for (size_t location : next)
+                a.patch(location);
+        }
+    }
+
+    // Bailing out of the chain entry returns before the block has done anything, apart from
+    // writing back the pinned registers the previous block left
+    for (size_t location : bail)
+        a.patch(location);
+    spill();
+    a.pop(R15);
+    a.pop(R14);
+    a.pop(R13);
+    a.pop(R12);
+    a.pop(RBX);
+    a.ret();
+
+    if (used + a.buf.size() > capacity) {
+        stats.exhausted++;
+        full = true;
+        return nullptr;
+    }
+
+    u8* fn = code + used;
+    memcpy(writable + used, a.buf.data(), a.buf.size());
+    if (where) {
+        where->entry = chain ? fn + entry : nullptr;
+        where->exits.clear();
+        for (size_t location : exits)
+            where->exits.push_back(fn + location);
+    }
+    used += (a.buf.size() + 15) & ~size_t(15);
+    stats.compiled++;
+
+    {
+        std::lock_guard<std::mutex> guard(perf_map.lock);
+        if (perf_map.file) {
+            fprintf(perf_map.file, "%lx %zx guest_%06x\n", (unsigned long)fn, a.buf.size(), guest_pc);
+            fflush(perf_map.file);
+        }
+    }
+
+    return (BlockFn)fn;
+}
+
+void JitX64::Patch(u8* jump, u8* entry) {
+    u32 rel = entry ? entry - jump : 0;
+    memcpy(writable + (jump - code) - 4, &rel, 4);
+}
+
+#else
+
+JitX64::JitX64(size_t) {}
+JitX64::~JitX64() {}
+void JitX64::Reset() {}
+void JitX64::EnablePerfMap() {}
+
+JitX64::BlockFn JitX64::Compile(const std::vector<IR_Base>&, const std::vector<u8>&, u32, const ChainSpec*, Chained*) {
+    stats.unsupported++;
+    return nullptr;
+}
+
+void JitX64::Patch(u8*, u8*) {}
+
+#endif
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "ir_base.h"
+
+#include <vector>
+#include <stdio.h>
+
+// Compiles finished IR blocks to native x86-64 code.
+//
+// Every node gets a u64 slot (like ssalist in the interpreter), constants are
+// inlined as immediates and all widths are known at compile time.
+// Only available on x86-64 Linux, elsewhere Compile() always fails and
+// blocks stay on the interpreter.
+//
+// Code goes into a fixed region, one block after another. The region is mapped twice: code is
+// written through a read/write view and run from a read/execute view, so no page is ever
+// writable and executable at once, and blocks can keep running while others are written.
+//
+// Blocks compiled with a ChainSpec can jump straight into each other, without returning to the
+// caller in between. Each of their exits ends in a jump that Patch can point at another block's
+// chain entry, which checks it's still valid to run before it does.
+//
+// The pinned registers are loaded into host registers when a block is called, and stored back
+// when it returns. Chained blocks pass them along in the host registers, so a run of blocks only
+// goes through the register file for the rest.
+class JitX64 {
+    u8* code = nullptr;     // Executable view
+    u8* writable = nullptr; // Writable view of the same memory
+    size_t capacity = 0;
+    size_t used = 0;
+    bool full = false;
+
+public:
+    // slots must have room for one u64 per IR node.
+    // Blocks compiled with a ChainSpec also need a ChainState just before slots.
+    using BlockFn = void (*)(u64* slots, u64* regs, u8* mem);
+
+    // (regs[reg] & mask) == value, or != if equal is false
+    struct RegTest {
+        u8 reg;
+        u64 mask;
+        u32 value;
+        bool equal = true;
+    };
+
+    struct ChainSpec {
+        u32 key;           // Written to ChainState::last when the block finishes
+        u32 instructions;  // Most instructions the block runs
+        int retired = -1;  // Register holding the instructions it did run, if it can leave early
+        u8 cycle;          // Register counting cycles
+
+        // Checked when another block jumps in, which returns to the caller instead if any fail
+        std::vector<RegTest> entry;
+        std::vector<std::pair<u32, u8>> guards; // mem[address & 0xffff] must still hold the byte
+
+        // Each exit gets a jump, taken if all of its tests pass, which can be patched
+        std::vector<std::vector<RegTest>> exits;
+    };
+
+    // Filled in by the caller, and updated by the blocks as they run
+    struct ChainState {
+        u64 last;               // key of the last block that ran
+        u64 chained;            // Blocks entered from another block
+        u64 cycle_limit;        // Blocks aren't entered once the cycle register reaches this
+        u64 instructions_left;  // Lowered by every block as it finishes. Blocks aren't entered
+                                // unless all their instructions fit
+    };
+
+    struct Chained {
+        u8* entry = nullptr;     // Where other blocks jump in
+        std::vector<u8*> exits;  // The jump of each exit, for Patch
+    };
+
+    // Register file entries kept in host registers, at most max_pinned. Only for constant offsets,
+    // and never anything a ChainSpec checks. Set before compiling anything.
+    static constexpr size_t max_pinned = 8;
+    std::vector<u8> pinned;
+
+    explicit JitX64(size_t capacity = 16 * 1024 * 1024);
+    ~JitX64();
+
+    JitX64(const JitX64&) = delete;
+    JitX64& operator=(const JitX64&) = delete;
+
+    // widths must have passed VerifyWidths.
+    // Returns nullptr if the block uses anything we can't compile (or we are out of space)
+    // The caller should fall back to the interpreter.
+    // With chain, the block can be chained to others, and where is filled in.
+    BlockFn Compile(const std::vector<IR_Base>& ir, const std::vector<u8>& widths, u32 guest_pc,
+                    const ChainSpec* chain = nullptr, Chained* where = nullptr);
+
+    // Points an exit's jump at another block's entry, or back at the rest of its own block
+    // (which returns to the caller) if entry is nullptr. Only for blocks from this JitX64.
+    void Patch(u8* jump, u8* entry);
+
+    // True if a block didn't fit since the last Reset. The caller should drop everything
+    // it compiled and Reset.
+    bool Full() const { return full; }
+
+    // Reuses the whole region for new code. Every BlockFn returned so far becomes invalid.
+    // With the perf map on, the region moves instead, so old entries in the map stay right.
+    void Reset();
+
+    // Lists every block compiled from now on in /tmp/perf-<pid>.map, so perf can attribute samples
+    // in JIT code to guest blocks. One map for the whole process, off unless asked for.
+    static void EnablePerfMap();
+
+    size_t Used() const { return used; }
+
+    struct Stats {
+        u64 compiled = 0;
+        u64 unsupported = 0; // Blocks using IR the JIT can't lower
+        u64 exhausted = 0;   // Blocks that didn't fit in the code region
+        u64 resets = 0;
+        u64 pinned = 0;      // Register file loads and stores compiled to host register moves
+    } stats;
+};
@@ -0,0 +1,129 @@
+#include "ir_lockstep.h"
+#include "ir_threaded.h"
+
+#include <cassert>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LOCKSTEP_AVX2 1
+#endif
+
+namespace {
+
+// One slot's values for every lane. The compiler picks the instructions, so the same kernel
+// becomes AVX2 or SSE2 depending on the function it's inlined into.
+using Lanes = u64 __attribute__((vector_size(8 * lockstep_lanes)));
+
+#define LOCKSTEP_INLINE inline __attribute__((always_inline))
+
+// The helpers are always inlined, so passing vectors between them never goes through the ABI
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+LOCKSTEP_INLINE Lanes get(const u64* s, u16 slot) {
+    Lanes value;
+    memcpy(&value, s + slot * lockstep_lanes, sizeof(value));
+    return value;
+}
+
+LOCKSTEP_INLINE void set(u64* s, u16 slot, const Lanes& value) {
+    memcpy(s + slot * lockstep_lanes, &value, sizeof(value));
+}
+
+LOCKSTEP_INLINE void run(const ThreadedBlock::Op* op, u64* s, const LockstepLane* lanes, u8 active) {
+    using Kind = ThreadedBlock::Kind;
+
+    // Memory operations go one lane at a time. Lanes that aren't active, or have the operation
+    // disabled, skip it, and disabled loads read as zero.
+#define LANE(slot) s[(slot) * lockstep_lanes + lane]
+#define ENABLED ((active >> lane & 1) && LANE(op->c))
+#define EACH_LANE for (int lane = 0; lane < lockstep_lanes; lane++)
+#define MEM(offset) (assert((offset) <= 0xffff), &lanes[lane].mem[offset])
+
+    for (;; op++) {
+        switch (op->kind) {
+        case Kind::Not:        set(s, op->dst, ~get(s, op->a) & op->mask); break;
+        case Kind::Add:        set(s, op->dst, (get(s, op->a) + get(s, op->b)) & op->mask); break;
+        case Kind::Sub:        set(s, op->dst, (get(s, op->a) - get(s, op->b)) & op->mask); break;
+        case Kind::And:        set(s, op->dst, get(s, op->a) & get(s, op->b)); break;
+        case Kind::Or:         set(s, op->dst, get(s, op->a) | get(s, op->b)); break;
+        case Kind::Xor:        set(s, op->dst, get(s, op->a) ^ get(s, op->b)); break;
+        case Kind::ShiftLeft:  set(s, op->dst, get(s, op->a) << op->shift); break;
+        case Kind::ShiftRight: set(s, op->dst, get(s, op->a) >> op->shift); break;
+        case Kind::Cat:        set(s, op->dst, get(s, op->a) << op->shift | get(s, op->b)); break;
+        case Kind::Extract:    set(s, op->dst, (get(s, op->a) >> op->shift) & op->mask); break;
+        case Kind::Copy:       set(s, op->dst, get(s, op->a)); break;
+        // Vector comparisons give all ones for true
+        case Kind::Eq:         set(s, op->dst, (Lanes)(get(s, op->a) == get(s, op->b)) & 1); break;
+        case Kind::Neq:        set(s, op->dst, (Lanes)(get(s, op->a) != get(s, op->b)) & 1); break;
+        case Kind::Ternary: {
+            Lanes take = (Lanes)(get(s, op->a) != 0);
+            set(s, op->dst, (get(s, op->b) & take) | (get(s, op->c) & ~take));
+            break;
+        }
+
+        case Kind::LoadReg:   EACH_LANE LANE(op->dst) = ENABLED ? lanes[lane].regs[LANE(op->a)] & op->mask : 0; break;
+        case Kind::LoadMem8:  EACH_LANE LANE(op->dst) = ENABLED ? *(u8*)MEM(LANE(op->a)) : 0; break;
+        case Kind::LoadMem16: EACH_LANE LANE(op->dst) = ENABLED ? *(u16*)MEM(LANE(op->a)) : 0; break;
+        case Kind::LoadMem32: EACH_LANE LANE(op->dst) = ENABLED ? *(u32*)MEM(LANE(op->a)) : 0; break;
+        case Kind::LoadMem64: EACH_LANE LANE(op->dst) = ENABLED ? *(u64*)MEM(LANE(op->a)) : 0; break;
+
+        case Kind::StoreReg8:  EACH_LANE if (ENABLED) *(u8*)&lanes[lane].regs[LANE(op->a)] = LANE(op->b); break;
+        case Kind::StoreReg16: EACH_LANE if (ENABLED) *(u16*)&lanes[lane].regs[LANE(op->a)] = LANE(op->b); break;
+        case Kind::StoreReg32: EACH_LANE if (ENABLED) *(u32*)&lanes[lane].regs[LANE(op->a)] = LANE(op->b); break;
+        case Kind::StoreReg64: EACH_LANE if (ENABLED) lanes[lane].regs[LANE(op->a)] = LANE(op->b); break;
+        case Kind::StoreMem8:  EACH_LANE if (ENABLED) *(u8*)MEM(LANE(op->a)) = LANE(op->b); break;
+        case Kind::StoreMem16: EACH_LANE if (ENABLED) *(u16*)MEM(LANE(op->a)) = LANE(op->b); break;
+        case Kind::StoreMem32: EACH_LANE if (ENABLED) *(u32*)MEM(LANE(op->a)) = LANE(op->b); break;
+        case Kind::StoreMem64: EACH_LANE if (ENABLED) *(u64*)MEM(LANE(op->a)) = LANE(op->b); break;
+
+        default: // End
+            return;
+        }
+    }
+
+#undef LANE
+#undef ENABLED
+#undef EACH_LANE
+#undef MEM
+}
+
+#ifdef LOCKSTEP_AVX2
+__attribute__((target("avx2")))
+void run_avx2(const ThreadedBlock::Op* ops, u64* s, const LockstepLane* lanes, u8 active) {
+    run(ops, s, lanes, active);
+}
+#endif
+
+void run_generic(const ThreadedBlock::Op* ops, u64* s, const LockstepLane* lanes, u8 active) {
+    run(ops, s, lanes, active);
+}
+
+} // namespace
+
+bool lockstep_avx2() {
+#ifdef LOCKSTEP_AVX2
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+void ThreadedBlock::RunLanes(const std::array<LockstepLane, lockstep_lanes>& lanes, u8 active) {
+    // Constants are in every lane
+    if (lane_slots.empty()) {
+        lane_slots.resize(slots.size() * lockstep_lanes);
+        for (size_t i = 0; i < slots.size(); i++) {
+            for (int lane = 0; lane < lockstep_lanes; lane++)
+                lane_slots[i * lockstep_lanes + lane] = slots[i];
+        }
+    }
+
+#ifdef LOCKSTEP_AVX2
+    if (lockstep_avx2()) {
+        run_avx2(ops.data(), lane_slots.data(), lanes.data(), active);
+        return;
+    }
+#endif
+    run_generic(ops.data(), lane_slots.data(), lanes.data(), active);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "ir_base.h"
+
+// Lockstep execution runs one block for several emulator instances at once, see ThreadedBlock::RunLanes.
+//
+// Blocks don't branch (see Ternary), so every instance runs every node. The values of each node
+// are kept side by side for all lanes ([node][lane]), so pure nodes are a single vector operation,
+// using AVX2 when the CPU has it. Memory operations go lane by lane, against each instance's
+// own registers and memory.
+constexpr int lockstep_lanes = 4;
+
+struct LockstepLane {
+    u64* regs = nullptr;
+    u8* mem = nullptr;
+};
+
+// True if RunLanes picked its AVX2 version
+bool lockstep_avx2();
@@ -0,0 +1,685 @@
+#include "ir_passes.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdio.h>
+
+bool IsRegisterAccess(const std::vector<IR_Base>& ir, const IR_Base& node) {
+    const IR_Base& mem = ir[node.arg_1];
+    assert(mem.id == memState);
+
+    const IR_Base& space = ir[mem.arg_1];
+    return space.id == Const && space.arg_32 == 0;
+}
+
+bool HasSideEffects(const std::vector<IR_Base>& ir, const IR_Base& node) {
+    switch (node.id) {
+    case store8:
+    case store16:
+    case store32:
+    case store64:
+    case stateWrite:
+    case Assert:
+        return true;
+    case load8:
+    case load16:
+    case load32:
+    case load64:
+        // Reads from the bus might hit MMIO, so they have to stay.
+        return !IsRegisterAccess(ir, node);
+    default:
+        return false;
+    }
+}
+
+size_t DeadCodeElimination(std::vector<IR_Base>& ir, std::vector<u8>& widths) {
+    std::vector<bool> live(ir.size(), false);
+
+    // Operands always come before their users, so a single backwards sweep
+    // is enough to find everything reachable from the side effects.
+    for (size_t i = ir.size(); i-- > 0; ) {
+        const IR_Base& node = ir[i];
+        if (!live[i] && !HasSideEffects(ir, node))
+            continue;
+
+        live[i] = true;
+        if (HasSsaArgs(node)) {
+            for (u16 arg : { u16(node.arg_1), u16(node.arg_2), u16(node.arg_3) }) {
+                if (arg != 0xffff)
+                    live[arg] = true;
+            }
+        }
+    }
+
+    // Compact, remapping operands to their new locations
+    std::vector<u16> remap(ir.size(), 0xffff);
+    size_t out = 0;
+    for (size_t i = 0; i < ir.size(); i++) {
+        if (!live[i])
+            continue;
+
+        IR_Base node = ir[i];
+        if (HasSsaArgs(node)) {
+            if (node.arg_1 != 0xffff) node.arg_1 = remap[node.arg_1];
+            if (node.arg_2 != 0xffff) node.arg_2 = remap[node.arg_2];
+            if (node.arg_3 != 0xffff) node.arg_3 = remap[node.arg_3];
+        }
+        remap[i] = out;
+        widths[out] = widths[i];
+        ir[out++] = node;
+    }
+
+    size_t removed = ir.size() - out;
+    ir.erase(ir.begin() + out, ir.end());
+    widths.resize(out);
+    return removed;
+}
+
+size_t HoistConstants(std::vector<IR_Base>& ir, std::vector<u8>& widths) {
+    std::vector<u16> order;
+    order.reserve(ir.size());
+    for (size_t i = 0; i < ir.size(); i++) {
+        if (ir[i].id == Const)
+            order.push_back(i);
+    }
+    size_t constants = order.size();
+    for (size_t i = 0; i < ir.size(); i++) {
+        if (ir[i].id != Const)
+            order.push_back(i);
+    }
+
+    std::vector<u16> remap(ir.size());
+    for (size_t i = 0; i < order.size(); i++)
+        remap[order[i]] = i;
+
+    std::vector<IR_Base> hoisted;
+    std::vector<u8> hoisted_widths;
+    hoisted.reserve(ir.size());
+    hoisted_widths.reserve(ir.size());
+    for (u16 i : order) {
+        IR_Base node = ir[i];
+        if (HasSsaArgs(node)) {
+            if (node.arg_1 != 0xffff) node.arg_1 = remap[node.arg_1];
+            if (node.arg_2 != 0xffff) node.arg_2 = remap[node.arg_2];
+            if (node.arg_3 != 0xffff) node.arg_3 = remap[node.arg_3];
+        }
+        hoisted.push_back(node);
+        hoisted_widths.push_back(widths[i]);
+    }
+
+    ir = std::move(hoisted);
+    widths = std::move(hoisted_widths);
+    return constants;
+}
+
+u8 NodeWidth(const std::vector<IR_Base>& ir, const std::vector<u8>& widths, const IR_Base& node) {
+    auto constant = [&] (u16 arg) -> int {
+        return ir[arg].id == Const ? ir[arg].arg_32 : -1;
+    };
+
+    int w = 0;
+    switch (node.id) {
+    case Const:
+        return node.num_bits;
+    case Not:
+    case Add:
+    case Sub:
+    case And:
+    case Or:
+    case Xor:
+        return widths[node.arg_1];
+    case ShiftLeft:
+        w = constant(node.arg_2) < 0 ? 0 : widths[node.arg_1] + constant(node.arg_2);
+        break;
+    case ShiftRight:
+        w = constant(node.arg_2) < 0 ? 0 : widths[node.arg_1] - constant(node.arg_2);
+        break;
+    case Cat:
+        w = widths[node.arg_1] + widths[node.arg_2];
+        break;
+    case Extract:
+        w = constant(node.arg_2) < 0 ? 0 : constant(node.arg_3);
+        break;
+    case Zext:
+        w = constant(node.arg_2);
+        break;
+    case stateRead:
+        w = constant(node.arg_2);
+        break;
+    case Eq:
+    case Neq:
+        return 1;
+    case Ternary:
+        // The interpreter used to take the width of whichever side was chosen
+        return widths[node.arg_2] == widths[node.arg_3] ? widths[node.arg_2] : 0;
+    case load8:  return 8;
+    case load16: return 16;
+    case load32: return 32;
+    case load64: return 64;
+    default:
+        return 0; // No value
+    }
+    return w > 0 && w <= 64 ? w : 0;
+}
+
+bool VerifyWidths(const std::vector<IR_Base>& ir, const std::vector<u8>& widths) {
+    bool ok = widths.size() == ir.size();
+    if (!ok) {
+        printf("Width error: %zu widths for %zu nodes\n", widths.size(), ir.size());
+        return false;
+    }
+
+    for (size_t i = 0; i < ir.size(); i++) {
+        const IR_Base& node = ir[i];
+        auto fail = [&] (const char* what) {
+            printf("Width error at node %zu (%s): %s\n", i, OpcodeName(node.id), what);
+            ok = false;
+        };
+        auto w = [&] (u16 arg) { return widths[arg]; };
+        auto is_const = [&] (u16 arg) { return ir[arg].id == Const; };
+
+        if (widths[i] != NodeWidth(ir, widths, node))
+            fail("recorded width doesn't match");
+
+        switch (node.id) {
+        case Not:
+        case Add:
+        case Sub:
+        case And:
+        case Or:
+        case Xor:
+        case Cat:
+        case Zext:
+        case Eq:
+        case Neq:
+        case load8:
+        case load16:
+        case load32:
+        case load64:
+            if (widths[i] == 0)
+                fail("unknown width");
+            break;
+        default:
+            break;
+        }
+
+        switch (node.id) {
+        case Sub:
+        case And:
+        case Or:
+        case Xor:
+            if (w(node.arg_1) != w(node.arg_2))
+                fail("operand widths differ");
+            break;
+        case Eq:
+        case Neq:
+            if (w(node.arg_1) > w(node.arg_2))
+                fail("first operand is wider");
+            break;
+        case ShiftLeft:
+        case ShiftRight:
+            if (!is_const(node.arg_2) || ir[node.arg_2].arg_32 >= 64 || widths[i] == 0)
+                fail("shift isn't a constant that fits");
+            break;
+        case Extract:
+            if (!is_const(node.arg_2) || !is_const(node.arg_3) || widths[i] == 0)
+                fail("shift and width must be constants");
+            else if (w(node.arg_1) < ir[node.arg_3].arg_32 + ir[node.arg_2].arg_32)
+                fail("extracting past the end of the operand");
+            break;
+        case Ternary:
+            if (widths[i] == 0)
+                fail("sides have different widths");
+            break;
+        case store8:
+            if (w(node.arg_3) != 8) fail("data isn't 8 bits");
+            break;
+        case store16:
+            if (w(node.arg_3) != 16) fail("data isn't 16 bits");
+            break;
+        case store32:
+            if (w(node.arg_3) != 32) fail("data isn't 32 bits");
+            break;
+        default:
+            break;
+        }
+    }
+    return ok;
+}
+
+namespace {
+
+// Rebuilds a block node by node, so a pass can replace nodes and insert new ones.
+// Operands are remapped to wherever their node ended up.
+struct Rebuilder {
+    const std::vector<IR_Base>& ir;
+    std::vector<IR_Base> out;
+    std::vector<u8> widths;
+    std::vector<u16> remap;
+
+    Rebuilder(const std::vector<IR_Base>& ir) : ir(ir), remap(ir.size(), 0xffff) {
+        out.reserve(ir.size());
+        widths.reserve(ir.size());
+    }
+
+    ssa emit(IR_Base node) {
+        widths.push_back(NodeWidth(out, widths, node));
+        out.push_back(node);
+        return ssa { u16(out.size() - 1) };
+    }
+    ssa constant(u32 value, u8 bits = 32) {
+        return emit(IR_Const32(value, bits));
+    }
+
+    // Where an old node ended up
+    ssa arg(u16 node) const {
+        return ssa { remap[node] };
+    }
+    void replace(size_t node, ssa value) {
+        remap[node] = value.offset;
+    }
+
+    // Copies an old node, with its operands remapped
+    void copy(size_t i) {
+        IR_Base node = ir[i];
+        if (HasSsaArgs(node)) {
+            if (node.arg_1 != 0xffff) node.arg_1 = remap[node.arg_1];
+            if (node.arg_2 != 0xffff) node.arg_2 = remap[node.arg_2];
+            if (node.arg_3 != 0xffff) node.arg_3 = remap[node.arg_3];
+        }
+        replace(i, emit(node));
+    }
+
+    void finish(std::vector<IR_Base>& ir_out, std::vector<u8>& widths_out) {
+        ir_out = std::move(out);
+        widths_out = std::move(widths);
+    }
+};
+
+} // namespace
+
+static std::optional<u64> ConstValue(const std::vector<IR_Base>& ir, u16 node) {
+    if (ir[node].id != Const)
+        return {};
+    return ir[node].arg_32;
+}
+
+// Low byte of an address, if it's known ahead of time
+static std::optional<u8> KnownLowByte(const std::vector<IR_Base>& ir, const std::vector<u8>& widths, u16 node) {
+    if (auto value = ConstValue(ir, node))
+        return u8(*value);
+    if (ir[node].id == Cat && widths[ir[node].arg_2] >= 8)
+        return KnownLowByte(ir, widths, ir[node].arg_2);
+    return {};
+}
+
+// True if next is always address + 1, as long as address doesn't end in 0xff
+static bool IsNextAddress(const std::vector<IR_Base>& ir, const std::vector<u8>& widths, u16 address, u16 next) {
+    auto a = ConstValue(ir, address);
+    auto b = ConstValue(ir, next);
+    if (a && b)
+        return *b == *a + 1;
+
+    const IR_Base& n = ir[next];
+    if (n.id == Add && n.arg_1 == address && ConstValue(ir, n.arg_2) == 1u)
+        return true;
+
+    // Cat(bank, x) and Cat(bank, x + 1)
+    const IR_Base& m = ir[address];
+    if (m.id == Cat && n.id == Cat && m.arg_1 == n.arg_1 && widths[m.arg_2] == widths[n.arg_2])
+        return IsNextAddress(ir, widths, m.arg_2, n.arg_2);
+    return false;
+}
+
+size_t CoalesceMemoryOps(std::vector<IR_Base>& ir, std::vector<u8>& widths, const PlainMemoryFn& is_plain) {
+    struct Access {
+        u16 node;
+        u64 space;
+    };
+
+    // Bus accesses in program order. Anything we can't reason about blocks merging across it.
+    std::vector<Access> accesses;
+    for (size_t i = 0; i < ir.size(); i++) {
+        const IR_Base& node = ir[i];
+        if (node.id < load64 || node.id > store8)
+            continue;
+        auto space = ConstValue(ir, ir[node.arg_1].arg_1);
+        if (space == 0u)
+            continue; // The register file
+        accesses.push_back({ u16(i), space ? *space : ~0ull });
+    }
+
+    // How each merged pair gets rebuilt
+    struct Merge {
+        u16 first, second;
+        u16 low_address;
+        bool first_is_low;
+    };
+    std::vector<Merge> merges;
+
+    for (size_t k = 0; k + 1 < accesses.size(); k++) {
+        // The next access to the same namespace. Unknown namespaces might be any of them.
+        size_t next = k + 1;
+        while (next < accesses.size() && accesses[next].space != accesses[k].space && accesses[next].space != ~0ull)
+            next++;
+        if (next == accesses.size() || accesses[next].space != accesses[k].space || accesses[k].space == ~0ull)
+            continue;
+
+        u16 i = accesses[k].node, j = accesses[next].node;
+        const IR_Base& a = ir[i];
+        const IR_Base& b = ir[j];
+        bool loads = a.id == load8 && b.id == load8;
+        bool stores = a.id == store8 && b.id == store8;
+        if (!loads && !stores)
+            continue;
+        if (ir[a.arg_1].arg_3 != ir[b.arg_1].arg_3)
+            continue; // Different conditions
+
+        bool first_is_low;
+        if (IsNextAddress(ir, widths, a.arg_2, b.arg_2))
+            first_is_low = true;
+        else if (IsNextAddress(ir, widths, b.arg_2, a.arg_2))
+            first_is_low = false;
+        else
+            continue;
+
+        // Both bytes need to be in the same page, which also rules out any wrapping
+        u16 low = first_is_low ? a.arg_2 : b.arg_2;
+        auto low_byte = KnownLowByte(ir, widths, low);
+        if (!low_byte || *low_byte == 0xff)
+            continue;
+
+        u64 space = accesses[k].space;
+        auto address = ConstValue(ir, low);
+        if (address ? !is_plain(space, *address) || !is_plain(space, *address + 1) : !is_plain(space, {}))
+            continue;
+
+        // A merged load happens at the first load, so it needs the address by then
+        if (loads && low > i && !address)
+            continue;
+
+        merges.push_back({ i, j, low, first_is_low });
+        k = next; // Continue after the pair
+    }
+
+    if (merges.empty())
+        return 0;
+
+    // Rebuild the block with the merged accesses
+    Rebuilder b(ir);
+
+    std::vector<const Merge*> merge_at(ir.size(), nullptr);
+    for (const Merge& m : merges) {
+        merge_at[m.first] = &m;
+        merge_at[m.second] = &m;
+    }
+
+    for (size_t i = 0; i < ir.size(); i++) {
+        const Merge* m = merge_at[i];
+        const IR_Base& node = ir[i];
+
+        if (m && node.id == load8 && i == m->first) {
+            ssa address = m->low_address < i ? b.arg(m->low_address) : b.constant(ir[m->low_address].arg_32);
+            ssa wide = b.emit(IR_Load16(b.arg(node.arg_1), address));
+            ssa low = b.emit(IR_Extract(wide, b.constant(0), b.constant(8)));
+            ssa high = b.emit(IR_Extract(wide, b.constant(8), b.constant(8)));
+            b.replace(m->first, m->first_is_low ? low : high);
+            b.replace(m->second, m->first_is_low ? high : low);
+            continue;
+        }
+        if (m && node.id == load8)
+            continue; // Already done by the first load
+        if (m && i == m->first)
+            continue; // Stores wait for the second store
+
+        if (m) {
+            const IR_Base& first = ir[m->first];
+            ssa low = b.arg(m->first_is_low ? first.arg_3 : node.arg_3);
+            ssa high = b.arg(m->first_is_low ? node.arg_3 : first.arg_3);
+            ssa data = b.emit(IR_Cat(high, low));
+            b.replace(i, b.emit(IR_Store16(b.arg(node.arg_1), b.arg(m->low_address), data)));
+            continue;
+        }
+
+        b.copy(i);
+    }
+
+    b.finish(ir, widths);
+    return merges.size();
+}
+
+namespace {
+
+// An address as high << bits | (base + offset) % 2^bits, where base is a node, or nothing for a
+// constant. Stack accesses add constants to S and wrap within page 1 in emulation mode, so each
+// push and pull has its own address node, but they all share S as their base.
+struct LinearAddress {
+    std::optional<u16> base;
+    u64 offset = 0;
+    int bits = 0;
+    u64 high = 0;
+    bool exact = true; // Otherwise only the low bits are known, as base + offset
+};
+
+} // namespace
+
+static u64 LowMask(int bits) {
+    return bits >= 64 ? ~0ull : (1ull << bits) - 1;
+}
+
+static LinearAddress Linearize(const std::vector<IR_Base>& ir, const std::vector<u8>& widths, u16 node,
+                               std::vector<std::optional<LinearAddress>>& memo) {
+    if (memo[node])
+        return *memo[node];
+
+    const IR_Base& n = ir[node];
+    int width = widths[node];
+    LinearAddress result { node, 0, width, 0, true };
+    switch (n.id) {
+    case Const:
+        result = { {}, n.arg_32 & LowMask(width), width, 0, true };
+        break;
+    case Add:
+    case Sub: {
+        u16 other = n.arg_1;
+        auto c = ConstValue(ir, n.arg_2);
+        if (!c && n.id == Add) {
+            other = n.arg_2;
+            c = ConstValue(ir, n.arg_1);
+        }
+        if (!c)
+            break;
+        // Carries go into the high part, so only the low bits stay linear
+        LinearAddress a = Linearize(ir, widths, other, memo);
+        result = a;
+        result.offset = n.id == Add ? a.offset + *c : a.offset - *c;
+        result.bits = std::min(a.bits, width);
+        result.high = 0;
+        result.exact = a.exact && a.bits >= width;
+        break;
+    }
+    case Extract: {
+        if (ConstValue(ir, n.arg_2) != 0u)
+            break;
+        LinearAddress a = Linearize(ir, widths, n.arg_1, memo);
+        result = a;
+        result.bits = std::min(a.bits, width);
+        result.high = a.bits < width ? a.high & LowMask(width - a.bits) : 0;
+        break;
+    }
+    case Zext:
+        result = Linearize(ir, widths, n.arg_1, memo);
+        break;
+    case Cat: {
+        auto high = ConstValue(ir, n.arg_1);
+        int shift = widths[n.arg_2];
+        if (!high)
+            break;
+        LinearAddress b = Linearize(ir, widths, n.arg_2, memo);
+        if (shift - b.bits >= 64)
+            break;
+        result = b;
+        result.high = *high << (shift - b.bits) | b.high;
+        break;
+    }
+    default:
+        break;
+    }
+    if (result.bits >= width) {
+        // Every bit is known
+        result.high = 0;
+        result.exact = true;
+    }
+
+    memo[node] = result;
+    return result;
+}
+
+// The lowest and highest bytes an access might touch, or everything if that's too big to work out
+static std::pair<u64, u64> AddressRange(const LinearAddress& a, int bytes) {
+    if (a.bits >= 48 || a.high >> (48 - a.bits))
+        return { 0, ~0ull };
+    u64 first = a.high << a.bits;
+    if (!a.base)
+        return { first | a.offset, (first | a.offset) + bytes - 1 };
+    return { first, first + LowMask(a.bits) + bytes - 1 };
+}
+
+static bool SameAddress(const LinearAddress& a, const LinearAddress& b) {
+    return a.base == b.base && a.bits == b.bits && a.high == b.high && ((a.offset - b.offset) & LowMask(a.bits)) == 0;
+}
+
+static bool Disjoint(const LinearAddress& a, int a_bytes, const LinearAddress& b, int b_bytes) {
+    auto [a_first, a_last] = AddressRange(a, a_bytes);
+    auto [b_first, b_last] = AddressRange(b, b_bytes);
+    if (a_last < b_first || b_last < a_first)
+        return true;
+
+    // Whatever the base is, the low parts are a fixed distance apart (modulo 2^bits)
+    if (a.base != b.base || a.bits != b.bits || a.high != b.high || a.bits >= 48)
+        return false;
+    u64 distance = (b.offset - a.offset) & LowMask(a.bits);
+    return distance >= u64(a_bytes) && (1ull << a.bits) - distance >= u64(b_bytes);
+}
+
+size_t ForwardMemoryOps(std::vector<IR_Base>& ir, std::vector<u8>& widths, const PlainMemoryFn& is_plain) {
+    // What the block knows about memory at the current node
+    struct Known {
+        u64 space;
+        u16 address;
+        LinearAddress linear;
+        int bytes;
+        u16 value;
+        u16 cond; // The value is only known when this is true
+    };
+    std::vector<Known> known;
+    std::vector<std::optional<LinearAddress>> linear(ir.size());
+
+    auto always = [&] (u16 cond) {
+        auto value = ConstValue(ir, cond);
+        return value && *value != 0;
+    };
+
+    // Forgets anything an access might overlap, or the whole namespace without an address
+    auto forget = [&] (u64 space, const LinearAddress* address, int bytes) {
+        known.erase(std::remove_if(known.begin(), known.end(), [&] (const Known& k) {
+            return k.space == space && !(address && Disjoint(k.linear, k.bytes, *address, bytes));
+        }), known.end());
+    };
+
+    // Asking about every byte of a page is cheap enough, and most stack accesses hit the same one
+    struct PlainRange {
+        u64 space, first, last;
+        bool plain;
+    };
+    std::vector<PlainRange> plain_ranges;
+    auto is_plain_range = [&] (u64 space, u64 first, u64 last) {
+        for (const PlainRange& r : plain_ranges) {
+            if (r.space == space && r.first == first && r.last == last)
+                return r.plain;
+        }
+        bool plain = true;
+        for (u64 address = first; plain && address <= last; address++)
+            plain = is_plain(space, address);
+        plain_ranges.push_back({ space, first, last, plain });
+        return plain;
+    };
+
+    Rebuilder b(ir);
+    size_t removed = 0;
+
+    for (size_t i = 0; i < ir.size(); i++) {
+        const IR_Base& node = ir[i];
+        if (node.id < load64 || node.id > store8) {
+            b.copy(i);
+            continue;
+        }
+
+        const IR_Base& mem = ir[node.arg_1];
+        auto space = ConstValue(ir, mem.arg_1);
+        if (space == 0u) {
+            b.copy(i); // The register file
+            continue;
+        }
+        if (!space) {
+            known.clear(); // Could be anything
+            b.copy(i);
+            continue;
+        }
+
+        bool is_load = node.id <= load8;
+        int bytes = 1 << (is_load ? load8 - node.id : store8 - node.id);
+        u16 address = node.arg_2;
+        u16 cond = mem.arg_3;
+
+        LinearAddress where = Linearize(ir, widths, address, linear);
+        if (!where.exact)
+            where = { address, 0, widths[address], 0, true };
+
+        bool plain = true;
+        auto [first, last] = AddressRange(where, bytes);
+        if (!where.base) {
+            for (u64 n = first; n <= last; n++)
+                plain = plain && is_plain(*space, n);
+        } else if (last - first < 0x100 + u64(bytes)) {
+            plain = is_plain_range(*space, first, last);
+        } else {
+            plain = is_plain(*space, {});
+        }
+
+        if (!plain) {
+            // MMIO might change anything in its namespace
+            forget(*space, nullptr, bytes);
+            b.copy(i);
+            continue;
+        }
+
+        if (is_load) {
+            // A known value can be reused if it was known under the same condition (disabled loads
+            // read as zero), or under no condition at all
+            auto match = std::find_if(known.begin(), known.end(), [&] (const Known& k) {
+                return k.space == *space && (k.address == address || SameAddress(k.linear, where)) &&
+                    k.bytes == bytes && (k.cond == cond || always(k.cond));
+            });
+            if (match != known.end()) {
+                ssa value = b.arg(match->value);
+                if (!always(cond))
+                    value = b.emit(IR_Ternary(b.arg(cond), value, b.constant(0, bytes * 8)));
+                b.replace(i, value);
+                removed++;
+                continue;
+            }
+
+            b.copy(i);
+            known.push_back({ *space, address, where, bytes, u16(i), cond });
+        } else {
+            forget(*space, &where, bytes);
+            b.copy(i);
+            known.push_back({ *space, address, where, bytes, u16(node.arg_3), cond });
+        }
+    }
+
+    if (removed)
+        b.finish(ir, widths);
+    return removed;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ir_base.h"
+
+#include <vector>
+#include <functional>
+#include <optional>
+
+// Optimization passes over finished IR blocks.
+// These run on a block after Finalize(), they are not safe to use on a
+// block that is still being emitted and interpreted.
+
+// True for nodes which reference other nodes through arg_1..arg_3
+inline bool HasSsaArgs(const IR_Base& ir) {
+    return ir.id < Const48;
+}
+
+// True for memory operations on the register file (memState namespace 0)
+// rather than the bus.
+bool IsRegisterAccess(const std::vector<IR_Base>& ir, const IR_Base& node);
+
+// True for nodes that must be kept, even if nothing uses their value.
+bool HasSideEffects(const std::vector<IR_Base>& ir, const IR_Base& node);
+
+// Removes every node which doesn't contribute to a store, a bus access or an assert.
+// Compacts the buffer and renumbers the ssa operands.
+// widths are compacted along with the nodes.
+// Returns the number of nodes removed.
+size_t DeadCodeElimination(std::vector<IR_Base>& ir, std::vector<u8>& widths);
+
+// Moves every Const node to the start of the block, keeping the order of everything else, so
+// their slots can be filled in once and skipped on every run (see partial_interpret's offset).
+// Returns the number of constants.
+size_t HoistConstants(std::vector<IR_Base>& ir, std::vector<u8>& widths);
+
+// Width of a node's value, following the rules the interpreter uses.
+// Widths of the operands come from widths. Returns 0 if the node has no value
+// or its width can't be known ahead of time.
+u8 NodeWidth(const std::vector<IR_Base>& ir, const std::vector<u8>& widths, const IR_Base& node);
+
+// Checks the recorded widths against NodeWidth, and checks the operand width rules
+// the interpreter relies on. Prints every problem it finds.
+// The interpreter, threaded interpreter and JIT only accept verified blocks.
+bool VerifyWidths(const std::vector<IR_Base>& ir, const std::vector<u8>& widths);
+
+// Tells the memory passes which parts of a memState namespace are plain RAM/ROM, where reads
+// have no side effects and return the last value written (see Bus::IsPlainMemory).
+// address is empty when asking about every address in the namespace.
+using PlainMemoryFn = std::function<bool(u64 space, std::optional<u64> address)>;
+
+// Merges pairs of 8bit bus loads (or stores) to adjacent addresses into single 16bit accesses.
+// Both bytes must be plain memory, under the same condition, in the same page, with no other
+// access to the namespace between them. Loads merge at the first load, stores at the second store.
+// Leaves dead nodes behind, run DeadCodeElimination afterwards.
+// Returns the number of pairs merged.
+size_t CoalesceMemoryOps(std::vector<IR_Base>& ir, std::vector<u8>& widths, const PlainMemoryFn& is_plain);
+
+// Forwards values stored to plain memory to later loads of the same address, and reuses
+// the value of an earlier load instead of loading again. Any store that might alias,
+// and any access that isn't known to be plain memory, forgets what was known about
+// the namespace. Loads that might hit MMIO are never removed.
+// Addresses that are a node plus a constant (like the stack, through S) are compared by
+// that node and constant, so a pull can get the value of an earlier push.
+// Leaves dead nodes behind, run DeadCodeElimination afterwards.
+// Returns the number of loads removed.
+size_t ForwardMemoryOps(std::vector<IR_Base>& ir, std::vector<u8>& widths, const PlainMemoryFn& is_plain);
@@ -0,0 +1,151 @@
+#include "ir_threaded.h"
+
+#include <cassert>
+
+static u64 mask(int bits) {
+    return bits >= 64 ? ~0ull : (1ull << bits) - 1;
+}
+
+bool ThreadedBlock::Decode(const std::vector<IR_Base>& ir, const std::vector<u8>& width) {
+    ops.clear();
+    slots.assign(ir.size(), 0);
+    lane_slots.clear();
+    resolved = false;
+
+    for (size_t i = 0; i < ir.size(); i++) {
+        const IR_Base& node = ir[i];
+        Op op = { nullptr, 0, u16(i), u16(node.arg_1), u16(node.arg_2), u16(node.arg_3), 0, End };
+
+        auto constant = [&] (u16 arg) { return ir[arg].arg_32; };
+
+        switch (node.id) {
+        case Opcode::Const:
+            slots[i] = node.arg_32;
+            continue;
+        case Opcode::memState:
+        case Opcode::Assert: // Not needed during execution, same as the interpreter
+            continue;
+
+        case Opcode::Not: op.kind = Not; op.mask = mask(width[i]); break;
+        case Opcode::Add: op.kind = Add; op.mask = mask(width[i]); break;
+        case Opcode::Sub: op.kind = Sub; op.mask = mask(width[i]); break;
+        case Opcode::And: op.kind = And; break;
+        case Opcode::Or:  op.kind = Or;  break;
+        case Opcode::Xor: op.kind = Xor; break;
+        case Opcode::ShiftLeft:  op.kind = ShiftLeft;  op.shift = constant(node.arg_2); break;
+        case Opcode::ShiftRight: op.kind = ShiftRight; op.shift = constant(node.arg_2); break;
+        case Opcode::Cat:
+            if (width[node.arg_2] >= 64)
+                return false;
+            op.kind = Cat;
+            op.shift = width[node.arg_2];
+            break;
+        case Opcode::Extract:
+            op.kind = Extract;
+            op.shift = constant(node.arg_2);
+            op.mask = mask(width[i]);
+            break;
+        case Opcode::Zext:    op.kind = Copy; break;
+        case Opcode::Eq:      op.kind = Eq; break;
+        case Opcode::Neq:     op.kind = Neq; break;
+        case Opcode::Ternary: op.kind = Ternary; break;
+
+        case Opcode::load8:
+        case Opcode::load16:
+        case Opcode::load32:
+        case Opcode::load64:
+        case Opcode::store8:
+        case Opcode::store16:
+        case Opcode::store32:
+        case Opcode::store64: {
+            const IR_Base& mem = ir[node.arg_1];
+            if (ir[mem.arg_1].id != Opcode::Const)
+                return false;
+            bool is_register = ir[mem.arg_1].arg_32 == 0;
+            op.a = node.arg_2;
+            op.b = node.arg_3;
+            op.c = mem.arg_3;
+
+            if (node.id <= Opcode::load8) {
+                int log2_bytes = Opcode::load8 - node.id;
+                op.kind = is_register ? LoadReg : Kind(LoadMem8 + log2_bytes);
+                op.mask = mask(8 << log2_bytes);
+            } else {
+                int log2_bytes = Opcode::store8 - node.id;
+                op.kind = Kind((is_register ? StoreReg8 : StoreMem8) + log2_bytes);
+            }
+            break;
+        }
+        default:
+            return false;
+        }
+
+        ops.push_back(op);
+    }
+
+    ops.push_back({ nullptr, 0, 0, 0, 0, 0, 0, End });
+    return true;
+}
+
+void ThreadedBlock::Run(u64* regs, u8* mem) {
+    static const void* labels[NumKinds] = {
+        &&op_not, &&op_add, &&op_sub, &&op_and, &&op_or, &&op_xor,
+        &&op_shl, &&op_shr, &&op_cat, &&op_extract, &&op_copy,
+        &&op_eq, &&op_neq, &&op_ternary,
+        &&op_load_reg, &&op_load_mem8, &&op_load_mem16, &&op_load_mem32, &&op_load_mem64,
+        &&op_store_reg8, &&op_store_reg16, &&op_store_reg32, &&op_store_reg64,
+        &&op_store_mem8, &&op_store_mem16, &&op_store_mem32, &&op_store_mem64,
+        &&op_end,
+    };
+
+    if (!resolved) {
+        for (Op& op : ops)
+            op.handler = labels[op.kind];
+        resolved = true;
+    }
+
+    u64* s = slots.data();
+    const Op* op = ops.data();
+
+#define NEXT() do { op++; goto *op->handler; } while (0)
+#define MEM(offset) (assert((offset) <= 0xffff), &mem[offset])
+
+    goto *op->handler;
+
+op_not:     s[op->dst] = ~s[op->a] & op->mask; NEXT();
+op_add:     s[op->dst] = (s[op->a] + s[op->b]) & op->mask; NEXT();
+op_sub:     s[op->dst] = (s[op->a] - s[op->b]) & op->mask; NEXT();
+op_and:     s[op->dst] = s[op->a] & s[op->b]; NEXT();
+op_or:      s[op->dst] = s[op->a] | s[op->b]; NEXT();
+op_xor:     s[op->dst] = s[op->a] ^ s[op->b]; NEXT();
+op_shl:     s[op->dst] = s[op->a] << op->shift; NEXT();
+op_shr:     s[op->dst] = s[op->a] >> op->shift; NEXT();
+op_cat:     s[op->dst] = s[op->a] << op->shift | s[op->b]; NEXT();
+op_extract: s[op->dst] = (s[op->a] >> op->shift) & op->mask; NEXT();
+op_copy:    s[op->dst] = s[op->a]; NEXT();
+op_eq:      s[op->dst] = s[op->a] == s[op->b]; NEXT();
+op_neq:     s[op->dst] = s[op->a] != s[op->b]; NEXT();
+op_ternary: s[op->dst] = s[op->a] ? s[op->b] : s[op->c]; NEXT();
+
+    // Disabled loads read as zero
+op_load_reg:   s[op->dst] = s[op->c] ? regs[s[op->a]] & op->mask : 0; NEXT();
+op_load_mem8:  s[op->dst] = s[op->c] ? *(u8*)MEM(s[op->a]) : 0; NEXT();
+op_load_mem16: s[op->dst] = s[op->c] ? *(u16*)MEM(s[op->a]) : 0; NEXT();
+op_load_mem32: s[op->dst] = s[op->c] ? *(u32*)MEM(s[op->a]) : 0; NEXT();
+op_load_mem64: s[op->dst] = s[op->c] ? *(u64*)MEM(s[op->a]) : 0; NEXT();
+
+op_store_reg8:  if (s[op->c]) *(u8*)&regs[s[op->a]] = s[op->b]; NEXT();
+op_store_reg16: if (s[op->c]) *(u16*)&regs[s[op->a]] = s[op->b]; NEXT();
+op_store_reg32: if (s[op->c]) *(u32*)&regs[s[op->a]] = s[op->b]; NEXT();
+op_store_reg64: if (s[op->c]) regs[s[op->a]] = s[op->b]; NEXT();
+op_store_mem8:  if (s[op->c]) *(u8*)MEM(s[op->a]) = s[op->b]; NEXT();
+op_store_mem16: if (s[op->c]) *(u16*)MEM(s[op->a]) = s[op->b]; NEXT();
+op_store_mem32: if (s[op->c]) *(u32*)MEM(s[op->a]) = s[op->b]; NEXT();
+op_store_mem64: if (s[op->c]) *(u64*)MEM(s[op->a]) = s[op->b]; NEXT();
+
+op_end:
+    return;
+
+#undef NEXT
+#undef MEM
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "ir_base.h"
+#include "ir_lockstep.h"
+
+#include <array>
+#include <vector>
+
+// A finished IR block, pre-decoded for a direct-threaded interpreter.
+//
+// Widths come from the emitter, so each op carries its masks and shift amounts
+// and nothing tracks types while running. Constants are written into their slots once,
+// when decoding, and never touched again.
+// Dispatch uses computed goto (a GCC/Clang extension).
+class ThreadedBlock {
+public:
+    enum Kind : u8 {
+        Not, Add, Sub, And, Or, Xor,
+        ShiftLeft, ShiftRight, Cat, Extract, Copy,
+        Eq, Neq, Ternary,
+        LoadReg, LoadMem8, LoadMem16, LoadMem32, LoadMem64,
+        StoreReg8, StoreReg16, StoreReg32, StoreReg64,
+        StoreMem8, StoreMem16, StoreMem32, StoreMem64,
+        End,
+        NumKinds
+    };
+
+    struct Op {
+        const void* handler; // Filled in by the first Run()
+        u64 mask;
+        u16 dst;
+        u16 a, b, c; // Slots. For memory ops: offset, data, condition
+        u8 shift;
+        Kind kind;
+    };
+
+    // widths must have passed VerifyWidths.
+    // Returns false if the block can't be decoded, the caller should use partial_interpret instead
+    bool Decode(const std::vector<IR_Base>& ir, const std::vector<u8>& widths);
+
+    void Run(u64* regs, u8* mem);
+
+    // Runs the block once for each lane with its bit set in active, all at once (see ir_lockstep.h).
+    // Defined in ir_lockstep.cpp
+    void RunLanes(const std::array<LockstepLane, lockstep_lanes>& lanes, u8 active);
+
+    size_t size() const { return ops.size() * sizeof(Op) + (slots.size() + lane_slots.size()) * sizeof(u64); }
+
+private:
+    std::vector<Op> ops;
+    std::vector<u64> slots;
+    std::vector<u64> lane_slots; // [slot][lane], made from slots by the first RunLanes
+    bool resolved = false;
+};
@@ -0,0 +1,19 @@
+#include "ir_trace.h"
+
+TraceSink trace_sink("trace.bin");
+
+TraceSink::~TraceSink() {
+    Flush();
+    if (file)
+        fclose(file);
+}
+
+void TraceSink::Flush() {
+    if (used == 0)
+        return;
+    if (!file)
+        file = fopen(path, "wb");
+    if (file)
+        fwrite(buffer.data(), 1, used, file);
+    used = 0;
+}
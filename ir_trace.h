@@ -0,0 +1,75 @@
+#pragma once
+
+#include "types.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Tracing is chosen at compile time (-DFIRESNES_TRACE=n), so it costs nothing when it's off.
+enum class TraceLevel {
+    Off = 0,
+    Instruction = 1, // A record before every guest instruction (forces single instruction blocks)
+    IR = 2,          // Also a record for every IR node run by partial_interpret
+};
+
+#ifndef FIRESNES_TRACE
+#define FIRESNES_TRACE 0
+#endif
+
+constexpr TraceLevel trace_level = TraceLevel(FIRESNES_TRACE);
+
+// Binary trace records. Formatting happens later, when the trace is dumped.
+enum TraceRecordType : u8 {
+    Trace_Instruction = 1,
+    Trace_Node = 2,
+};
+
+#pragma pack(push, 1)
+struct TraceInstruction {
+    u8 type = Trace_Instruction;
+    u8 opcode;
+    u32 pc;
+    u16 a, x, y, s;
+    u8 flags[8]; // N V M X D I Z C, as stored in registers[]
+    u64 cycle;
+};
+
+struct TraceNode {
+    u8 type = Trace_Node;
+    u8 width;
+    u16 id;
+    u16 index;
+    u16 args[3];
+    u64 value;
+};
+#pragma pack(pop)
+
+// Collects trace records in memory and writes them out in large chunks.
+// The file is only created once something is traced.
+class TraceSink {
+    const char* path;
+    FILE* file = nullptr;
+    std::vector<u8> buffer;
+    size_t used = 0;
+
+public:
+    explicit TraceSink(const char* path, size_t buffer_size = 1 << 20) : path(path), buffer(buffer_size) {}
+    ~TraceSink();
+
+    TraceSink(const TraceSink&) = delete;
+    TraceSink& operator=(const TraceSink&) = delete;
+
+    template<typename T>
+    void Write(const T& record) {
+        if (used + sizeof(T) > buffer.size())
+            Flush();
+        memcpy(&buffer[used], &record, sizeof(T));
+        used += sizeof(T);
+    }
+
+    void Flush();
+};
+
+// Everything traces to trace.bin
+extern TraceSink trace_sink;
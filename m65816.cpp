@@ -1,856 +1,762 @@
 #include <stdio.h>
 #include <array>
-#include <functional>
 #include <vector>
 #include <cassert>
-#include <string>
 
 #include "m65816_emitter.h"
 #include "m65816_utils.h"
+#include "m65816_cache.h"
+#include "ir_passes.h"
 #include "m65816.h"
 #include "ir_base.h"
 
 namespace m65816 {
 
-std::array<std::function<void(Emitter&)>, 256> gen_table;
-std::array<std::string, 256> name_table;
+namespace {
 
-void populate_tables() {
-    auto insert = [&] (size_t opcode, std::string name, std::function<void(Emitter&)>&& fn) {
-        gen_table[opcode] = std::move(fn);
-        if (name_table[opcode] != "") {
-            printf("Overwriting %s at %x with %s\n", name_table[opcode].c_str(), (unsigned)opcode, name.c_str());
-        }
-        name_table[opcode] = name;
-    };
-
-    // Universal Instructions:
-    //      a     a,x   a,y   al    al,x  d     d,s   d,x   (d)   [d]   (d,s),y  (d,x)  (d),y  [d],y  #
-    // ORA  0d    1d    19    0f    1f    05    03    15    12    07     13      01     11     17     09
-    // AND  2d    3d    39    2f    3f    25    23    35    32    27     33      21     31     37     29
-    // EOR  4d    5d    59    4f    5f    45    43    55    52    47     53      41     51     57     49
-    // ADC  6d    7d    79    6f    7f    65    63    75    72    67     73      61     71     77     69
-    // STA  8d    9d    99    8f    9f    85    83    95    92    87     93      81     91     97     --
-    // LDA  ad    bd    b9    af    bf    a5    a3    b5    b2    a7     b3      a1     b1     b7     a9
-    // CMP  cd    dd    d9    cf    df    c5    c3    d5    d2    c7     d3      c1     d1     d7     c9
-    // SBC  ed    fd    f9    ef    ff    e5    e3    f5    f2    e7     f3      e1     f1     f7     e9
-
-    // These are universal instructions that do A <--> Memory operations with almost every addressing mode
-
-    auto universal = [&] (const char* name, size_t op_base, inner_fn fn) {
-        auto apply = [&] (size_t sub_op, std::function<ssa(Emitter&, bool)> address_fn) {
-            bool is_store = std::string(name) == "STA";
-            insert(op_base | sub_op, name, [fn, address_fn, is_store] (Emitter& e) {
-                ApplyMemoryOperation(e, fn, address_fn(e, is_store));
-            });
-        };
-
-        apply(0x0d, Absolute);              // a
-        apply(0x1d, AbsoluteIndex<X>);      // a,x
-        apply(0x19, AbsoluteIndex<Y>);      // a, y
-        apply(0x0f, AbsoluteLong);          // al
-        apply(0x1f, AbsoluteLongX);         // al,x
-        apply(0x05, Direct);                // d
-        apply(0x03, StackRelative);         // d,s
-        apply(0x15, DirectIndex<X>);        // d,x
-        apply(0x12, IndirectDirect);        // (d)
-        apply(0x07, IndirectDirectLong);    // [d]
-        // T[def.op_base + 0x13] = Instruction(def.name, StackRelativeIndirectIndexed<def.fn>); // (d,s),y
-        apply(0x01, IndirectDirectIndexX);  // (d,x)
-        apply(0x11, IndexYIndirectDirect);  // (d),y
-        // T[def.op_base + 0x17] = Instruction(def.name, DirectIndirectLongIndexed<def.fn>); // [d],y
-        if (std::string(name) != "STA") { // Can't store to an immidate
-            insert(op_base + 0x09, name, [fn] (Emitter& e) { ApplyImmediate(e, fn); });
-        }
-    };
-
-    universal("ORA", 0x00, [] (Emitter& e, ssa& reg, ssa addr) { reg = e.Or(reg, e.Read(addr)); nz_flags(e, reg); });
-    universal("AND", 0x20, [] (Emitter& e, ssa& reg, ssa addr) { reg = e.And(reg, e.Read(addr)); nz_flags(e, reg); });
-    universal("EOR", 0x40, [] (Emitter& e, ssa& reg, ssa addr) { reg = e.Xor(reg, e.Read(addr)); nz_flags(e, reg); });
-    universal("ADC", 0x60, [] (Emitter& e, ssa& reg, ssa addr) { add_carry_overflow(e, reg, e.Read(addr)); nz_flags(e, reg); });
-    universal("STA", 0x80, [] (Emitter& e, ssa& reg, ssa addr) { e.Write(addr, reg); }); // Doesn't modify flags
-    universal("LDA", 0xa0, [] (Emitter& e, ssa& reg, ssa addr) { reg = e.Read(addr); nz_flags(e, reg); });
-    universal("CMP", 0xc0, [] (Emitter& e, ssa& reg, ssa addr) { compare(e, reg, e.Read(addr)); });
-    universal("SBC", 0xe0, [] (Emitter& e, ssa& reg, ssa addr) { subtract_borrow(e, reg, e.Read(addr)); nz_flags(e, reg); });
-
-    // General Read-Modify-Write instructions:
-    //      dir     abs     dir,x   abs,x   acc
-    // ASL  06      0e      16      1e      0a
-    // ROL  26      2e      36      3e      2a
-    // LSR  46      4e      56      5e      4a
-    // ROR  66      6e      76      7e      6a
-    // INC  e6      ee      f6      fe     <1a>
-    // DEC  c6      ce      d6      de     <3a>
-
-    // These do shifts and increments with a few addressing modes.
-    // Doesn't include the bit RWM instructions below
-
-    auto rwm = [&] (const char* name, size_t op_base, rmw_fn fn) {
-        auto apply = [&] (size_t sub_op, std::function<ssa(Emitter&, bool)> address_fn) {
-            insert(op_base + sub_op, name, [fn, address_fn] (Emitter& e) { ApplyModify(e, fn, address_fn(e, true)); });
-        };
-
-        apply(0x06, Direct);
-        apply(0x0e, Absolute);
-        apply(0x16, DirectIndex<X>);
-        apply(0x1e, AbsoluteIndex<X>);
-        if (op_base > 0x80) {
-            // the INC A and DEC A instructions were new to the 65816 and have a weird encoding.
-            op_base = (op_base & 0x30) ^ 0x30; // Uh... What were you thinking 65816 designers?
-            insert(op_base | 0x0a, name, std::bind(ApplyAcc, std::placeholders::_1, fn));
-        } else {
-            insert(op_base | 0x0a, name, std::bind(ApplyAcc, std::placeholders::_1, fn));
-        }
-    };
-
-    rwm("ASL", 0x00, [] (Emitter& e, ssa val, int width) {
-        ssa result = e.Cat(e.Extract(val, 0, width-1), e.Const<1>(0));
-        e.state[Flag_C] = e.Extract(val, width-1, 1);
-        e.state[Flag_N] = e.Extract(val, width-2, 1);
-        e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
-        return result;
-    });
-    rwm("ROL", 0x20, [] (Emitter& e, ssa val, int width) {
-        ssa result = e.Cat(e.Extract(val, 0, width-1), e.state[Flag_C]);
-        e.state[Flag_C] = e.Extract(val, width-1, 1);
-        e.state[Flag_N] = e.Extract(val, width-2, 1);
-        e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
-        return result;
-    });
-    rwm("LSR", 0x40, [] (Emitter& e, ssa val, int width) {
-        ssa result = e.Cat(e.Const<1>(0), e.Extract(val, 1, width-1));
-        e.state[Flag_C] = e.Extract(val, 0, 1);
-        e.state[Flag_N] = e.Const<1>(0); // Top bit is always zero
-        e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
-        return result;
-    });
-    rwm("ROR", 0x60, [] (Emitter& e, ssa val, int width) {
-        ssa result = e.Cat(e.state[Flag_C], e.Extract(val, 1, width-1));
-        e.state[Flag_N] = e.state[Flag_C];
-        e.state[Flag_C] = e.Extract(val, 0, 1);
-        e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
-        return result;
-    });
-    rwm("INC", 0xe0, [] (Emitter& e, ssa val, int width) {
-        ssa result = e.Add(val, e.Const(1, width));
-        e.state[Flag_N] = e.Extract(result, width-1, 1);
-        e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
-        return result;
-    });
-    rwm("DEC", 0xc0, [] (Emitter& e, ssa val, int width) {
-        ssa result = e.Sub(val, e.Const(1, width));
-        e.state[Flag_N] = e.Extract(result, width-1, 1);
-        e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
-        return result;
-    });
+using address_fn = ssa (*)(Emitter&, bool);
+using emit_fn = void (*)(Emitter&);
 
-    // Bit instructions:
-    //      dir   abs     dir,x   abs,x  !imm!
-    // TRB  14    1c
-    // TSB  04    0c
-    // BIT  24    2c      34      3c     <89>
+struct Opcode {
+    const char* name = "";
+    emit_fn emit = nullptr;
+};
 
-    auto bit_rmw = [&] (const char* name, size_t op_base, rmw_fn fn) {
-        auto apply = [&] (size_t sub_op, std::function<ssa(Emitter&, bool)> address_fn) {
-            insert(op_base + sub_op, name, [fn, address_fn] (Emitter& e) { ApplyModify(e, fn, address_fn(e, true)); });
-        };
+using OpcodeTable = std::array<Opcode, 256>;
 
-        apply(0x04, Direct);
-        apply(0x0c, Absolute);
+// The table is built at compile time, so overwriting an opcode is a build error
+constexpr void insert(OpcodeTable& table, size_t opcode, const char* name, emit_fn fn) {
+    if (table[opcode].emit)
+        throw "Overwriting opcode";
+    table[opcode] = { name, fn };
+}
 
-        if (std::string(name) == "BIT") {
-            apply(0x14, DirectIndex<X>);
-            apply(0x1c, AbsoluteIndex<X>);
-            // BIT #imm is very much a diffrent instruction that we will handle below
-        }
-    };
-
-    // TODO: Flags!
-    // FIXME: wrong
-    //bit_rmw("TRB", 0x10, [] (Emitter& e, ssa val) { return e.And(val, e.Xor(e.Const<8>(255), e.state[A])); });
-    //bit_rmw("TSB", 0x00, [] (Emitter& e, ssa val) { return e.Or(val, e.state[A]); });
-
-    {
-        auto apply_bit = [&] (size_t sub_op, std::function<ssa(Emitter&m, bool)> address_fn) {
-            insert(0x20 | sub_op, "BIT", [address_fn] (Emitter& e) {
-                auto fn = [] (Emitter &e, ssa &dst, ssa address) {
-                    ssa val =  e.Read(address);
-                    e.state[Flag_N] = e.Extract(val, 7, 1);
-                    e.state[Flag_V] = e.Extract(val, 6, 1);
-                    ssa result = e.And(dst, val);
-                    zero_flag(e, result);
-                };
-                ApplyMemoryOperation(e, fn, address_fn(e, false));
-            });
-        };
+// Universal Instructions:
+//      a     a,x   a,y   al    al,x  d     d,s   d,x   (d)   [d]   (d,s),y  (d,x)  (d),y  [d],y  #
+// ORA  0d    1d    19    0f    1f    05    03    15    12    07     13      01     11     17     09
+// AND  2d    3d    39    2f    3f    25    23    35    32    27     33      21     31     37     29
+// EOR  4d    5d    59    4f    5f    45    43    55    52    47     53      41     51     57     49
+// ADC  6d    7d    79    6f    7f    65    63    75    72    67     73      61     71     77     69
+// STA  8d    9d    99    8f    9f    85    83    95    92    87     93      81     91     97     --
+// LDA  ad    bd    b9    af    bf    a5    a3    b5    b2    a7     b3      a1     b1     b7     a9
+// CMP  cd    dd    d9    cf    df    c5    c3    d5    d2    c7     d3      c1     d1     d7     c9
+// SBC  ed    fd    f9    ef    ff    e5    e3    f5    f2    e7     f3      e1     f1     f7     e9
+
+// These are universal instructions that do A <--> Memory operations with almost every addressing mode
+
+template<inner_fn fn, address_fn address, bool is_store>
+void Universal(Emitter& e) {
+    ApplyMemoryOperation<fn>(e, address(e, is_store));
+}
 
-        apply_bit(0x04, Direct);
-        apply_bit(0x0c, Absolute);
-        apply_bit(0x14, DirectIndex<X>);
-        apply_bit(0x1c, AbsoluteIndex<X>);
+template<inner_fn fn>
+void UniversalImmediate(Emitter& e) {
+    ApplyImmediate<fn>(e);
+}
 
-        insert(0x89, "BIT", [] (Emitter &e) {
-            ssa low = ReadPc(e);
-            ssa wide = e.Not(e.state[Flag_M]);
+template<inner_fn fn, bool is_store = false>
+constexpr void universal(OpcodeTable& t, const char* name, size_t op_base) {
+    insert(t, op_base | 0x0d, name, Universal<fn, Absolute, is_store>);              // a
+    insert(t, op_base | 0x1d, name, Universal<fn, AbsoluteIndex<X>, is_store>);      // a,x
+    insert(t, op_base | 0x19, name, Universal<fn, AbsoluteIndex<Y>, is_store>);      // a, y
+    insert(t, op_base | 0x0f, name, Universal<fn, AbsoluteLong, is_store>);          // al
+    insert(t, op_base | 0x1f, name, Universal<fn, AbsoluteLongX, is_store>);         // al,x
+    insert(t, op_base | 0x05, name, Universal<fn, Direct, is_store>);                // d
+    insert(t, op_base | 0x03, name, Universal<fn, StackRelative, is_store>);         // d,s
+    insert(t, op_base | 0x15, name, Universal<fn, DirectIndex<X>, is_store>);        // d,x
+    insert(t, op_base | 0x12, name, Universal<fn, IndirectDirect, is_store>);        // (d)
+    insert(t, op_base | 0x07, name, Universal<fn, IndirectDirectLong, is_store>);    // [d]
+    // T[def.op_base + 0x13] = Instruction(def.name, StackRelativeIndirectIndexed<def.fn>); // (d,s),y
+    insert(t, op_base | 0x01, name, Universal<fn, IndirectDirectIndexX, is_store>);  // (d,x)
+    insert(t, op_base | 0x11, name, Universal<fn, IndexYIndirectDirect, is_store>);  // (d),y
+    // T[def.op_base + 0x17] = Instruction(def.name, DirectIndirectLongIndexed<def.fn>); // [d],y
+    if constexpr (!is_store) { // Can't store to an immidate
+        insert(t, op_base + 0x09, name, UniversalImmediate<fn>);
+    }
+}
 
-            ssa high;
-            e.If(wide, [&] () {
-                high = ReadPc(e);
-            });
-            ssa value = e.Cat(e.Ternary(wide, high, e.Const<8>(0)), low);
+void ORA(Emitter& e, ssa& reg, ssa addr) { reg = e.Or(reg, e.Read(addr)); nz_flags(e, reg); }
+void AND(Emitter& e, ssa& reg, ssa addr) { reg = e.And(reg, e.Read(addr)); nz_flags(e, reg); }
+void EOR(Emitter& e, ssa& reg, ssa addr) { reg = e.Xor(reg, e.Read(addr)); nz_flags(e, reg); }
+void ADC(Emitter& e, ssa& reg, ssa addr) { add_carry_overflow(e, reg, e.Read(addr)); nz_flags(e, reg); }
+void STA(Emitter& e, ssa& reg, ssa addr) { e.Write(addr, reg); } // Doesn't modify flags
+void LDA(Emitter& e, ssa& reg, ssa addr) { reg = e.Read(addr); nz_flags(e, reg); }
+void CMP(Emitter& e, ssa& reg, ssa addr) { compare(e, reg, e.Read(addr)); }
+void SBC(Emitter& e, ssa& reg, ssa addr) { subtract_borrow(e, reg, e.Read(addr)); nz_flags(e, reg); }
+
+// General Read-Modify-Write instructions:
+//      dir     abs     dir,x   abs,x   acc
+// ASL  06      0e      16      1e      0a
+// ROL  26      2e      36      3e      2a
+// LSR  46      4e      56      5e      4a
+// ROR  66      6e      76      7e      6a
+// INC  e6      ee      f6      fe     <1a>
+// DEC  c6      ce      d6      de     <3a>
+
+// These do shifts and increments with a few addressing modes.
+// Doesn't include the bit RWM instructions below
+
+template<rmw_fn fn, address_fn address>
+void Modify(Emitter& e) {
+    ApplyModify<fn>(e, address(e, true));
+}
 
-            ssa result = e.And(value, loadReg16(e, A));
+template<rmw_fn fn>
+void ModifyAcc(Emitter& e) {
+    ApplyAcc<fn>(e);
+}
 
-            // Only sets Z
-            e.state[Flag_Z] = e.Eq(result, e.Const<16>(0));
-        });
+template<rmw_fn fn>
+constexpr void rwm(OpcodeTable& t, const char* name, size_t op_base) {
+    insert(t, op_base + 0x06, name, Modify<fn, Direct>);
+    insert(t, op_base + 0x0e, name, Modify<fn, Absolute>);
+    insert(t, op_base + 0x16, name, Modify<fn, DirectIndex<X>>);
+    insert(t, op_base + 0x1e, name, Modify<fn, AbsoluteIndex<X>>);
+    if (op_base > 0x80) {
+        // the INC A and DEC A instructions were new to the 65816 and have a weird encoding.
+        op_base = (op_base & 0x30) ^ 0x30; // Uh... What were you thinking 65816 designers?
     }
+    insert(t, op_base | 0x0a, name, ModifyAcc<fn>);
+}
 
-    // Index<-->Memory instructions:
-    //      dir     abs     dir.X/Y  abs.X/Y   imm
-    // STY  84      8c      94       --        --
-    // STX  86      8e      96       --        --
-    // LDY  a4      ac      b4 (X)   bc (X)    a0
-    // LDX  a6      ae      b6 (Y)   be (Y)    a2
-    // CPY  c4      cc      --       --        c0
-    // CPX  e4      ec      --       --        e0
-
-    // NOTE: Index registers are swapped.
-
-    {
-        enum idxmem_type {
-            STORE,
-            LOAD,
-            CMP,
-        };
-
-        auto idxmem = [&] (const char* name, size_t op_base, idxmem_type type, Reg reg) {
-            auto apply = [&] (size_t sub_op, std::function<ssa(Emitter&, bool)> address_fn) {
-                insert(op_base + sub_op, name, [type, reg, address_fn] (Emitter& e) {
-                    ssa addr = address_fn(e, false);
-                    ssa val_low;
-                    if (type == STORE) {
-                         e.Write(addr, e.Extract(e.state[reg], 0, 8));
-                    } else {
-                            val_low = e.Read(addr);
-                            if (type == CMP) {
-                                ssa dst_low = e.Extract(e.state[reg], 0, 8);
-                                compare(e, dst_low, val_low);
-                            }
-                            if (type == LOAD) {
-                                e.state[reg] = e.Cat(e.Const<8>(0), val_low);
-                                nz_flags(e, val_low);
-                            }
-                    }
-                    e.IncCycle();
-
-                    e.If(e.Not(e.state[Flag_X]), [&] () {
-                        ssa addr2 = e.Add(addr, 1);
-                        if (type == STORE) {
-                            e.Write(addr2, e.Extract(e.state[reg], 8, 8));
-                        } else {
-                            ssa val_high = e.Read(addr);
-                            if (type == CMP) {
-                                ssa dst_high = e.Extract(e.state[reg], 8, 8);
-                                compare(e, dst_high, val_high);
-                            }
-                            if (type == LOAD) {
-                                e.state[reg] = e.Cat(val_high, val_low);
-                                nz_flags(e, val_high);
-                            }
-                        }
-                        e.IncCycle();
-                    });
-                });
-            };
-
-            apply(0x04, Direct);
-            apply(0x0c, Absolute);
-
-            if (type != CMP)
-                apply(0x14, reg == X ? DirectIndex<Y> : DirectIndex<X>);
-            if (type == LOAD) {
-                apply(0x1c, reg == X ? AbsoluteIndex<Y> : AbsoluteIndex<X>);
-
-                insert(op_base + 0x00, name, [reg] (Emitter& e) {
-                    ssa low = ReadPc(e);
-                    nz_flags(e, low);
-
-                    ssa wide = e.Not(e.state[Flag_X]);
-
-                    ssa high;
-                    e.If(wide, [&] () {
-                        high = ReadPc(e);
-                        nz_flags(e, high);
-                    });
-
-                    e.state[reg] = e.Cat(e.Ternary(wide, high, e.Const<8>(0)), low);
-                });
-            }
-            if (type == CMP) {
-                insert(op_base + 0x00, name, [reg] (Emitter& e) {
-                    ssa low = ReadPc(e);
-                    ssa dst_low = e.Extract(e.state[reg], 0, 8);
-                    compare(e, dst_low, low);
-
-                    ssa wide = e.Not(e.state[Flag_X]);
-
-                    ssa high;
-                    e.If(wide, [&] () {
-                        high = ReadPc(e);
-                        ssa dst_high = e.Extract(e.state[reg], 8, 8);
-                        compare(e, dst_high, high);
-                    });
-                });
-            }
-        };
-
-        idxmem("STY", 0x80, STORE, Y);
-        idxmem("STX", 0x82, STORE, X);
-        idxmem("LDY", 0xa0, LOAD,  Y);
-        idxmem("LDX", 0xa2, LOAD,  X);
-        idxmem("CPY", 0xc0, CMP,   Y);
-        idxmem("CPX", 0xe0, CMP,   X);
-    }
+ssa ASL(Emitter& e, ssa val, int width) {
+    ssa result = e.Cat(e.Extract(val, 0, width-1), e.Const<1>(0));
+    e.state[Flag_C] = e.Extract(val, width-1, 1);
+    e.state[Flag_N] = e.Extract(val, width-2, 1);
+    e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
+    return result;
+}
+ssa ROL(Emitter& e, ssa val, int width) {
+    ssa result = e.Cat(e.Extract(val, 0, width-1), e.state[Flag_C]);
+    e.state[Flag_C] = e.Extract(val, width-1, 1);
+    e.state[Flag_N] = e.Extract(val, width-2, 1);
+    e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
+    return result;
+}
+ssa LSR(Emitter& e, ssa val, int width) {
+    ssa result = e.Cat(e.Const<1>(0), e.Extract(val, 1, width-1));
+    e.state[Flag_C] = e.Extract(val, 0, 1);
+    e.state[Flag_N] = e.Const<1>(0); // Top bit is always zero
+    e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
+    return result;
+}
+ssa ROR(Emitter& e, ssa val, int width) {
+    ssa result = e.Cat(e.state[Flag_C], e.Extract(val, 1, width-1));
+    e.state[Flag_N] = e.state[Flag_C];
+    e.state[Flag_C] = e.Extract(val, 0, 1);
+    e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
+    return result;
+}
+ssa INC(Emitter& e, ssa val, int width) {
+    ssa result = e.Add(val, e.Const(1, width));
+    e.state[Flag_N] = e.Extract(result, width-1, 1);
+    e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
+    return result;
+}
+ssa DEC(Emitter& e, ssa val, int width) {
+    ssa result = e.Sub(val, e.Const(1, width));
+    e.state[Flag_N] = e.Extract(result, width-1, 1);
+    e.state[Flag_Z] = e.Eq(result, e.Const(0, width));
+    return result;
+}
 
-    // STZ  dir     abs     dir,X    abs,X
-    //      64      9c      74       9e
+// Bit instructions:
+//      dir   abs     dir,x   abs,x  !imm!
+// TRB  14    1c
+// TSB  04    0c
+// BIT  24    2c      34      3c     <89>
 
-    // Store Zero kind of fits into the above Index<-->Memory pattern if you squint.
-    // But its cleanly been stuffed into free slots.
+template<rmw_fn fn>
+constexpr void bit_rmw(OpcodeTable& t, const char* name, size_t op_base) {
+    insert(t, op_base + 0x04, name, Modify<fn, Direct>);
+    insert(t, op_base + 0x0c, name, Modify<fn, Absolute>);
+}
+
+// TODO: Flags!
+// FIXME: wrong
+//bit_rmw<TRB>(t, "TRB", 0x10); // [] (Emitter& e, ssa val) { return e.And(val, e.Xor(e.Const<8>(255), e.state[A])); }
+//bit_rmw<TSB>(t, "TSB", 0x00); // [] (Emitter& e, ssa val) { return e.Or(val, e.state[A]); }
+
+void BIT(Emitter &e, ssa &dst, ssa address) {
+    ssa val =  e.Read(address);
+    e.state[Flag_N] = e.Extract(val, 7, 1);
+    e.state[Flag_V] = e.Extract(val, 6, 1);
+    ssa result = e.And(dst, val);
+    zero_flag(e, result);
+}
+
+// BIT #imm is very much a diffrent instruction
+void BitImmediate(Emitter &e) {
+    ssa low = ReadPc(e);
+    ssa wide = e.Not(e.state[Flag_M]);
+
+    ssa high;
+    e.If(wide, [&] () {
+        high = ReadPc(e);
+    });
+    ssa value = e.Cat(e.Ternary(wide, high, e.Const<8>(0)), low);
+
+    ssa result = e.And(value, loadReg16(e, A));
 
-    {
-        auto stz = [&] (size_t opcode, std::function<ssa(Emitter&, bool)> address_fn) {
-            insert(opcode, "STZ", [address_fn] (Emitter& e) { e.Write(address_fn(e, true), e.Const<8>(0)); e.IncCycle();});
-        };
-        stz(0x64, Direct);
-        stz(0x9c, Absolute);
-        stz(0x74, DirectIndex<X>);
-        stz(0x9e, AbsoluteIndex<X>);
+    // Only sets Z
+    e.state[Flag_Z] = e.Eq(result, e.Const<16>(0));
+}
+
+constexpr void bit(OpcodeTable& t) {
+    insert(t, 0x24, "BIT", Universal<BIT, Direct, false>);
+    insert(t, 0x2c, "BIT", Universal<BIT, Absolute, false>);
+    insert(t, 0x34, "BIT", Universal<BIT, DirectIndex<X>, false>);
+    insert(t, 0x3c, "BIT", Universal<BIT, AbsoluteIndex<X>, false>);
+    insert(t, 0x89, "BIT", BitImmediate);
+}
+
+// Index<-->Memory instructions:
+//      dir     abs     dir.X/Y  abs.X/Y   imm
+// STY  84      8c      94       --        --
+// STX  86      8e      96       --        --
+// LDY  a4      ac      b4 (X)   bc (X)    a0
+// LDX  a6      ae      b6 (Y)   be (Y)    a2
+// CPY  c4      cc      --       --        c0
+// CPX  e4      ec      --       --        e0
+
+// NOTE: Index registers are swapped.
+
+enum class idxmem_type {
+    STORE,
+    LOAD,
+    CMP,
+};
+
+template<idxmem_type type, Reg reg, address_fn address>
+void IndexMemory(Emitter& e) {
+    ssa addr = address(e, false);
+    ssa val_low;
+    if (type == idxmem_type::STORE) {
+         e.Write(addr, e.Extract(e.state[reg], 0, 8));
+    } else {
+            val_low = e.Read(addr);
+            if (type == idxmem_type::CMP) {
+                ssa dst_low = e.Extract(e.state[reg], 0, 8);
+                compare(e, dst_low, val_low);
+            }
+            if (type == idxmem_type::LOAD) {
+                e.state[reg] = e.Cat(e.Const<8>(0), val_low);
+                nz_flags(e, val_low);
+            }
     }
+    e.IncCycle();
 
-    // Implied Operations on Index:
-    // DEY  88
-    // INY  c8
-    // DEX  ca
-    // INX  e8
-
-    auto inc = [&] (const char* name, size_t opcode, Reg index, int dir) {
-        insert(opcode, name, [index, dir] (Emitter& e) {
-            ssa result = e.Add(e.state[index], e.Const<16>(u16(dir)));
-            storeReg16(e, index, result);
-
-            // TODO: Dummy read to PC + 1
-            e.IncCycle(); // Internal operation;
-        } );
-    };
-
-    inc("DEY", 0x88, Y, -1);
-    inc("INY", 0xc8, Y,  1);
-    inc("DEX", 0xca, X, -1);
-    inc("INX", 0xe8, X,  1);
-
-    // Transfer operations:
-    // TXA  8a  x -> a.
-    // TYA  98
-    // TXS  9a -- special. Doesn't effect flags
-    // TXY  9b
-    // TAY  a8
-    // TAX  aa
-    // TSX  ba
-    // TYX  bb
-
-    // TCD  5b
-    // TCS  1b
-    // TDC  7b
-    // TSC  3B
-
-    auto move = [&] (const char* name, size_t opcode, Reg src, Reg dst) {
-        insert(opcode, name, [src, dst] (Emitter& e) {
-            // loadReg16 and storeReg16 handle all compexities
-            // Correctly handling the M and X flags and updating flags on store (except when storing to S)
-            ssa value = loadReg16(e, src);
-            storeReg16(e, dst, value);
-
-            // TODO: Dummy read to PC + 1
-            e.IncCycle();
-        });
-    };
-
-    move("TXA", 0x8a, X, A);
-    move("TYA", 0x98, Y, A);
-    move("TXS", 0x9a, X, S); // doesn't touch flags
-    move("TXY", 0x9b, X, Y);
-    move("TAX", 0xa8, A, Y);
-    move("TAX", 0xaa, A, X);
-    move("TSX", 0xba, S, X);
-    move("TYX", 0xbb, Y, X);
-    move("TCD", 0x5b, A, D);
-    move("TCS", 0x1b, A, S); // doesn't touch flags
-    move("TDC", 0x7b, D, A);
-    move("TSC", 0x3b, S, A);
-
-    auto swap = [&] (const char* name, size_t opcode, Reg a, Reg b) {
-        insert(opcode, name, [a, b] (Emitter& e) {
-            ssa c = e.state[a];
-            e.state[a] = e.state[b];
-            e.state[b] = c;
-            e.IncCycle();
-         });
-    };
-
-    // XBA -- swap B and A
-    insert(0xeb, "XBA", [] (Emitter& e) {
-        ssa old_b = e.state[B];
-        e.state[B] = e.state[A];
-        e.state[A] = old_b;
-        nz_flags(e, e.state[A]); // Flags get updated according to the new 8 bit A value
+    e.If(e.Not(e.state[Flag_X]), [&] () {
+        ssa addr2 = e.Add(addr, 1);
+        if (type == idxmem_type::STORE) {
+            e.Write(addr2, e.Extract(e.state[reg], 8, 8));
+        } else {
+            ssa val_high = e.Read(addr);
+            if (type == idxmem_type::CMP) {
+                ssa dst_high = e.Extract(e.state[reg], 8, 8);
+                compare(e, dst_high, val_high);
+            }
+            if (type == idxmem_type::LOAD) {
+                e.state[reg] = e.Cat(val_high, val_low);
+                nz_flags(e, val_high);
+            }
+        }
         e.IncCycle();
     });
-    // XCE -- swap carry and emu flags
-    insert(0xfb, "XCE", [] (Emitter& e) {
-            ssa tmp = e.state[Flag_E];
-            e.state[Flag_E] = e.state[Flag_C];
-            e.state[Flag_C] = tmp;
-            e.IncCycle();
-    });
+}
 
-    // Flag Modification Instructions:
+template<Reg reg>
+void IndexLoadImmediate(Emitter& e) {
+    ssa low = ReadPc(e);
+    nz_flags(e, low);
 
-    auto flag = [&] (const char* name, size_t opcode, Reg flag, int value) {
-        insert(opcode, name, [flag, value] (Emitter& e) {
-            e.state[flag] = e.Const<1>(value);
-            // TODO: Dummy read to PC+1
-            e.IncCycle();
-        });
-    };
-
-    flag("CLC", 0x18, Flag_C, 0);
-    flag("SEC", 0x38, Flag_C, 1);
-    flag("CLI", 0x58, Flag_I, 0);
-    flag("SEI", 0x78, Flag_I, 1);
-    flag("CLV", 0xb8, Flag_V, 0);
-    flag("CLD", 0xd8, Flag_D, 0);
-    flag("SED", 0xf8, Flag_D, 1);
-
-    enum stack_mode {
-        STACK_8,  // Always 8 bits
-        STACK_16, // Always 16 bits
-        STACK_X,  // Depends on X (PHX/PHY/PLX/PLY)
-        STACK_M,  // Depends on M (PHA/PLA)
-    };
-
-    // Stack instructions:
-    auto push = [&] (const char* name, size_t opcode, stack_mode mode, std::function<ssa(Emitter&)> fn) {
-        insert(opcode, name, [fn, mode] (Emitter &e) {
-            // TODO: Dummy Read to PBR,PC+1
-            e.IncCycle(); // Internal operation
-            ssa value = fn(e);
-            ssa high = mode == STACK_8 ? value : e.Extract(value, 8, 8);
-
-            e.Write(e.state[S], high);
-            modifyStack(e, -1);
-            e.IncCycle();
+    ssa wide = e.Not(e.state[Flag_X]);
 
-            if (mode == STACK_8)
-                return;
+    ssa high;
+    e.If(wide, [&] () {
+        high = ReadPc(e);
+        nz_flags(e, high);
+    });
 
-            ssa low = e.Extract(value, 0, 8);
+    e.state[reg] = e.Cat(e.Ternary(wide, high, e.Const<8>(0)), low);
+}
 
-            if (mode == STACK_16) {
-                e.Write(e.state[S], low);
-                modifyStack(e, -1);
-                e.IncCycle();
-            } else {
-                ssa cond = e.Not(e.state[mode == STACK_X ? Flag_X : Flag_M]);
-                e.If(cond, [&]  {
-                    e.Write(e.state[S], low);
-                    modifyStack(e, -1);
-                    e.IncCycle();
-                });
-            }
-        });
-    };
-    auto pull = [&] (const char* name, size_t opcode, stack_mode mode, std::function<void(Emitter&, ssa)> fn) {
-        insert(opcode, name, [fn, mode] (Emitter &e) {
-            // TODO: Dummy Read to PBR,PC+1
-            e.IncCycle(); // Internal operation
+template<Reg reg>
+void IndexCompareImmediate(Emitter& e) {
+    ssa low = ReadPc(e);
+    ssa dst_low = e.Extract(e.state[reg], 0, 8);
+    compare(e, dst_low, low);
 
-            modifyStack(e, 1);
-            // TODO: Dummy Read to PBR,PC+1
-            e.IncCycle(); // Internal operation
+    ssa wide = e.Not(e.state[Flag_X]);
 
-            ssa low = e.Read(e.state[S]);
-            e.IncCycle();
+    ssa high;
+    e.If(wide, [&] () {
+        high = ReadPc(e);
+        ssa dst_high = e.Extract(e.state[reg], 8, 8);
+        compare(e, dst_high, high);
+    });
+}
 
-            if (mode == STACK_8) {
-                fn(e, low);
-                return;
-            }
+template<idxmem_type type, Reg reg>
+constexpr void idxmem(OpcodeTable& t, const char* name, size_t op_base) {
+    constexpr Reg other = reg == X ? Y : X;
 
-            if (mode == STACK_16) {
-                modifyStack(e, 1);
-                ssa high = e.Read(e.state[S]);
-                fn(e, e.Cat(high, low));
-                e.IncCycle();
-            } else {
-                nz_flags(e, low);
-                ssa cond = e.Not(e.state[mode == STACK_X ? Flag_X : Flag_M]);
-                ssa high;
-                e.If(cond, [&] () {
-                    modifyStack(e, 1);
-                    high = e.Read(e.state[S]);
-                    nz_flags(e, high);
-                    e.IncCycle();
-                });
-                if (mode == STACK_X) {
-                    fn(e, e.Ternary(cond, e.Cat(high, low), high));
-                } else { // STACK_M aka PLA
-                    // Ignore fn and handle Accumulator directly
-                    e.state[A] = low;
-                    e.state[B] = e.Ternary(cond, high, e.state[B]);
-                }
-            }
-        });
-    };
-
-    push("PHP", 0x08, STACK_8,  [] (Emitter &e) { return pack_flags(e); });
-    pull("PLP", 0x28, STACK_8,  [] (Emitter &e, ssa val) { unpack_flags(e, val); });
-    push("PHA", 0x48, STACK_M,  [] (Emitter &e) { return e.Cat(e.state[A], e.state[B]); });
-    pull("PLA", 0x68, STACK_M,  [] (Emitter &e, ssa val) { /* Handled as a special case */ });
-    push("PHY", 0x5A, STACK_X,  [] (Emitter &e) { return e.state[Y]; });
-    pull("PLY", 0x7A, STACK_X,  [] (Emitter &e, ssa val) { e.state[Y] = val; });
-    push("PHX", 0xDA, STACK_X,  [] (Emitter &e) { return e.state[X]; });
-    pull("PLX", 0xFA, STACK_X,  [] (Emitter &e, ssa val) { e.state[X] = val; });
-    push("PHD", 0x0B, STACK_16, [] (Emitter &e) { return e.state[D]; });
-    pull("PLD", 0x2B, STACK_16, [] (Emitter &e, ssa val) { e.state[D] = val; });
-    push("PHK", 0x4B, STACK_8,  [] (Emitter &e) { return e.state[PBR]; });
-    // There is no PLK
-    push("PHD", 0x8B, STACK_8,  [] (Emitter &e) { return e.state[DBR]; });
-    pull("PLD", 0xAB, STACK_8,  [] (Emitter &e, ssa val) { e.state[DBR] = val; });
-
-    // Unconditional Jump Instructions:
-    //       a    al   (a)   (a,x)
-    // JMP   4c   5c   6c    7c
-    // JML             dc
-    // JSR   20              fc
-    // JSL        22
-
-    // No real pattern to extract here.
-
-    auto jump = [&] (const char* name, size_t opcode, std::function<ssa(Emitter&, bool)> address_fn, bool subroutine) {
-        insert(opcode, name, [address_fn, subroutine] (Emitter& e) {
-            ssa long_address = address_fn(e, false);
-            if (subroutine) {
-                // TODO: Dummy Read to PBR,PC+2
-                e.IncCycle(); // Internal operation
-
-                // Return address is the last byte of the instruction
-                ssa return_address = e.Sub(e.state[PC], e.Const<16>(1));
-                ssa low =  e.Extract(return_address, 0, 8);
-                ssa high =  e.Extract(return_address, 8, 8);
-                e.Write(e.Cat(e.Const<8>(0), e.state[S]), high);
-                e.IncCycle();
+    insert(t, op_base + 0x04, name, IndexMemory<type, reg, Direct>);
+    insert(t, op_base + 0x0c, name, IndexMemory<type, reg, Absolute>);
 
-                modifyStack(e, -1);
-                e.Write(e.Cat(e.Const<8>(0), e.state[S]), low);
-                e.IncCycle();
+    if (type != idxmem_type::CMP)
+        insert(t, op_base + 0x14, name, IndexMemory<type, reg, DirectIndex<other>>);
+    if (type == idxmem_type::LOAD) {
+        insert(t, op_base + 0x1c, name, IndexMemory<type, reg, AbsoluteIndex<other>>);
+        insert(t, op_base + 0x00, name, IndexLoadImmediate<reg>);
+    }
+    if (type == idxmem_type::CMP) {
+        insert(t, op_base + 0x00, name, IndexCompareImmediate<reg>);
+    }
+}
 
-                modifyStack(e, -1);
-            }
-            e.state[PC] = e.Extract(long_address, 0, 16);
-            e.state[PBR] = e.Extract(long_address, 16, 8);
-            e.MarkBlockEnd();
-        });
-    };
-
-    jump("JMP", 0x4c, Absolute, false);
-    jump("JMP", 0x5c, AbsoluteLong, false);
-    jump("JMP", 0x6c, IndirectAbsolute, false);
-    //jump("JMP", 0x7c, AbsoluteIndexedXIndirect, false);
-    //jump("JML", 0x5c, AbsoluteIndirectLong, false);
-    jump("JSR", 0x20, Absolute, true);
-    //jump("JSR", 0xfc, AbsoluteIndexedXIndirect, true);
-    //jump("JSL", 0x22, AbsoluteIndirectLong, true);
-
-    insert(0x60, "RTS", [] (Emitter& e) {
-        // TODO: Dummy Read to PBR,PC+1
-        e.IncCycle(); // Internal operation
+// STZ  dir     abs     dir,X    abs,X
+//      64      9c      74       9e
 
-        modifyStack(e, +1);
+// Store Zero kind of fits into the above Index<-->Memory pattern if you squint.
+// But its cleanly been stuffed into free slots.
 
-        // TODO: Dummy Read to PBR,PC+1
-        e.IncCycle(); // Internal operation
+template<address_fn address>
+void StoreZero(Emitter& e) {
+    e.Write(address(e, true), e.Const<8>(0));
+    e.IncCycle();
+}
 
-        ssa low = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
-        modifyStack(e, +1);
-        e.IncCycle();
+// Implied Operations on Index:
+// DEY  88
+// INY  c8
+// DEX  ca
+// INX  e8
 
-        ssa high  = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
-        e.IncCycle();
+template<Reg index, int dir>
+void Increment(Emitter& e) {
+    ssa result = e.Add(e.state[index], e.Const<16>(u16(dir)));
+    storeReg16(e, index, result);
 
-        ssa return_address = e.Cat(high, low);
+    // TODO: Dummy read to PC + 1
+    e.IncCycle(); // Internal operation;
+}
 
-        // The return address on stack is the last byte of the JSR instruction
-        // So increment by one
-        e.state[PC] = e.Add(return_address, e.Const<16>(1));
-        e.MarkBlockEnd();
+// Transfer operations:
+// TXA  8a  x -> a.
+// TYA  98
+// TXS  9a -- special. Doesn't effect flags
+// TXY  9b
+// TAY  a8
+// TAX  aa
+// TSX  ba
+// TYX  bb
+
+// TCD  5b
+// TCS  1b
+// TDC  7b
+// TSC  3B
+
+template<Reg src, Reg dst>
+void Move(Emitter& e) {
+    // loadReg16 and storeReg16 handle all compexities
+    // Correctly handling the M and X flags and updating flags on store (except when storing to S)
+    ssa value = loadReg16(e, src);
+    storeReg16(e, dst, value);
+
+    // TODO: Dummy read to PC + 1
+    e.IncCycle();
+}
 
-        // TODO: Dummy Read to S
-        e.IncCycle(); // Internal operation
-    });
+template<Reg a, Reg b>
+void Swap(Emitter& e) {
+    ssa c = e.state[a];
+    e.state[a] = e.state[b];
+    e.state[b] = c;
+    e.IncCycle();
+}
 
-    insert(0x40, "RTI", [] (Emitter& e) {
-        // TODO: Dummy Read to PBR,PC+1
-        e.IncCycle(); // Internal operation
+// XBA -- swap B and A
+void XBA(Emitter& e) {
+    ssa old_b = e.state[B];
+    e.state[B] = e.state[A];
+    e.state[A] = old_b;
+    nz_flags(e, e.state[A]); // Flags get updated according to the new 8 bit A value
+    e.IncCycle();
+}
 
-        modifyStack(e, +1);
+// XCE -- swap carry and emu flags
+void XCE(Emitter& e) {
+    ssa tmp = e.state[Flag_E];
+    e.state[Flag_E] = e.state[Flag_C];
+    e.state[Flag_C] = tmp;
+    e.IncCycle();
+}
 
-        // TODO: Dummy Read to PBR,PC+1
-        e.IncCycle(); // Internal operation
+// Flag Modification Instructions:
 
-        // Read status register
-        ssa val = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
-        unpack_flags(e, val);
-        modifyStack(e, +1);
-        e.IncCycle();
+template<Reg flag, int value>
+void SetFlag(Emitter& e) {
+    e.state[flag] = e.Const<1>(value);
+    // TODO: Dummy read to PC+1
+    e.IncCycle();
+}
 
-        ssa low = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
-        modifyStack(e, +1);
-        e.IncCycle();
+// Stack instructions:
 
-        ssa high  = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
-        e.IncCycle();
+enum stack_mode {
+    STACK_8,  // Always 8 bits
+    STACK_16, // Always 16 bits
+    STACK_X,  // Depends on X (PHX/PHY/PLX/PLY)
+    STACK_M,  // Depends on M (PHA/PLA)
+};
 
-        ssa return_address = e.Cat(high, low);
+template<stack_mode mode, ssa (*fn)(Emitter&)>
+void Push(Emitter &e) {
+    // TODO: Dummy Read to PBR,PC+1
+    e.IncCycle(); // Internal operation
+    ssa value = fn(e);
+    ssa high = mode == STACK_8 ? value : e.Extract(value, 8, 8);
 
-        // Unlike RTS, return address doesn't need to be incremented
-        e.state[PC] = return_address;
-        e.MarkBlockEnd();
+    e.Write(stackAddress(e), high);
+    modifyStack(e, -1);
+    e.IncCycle();
 
-        // Finally, if we are in native mode, pull the Program Bank register
-        e.If(e.Not(e.state[Flag_E]), [&] () {
-            modifyStack(e, +1);
-            e.IncCycle();
-            ssa pbr  = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
-            e.state[PBR] = pbr;
-        });
-    });
+    if (mode == STACK_8)
+        return;
 
-    // Conditional Branch Instructions:
-
-    auto branch = [&] (const char* name, size_t opcode, std::function<ssa(Emitter&)> condition_fn) {
-        insert(opcode, name, [condition_fn] (Emitter& e) {
-            ssa cond = condition_fn(e);
-            ssa offset = ReadPc(e);
-            e.If(cond, [&] () {
-                ssa old_pc = e.state[PC];
-                e.state[PC] = e.Add(e.state[PC], e.Cat(e.Const<8>(0), offset));
-                e.IncCycle(); // Extra cycle when branch taken
-                e.If(e.state[Flag_E], [&] () {
-                    // In emulation mode, an extra cycle is taken when a branch crosses a page boundary
-                    e.If(e.Neq(e.Extract(old_pc, 8, 8), e.Extract(e.state[PC], 8, 8)), [&] () {
-                        e.state[CYCLE] = e.Add(e.state[CYCLE], e.Const<64>(1));
-                    });
-                });
-            });
+    ssa low = e.Extract(value, 0, 8);
 
-            e.MarkBlockEnd();
-        });
-    };
-
-    branch("BPL", 0x10, [] (Emitter& e) { return e.Not(e.state[Flag_N]); });
-    branch("BMI", 0x30, [] (Emitter& e) { return e.state[Flag_N]; });
-    branch("BCV", 0x50, [] (Emitter& e) { return e.Not(e.state[Flag_V]); });
-    branch("BSV", 0x70, [] (Emitter& e) { return e.state[Flag_V]; });
-    branch("BRA", 0x80, [] (Emitter& e) { return e.Const<1>(1); });
-    branch("BCC", 0x90, [] (Emitter& e) { return e.Not(e.state[Flag_C]); });
-    branch("BCS", 0xB0, [] (Emitter& e) { return e.state[Flag_C]; });
-    branch("BNE", 0xD0, [] (Emitter& e) { return e.Not(e.state[Flag_Z]); });
-    branch("BEQ", 0xF0, [] (Emitter& e) { return e.state[Flag_Z]; });
-
-    // Nop Instruction:
-    insert(0xea, "NOP", [] (Emitter& e) {
-        // TODO: Dummy read to PBR,PC+1
+    if (mode == STACK_16) {
+        e.Write(stackAddress(e), low);
+        modifyStack(e, -1);
         e.IncCycle();
-    });
+    } else {
+        ssa cond = e.Not(e.state[mode == STACK_X ? Flag_X : Flag_M]);
+        e.If(cond, [&]  {
+            e.Write(stackAddress(e), low);
+            modifyStack(e, -1);
+            e.IncCycle();
+        });
+    }
 }
 
+template<stack_mode mode, void (*fn)(Emitter&, ssa)>
+void Pull(Emitter &e) {
+    // TODO: Dummy Read to PBR,PC+1
+    e.IncCycle(); // Internal operation
 
-void emit(Emitter& e, u8 opcode) {
-    // The opcode always gets baked into the IR trace, so we need emit code to check it hasn't changed
-    ssa runtime_opcode = ReadPc(e);
-    e.Assert(runtime_opcode, e.Const<8>(opcode));
+    modifyStack(e, 1);
+    // TODO: Dummy Read to PBR,PC+1
+    e.IncCycle(); // Internal operation
 
-    e.zero_lower.reset();
+    ssa low = e.Read(e.state[S]);
+    e.IncCycle();
 
-    gen_table[opcode](e);
-}
+    if (mode == STACK_8) {
+        fn(e, low);
+        return;
+    }
 
+    if (mode == STACK_16) {
+        modifyStack(e, 1);
+        ssa high = e.Read(e.state[S]);
+        fn(e, e.Cat(high, low));
+        e.IncCycle();
+    } else {
+        nz_flags(e, low);
+        ssa cond = e.Not(e.state[mode == STACK_X ? Flag_X : Flag_M]);
+        ssa high;
+        e.If(cond, [&] () {
+            modifyStack(e, 1);
+            high = e.Read(e.state[S]);
+            nz_flags(e, high);
+            e.IncCycle();
+        });
+        if (mode == STACK_X) {
+            fn(e, e.Ternary(cond, e.Cat(high, low), high));
+        } else { // STACK_M aka PLA
+            // Ignore fn and handle Accumulator directly
+            e.state[A] = low;
+            e.state[B] = e.Ternary(cond, high, e.state[B]);
+        }
+    }
 }
 
-void interpeter_loop() {
+template<Reg reg>
+ssa GetReg(Emitter &e) { return e.state[reg]; }
 
-    // Initial register state
-    registers[m65816::Flag_M] = 1;
-    registers[m65816::Flag_X] = 1;
-    registers[m65816::Flag_E] = 1;
-    registers[m65816::Flag_I] = 1;
-    registers[m65816::S] = 0x01fd;
+template<Reg reg>
+void SetReg(Emitter &e, ssa val) { e.state[reg] = val; }
 
-    u32 pc = 0xc000;
-    m65816::Emitter e(pc);
+ssa GetAcc(Emitter &e) { return e.Cat(e.state[A], e.state[B]); }
+void SetAcc(Emitter &, ssa) { /* Handled as a special case */ }
 
-    std::vector<u64> ssalist;
-    std::vector<u8> ssatype;
-    int offset = 0;
+// Unconditional Jump Instructions:
+//       a    al   (a)   (a,x)
+// JMP   4c   5c   6c    7c
+// JML             dc
+// JSR   20              fc
+// JSL        22
 
-    u8 a = 0;
-    u16 x = 0;
-    u16 y = 0;
-    u8  p = 0x24;
-    u8 sp = 0xfd;
-    u64 cycle = 0;
+// No real pattern to extract here.
 
+template<address_fn address, bool subroutine>
+void Jump(Emitter& e) {
+    ssa long_address = address(e, false);
+    if (subroutine) {
+        // TODO: Dummy Read to PBR,PC+2
+        e.IncCycle(); // Internal operation
 
-    int count = 6000;
+        // Return address is the last byte of the instruction
+        ssa return_address = e.Sub(e.state[PC], e.Const<16>(1));
+        ssa low =  e.Extract(return_address, 0, 8);
+        ssa high =  e.Extract(return_address, 8, 8);
+        e.Write(e.Cat(e.Const<8>(0), stackAddress(e)), high);
+        e.IncCycle();
 
-    while (count-- > 0) {
+        modifyStack(e, -1);
+        e.Write(e.Cat(e.Const<8>(0), stackAddress(e)), low);
+        e.IncCycle();
 
+        modifyStack(e, -1);
+    }
+    e.state[PC] = e.Extract(long_address, 0, 16);
+    e.state[PBR] = e.Extract(long_address, 16, 8);
+    e.MarkBlockEnd();
+}
 
-        u8 opcode = memory[pc];
+// Absolute jumps stay in the program bank
+ssa AbsolutePbr(Emitter& e, bool) { return e.Cat(e.state[PBR], ReadPc16(e)); }
 
-        u32 nes_cycle    = (cycle * 3) % 341;
-        u32 nes_scanline = ((341 * 242 + (cycle * 3)) / 341) % 262 - 1;
-        printf("%04X  %02X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3i SL:%i\n", pc, opcode, a, x, y, p, sp, nes_cycle, nes_scanline);
+void RTS(Emitter& e) {
+    // TODO: Dummy Read to PBR,PC+1
+    e.IncCycle(); // Internal operation
 
-        m65816::emit(e, opcode);
-        partial_interpret(e.buffer, ssalist, ssatype, offset);
-        offset = e.buffer.size();
+    modifyStack(e, +1);
 
-        // Extract PC so we know the next instruction
-        pc = ssalist[e.state[m65816::PC].offset];
+    // TODO: Dummy Read to PBR,PC+1
+    e.IncCycle(); // Internal operation
 
-        // Extact other registers for debugging:
-        a  = ssalist[e.state[m65816::A].offset];
-        x  = ssalist[e.state[m65816::X].offset];
-        y  = ssalist[e.state[m65816::Y].offset];
-        sp = ssalist[e.state[m65816::S].offset] & 0xFF;
-        cycle = ssalist[e.state[m65816::CYCLE].offset];
-        p = ssalist[e.state[m65816::Flag_N].offset] << 7
-          | ssalist[e.state[m65816::Flag_V].offset] << 6
-          | 1 << 5
-          | 0 << 4
-          | ssalist[e.state[m65816::Flag_D].offset] << 3
-          | ssalist[e.state[m65816::Flag_I].offset] << 2
-          | ssalist[e.state[m65816::Flag_Z].offset] << 1
-          | ssalist[e.state[m65816::Flag_C].offset] << 0;
+    ssa low = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
+    modifyStack(e, +1);
+    e.IncCycle();
 
-        if (e.ending) {
-            printf("End of block\n");
-            e.Finalize();
-            partial_interpret(e.buffer, ssalist, ssatype, offset);
-            e = m65816::Emitter(pc);
-            offset = 0;
+    ssa high  = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
+    e.IncCycle();
 
-            ssalist.resize(0);
-            ssatype.resize(0);
-        }
-    }
+    ssa return_address = e.Cat(high, low);
 
-    e.Finalize();
-    partial_interpret(e.buffer, ssalist, ssatype, offset);
+    // The return address on stack is the last byte of the JSR instruction
+    // So increment by one
+    e.state[PC] = e.Add(return_address, e.Const<16>(1));
+    e.MarkBlockEnd();
 
+    // TODO: Dummy Read to S
+    e.IncCycle(); // Internal operation
 }
 
-void load_nestest() {
-    FILE *f = fopen("nestest.nes", "rb");
-    assert(f != nullptr);
+void RTI(Emitter& e) {
+    // TODO: Dummy Read to PBR,PC+1
+    e.IncCycle(); // Internal operation
 
-    fseek(f, 16, SEEK_SET); // Skip header
+    modifyStack(e, +1);
 
-    // Read 16 kilobytes to memory[0xc000]
-    for (int i = 0; i < 0x4000; i++) {
-        char byte;
-        fread(&byte, 1, 1, f);
-        memory[0xc000 + i] = byte;
-        memory[0x8000 + i] = byte; // And it's mirror
-    }
+    // TODO: Dummy Read to PBR,PC+1
+    e.IncCycle(); // Internal operation
 
-    fclose(f);
-}
+    // Read status register
+    ssa val = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
+    unpack_flags(e, val);
+    modifyStack(e, +1);
+    e.IncCycle();
 
-int main(int, char**) {
-    printf("test\n");
+    ssa low = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
+    modifyStack(e, +1);
+    e.IncCycle();
 
-    m65816::populate_tables();
+    ssa high  = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
+    e.IncCycle();
 
-    int count = 255;
+    ssa return_address = e.Cat(high, low);
 
+    // Unlike RTS, return address doesn't need to be incremented
+    e.state[PC] = return_address;
+    e.MarkBlockEnd();
 
-    printf("     ");
-    for(int i = 0; i<16; i++) {
-        printf("  0x%x ", i);
-    }
+    // Finally, if we are in native mode, pull the Program Bank register
+    e.If(e.Not(e.state[Flag_E]), [&] () {
+        modifyStack(e, +1);
+        e.IncCycle();
+        ssa pbr  = e.Read(e.Cat(e.Const<8>(0), e.state[S]));
+        e.state[PBR] = pbr;
+    });
+}
 
-    m65816::Emitter e(0);
+// Conditional Branch Instructions:
+
+template<ssa (*condition)(Emitter&)>
+void Branch(Emitter& e) {
+    ssa cond = condition(e);
+    ssa offset = ReadPc(e);
+    e.If(cond, [&] () {
+        // The offset is signed
+        ssa high = e.Ternary(e.Extract(offset, 7, 1), e.Const<8>(0xff), e.Const<8>(0));
+        ssa old_pc = e.state[PC];
+        e.state[PC] = e.Add(e.state[PC], e.Cat(high, offset));
+        e.IncCycle(); // Extra cycle when branch taken
+        e.If(e.state[Flag_E], [&] () {
+            // In emulation mode, an extra cycle is taken when a branch crosses a page boundary
+            e.If(e.Neq(e.Extract(old_pc, 8, 8), e.Extract(e.state[PC], 8, 8)), [&] () {
+                e.IncCycle();
+            });
+        });
+    });
 
-    for(int i = 0; i < 16; i++) {
-        printf ("\n0x%x  ", i);
-        for(int j = 0; j < 16; j++) {
-            int op = i << 4 | j;
-            printf("%5s ", m65816::name_table[op].c_str());
+    e.MarkBlockEnd();
+}
 
-            if(m65816::name_table[op] == "") {
-                count--;
-            } else {
-                //m65816::emit(e, op);
-            }
-        }
-    }
+template<Reg flag>
+ssa FlagSet(Emitter& e) { return e.state[flag]; }
 
-    printf("\n\n\t\t%i/255\n", count);
+template<Reg flag>
+ssa FlagClear(Emitter& e) { return e.Not(e.state[flag]); }
 
-    load_nestest();
+ssa Always(Emitter& e) { return e.Const<1>(1); }
 
-    interpeter_loop();
-    return 0;
+// Nop Instruction:
+void NOP(Emitter& e) {
+    // TODO: Dummy read to PBR,PC+1
+    e.IncCycle();
+}
 
-    m65816::emit(e,  0xe9);
+constexpr OpcodeTable build_table() {
+    OpcodeTable t {};
+
+    universal<ORA>(t, "ORA", 0x00);
+    universal<AND>(t, "AND", 0x20);
+    universal<EOR>(t, "EOR", 0x40);
+    universal<ADC>(t, "ADC", 0x60);
+    universal<STA, true>(t, "STA", 0x80);
+    universal<LDA>(t, "LDA", 0xa0);
+    universal<CMP>(t, "CMP", 0xc0);
+    universal<SBC>(t, "SBC", 0xe0);
+
+    rwm<ASL>(t, "ASL", 0x00);
+    rwm<ROL>(t, "ROL", 0x20);
+    rwm<LSR>(t, "LSR", 0x40);
+    rwm<ROR>(t, "ROR", 0x60);
+    rwm<INC>(t, "INC", 0xe0);
+    rwm<DEC>(t, "DEC", 0xc0);
+
+    bit(t);
+
+    idxmem<idxmem_type::STORE, Y>(t, "STY", 0x80);
+    idxmem<idxmem_type::STORE, X>(t, "STX", 0x82);
+    idxmem<idxmem_type::LOAD,  Y>(t, "LDY", 0xa0);
+    idxmem<idxmem_type::LOAD,  X>(t, "LDX", 0xa2);
+    idxmem<idxmem_type::CMP,   Y>(t, "CPY", 0xc0);
+    idxmem<idxmem_type::CMP,   X>(t, "CPX", 0xe0);
+
+    insert(t, 0x64, "STZ", StoreZero<Direct>);
+    insert(t, 0x9c, "STZ", StoreZero<Absolute>);
+    insert(t, 0x74, "STZ", StoreZero<DirectIndex<X>>);
+    insert(t, 0x9e, "STZ", StoreZero<AbsoluteIndex<X>>);
+
+    insert(t, 0x88, "DEY", Increment<Y, -1>);
+    insert(t, 0xc8, "INY", Increment<Y,  1>);
+    insert(t, 0xca, "DEX", Increment<X, -1>);
+    insert(t, 0xe8, "INX", Increment<X,  1>);
+
+    insert(t, 0x8a, "TXA", Move<X, A>);
+    insert(t, 0x98, "TYA", Move<Y, A>);
+    insert(t, 0x9a, "TXS", Move<X, S>); // doesn't touch flags
+    insert(t, 0x9b, "TXY", Move<X, Y>);
+    insert(t, 0xa8, "TAX", Move<A, Y>);
+    insert(t, 0xaa, "TAX", Move<A, X>);
+    insert(t, 0xba, "TSX", Move<S, X>);
+    insert(t, 0xbb, "TYX", Move<Y, X>);
+    insert(t, 0x5b, "TCD", Move<A, D>);
+    insert(t, 0x1b, "TCS", Move<A, S>); // doesn't touch flags
+    insert(t, 0x7b, "TDC", Move<D, A>);
+    insert(t, 0x3b, "TSC", Move<S, A>);
+
+    insert(t, 0xeb, "XBA", XBA);
+    insert(t, 0xfb, "XCE", XCE);
+
+    insert(t, 0x18, "CLC", SetFlag<Flag_C, 0>);
+    insert(t, 0x38, "SEC", SetFlag<Flag_C, 1>);
+    insert(t, 0x58, "CLI", SetFlag<Flag_I, 0>);
+    insert(t, 0x78, "SEI", SetFlag<Flag_I, 1>);
+    insert(t, 0xb8, "CLV", SetFlag<Flag_V, 0>);
+    insert(t, 0xd8, "CLD", SetFlag<Flag_D, 0>);
+    insert(t, 0xf8, "SED", SetFlag<Flag_D, 1>);
+
+    insert(t, 0x08, "PHP", Push<STACK_8,  pack_flags>);
+    insert(t, 0x28, "PLP", Pull<STACK_8,  unpack_flags>);
+    insert(t, 0x48, "PHA", Push<STACK_M,  GetAcc>);
+    insert(t, 0x68, "PLA", Pull<STACK_M,  SetAcc>);
+    insert(t, 0x5A, "PHY", Push<STACK_X,  GetReg<Y>>);
+    insert(t, 0x7A, "PLY", Pull<STACK_X,  SetReg<Y>>);
+    insert(t, 0xDA, "PHX", Push<STACK_X,  GetReg<X>>);
+    insert(t, 0xFA, "PLX", Pull<STACK_X,  SetReg<X>>);
+    insert(t, 0x0B, "PHD", Push<STACK_16, GetReg<D>>);
+    insert(t, 0x2B, "PLD", Pull<STACK_16, SetReg<D>>);
+    insert(t, 0x4B, "PHK", Push<STACK_8,  GetReg<PBR>>);
+    // There is no PLK
+    insert(t, 0x8B, "PHD", Push<STACK_8,  GetReg<DBR>>);
+    insert(t, 0xAB, "PLD", Pull<STACK_8,  SetReg<DBR>>);
+
+    insert(t, 0x4c, "JMP", Jump<AbsolutePbr, false>);
+    insert(t, 0x5c, "JMP", Jump<AbsoluteLong, false>);
+    insert(t, 0x6c, "JMP", Jump<IndirectAbsolute, false>);
+    //insert(t, 0x7c, "JMP", Jump<AbsoluteIndexedXIndirect, false>);
+    //insert(t, 0x5c, "JML", Jump<AbsoluteIndirectLong, false>);
+    insert(t, 0x20, "JSR", Jump<AbsolutePbr, true>);
+    //insert(t, 0xfc, "JSR", Jump<AbsoluteIndexedXIndirect, true>);
+    //insert(t, 0x22, "JSL", Jump<AbsoluteIndirectLong, true>);
+
+    insert(t, 0x60, "RTS", RTS);
+    insert(t, 0x40, "RTI", RTI);
+
+    insert(t, 0x10, "BPL", Branch<FlagClear<Flag_N>>);
+    insert(t, 0x30, "BMI", Branch<FlagSet<Flag_N>>);
+    insert(t, 0x50, "BCV", Branch<FlagClear<Flag_V>>);
+    insert(t, 0x70, "BSV", Branch<FlagSet<Flag_V>>);
+    insert(t, 0x80, "BRA", Branch<Always>);
+    insert(t, 0x90, "BCC", Branch<FlagClear<Flag_C>>);
+    insert(t, 0xB0, "BCS", Branch<FlagSet<Flag_C>>);
+    insert(t, 0xD0, "BNE", Branch<FlagClear<Flag_Z>>);
+    insert(t, 0xF0, "BEQ", Branch<FlagSet<Flag_Z>>);
+
+    insert(t, 0xea, "NOP", NOP);
+
+    return t;
+}
 
-    e.Finalize();
+constexpr OpcodeTable opcode_table = build_table();
 
-    auto code = e.buffer;
+constexpr std::array<const char*, 256> build_names() {
+    std::array<const char*, 256> names {};
+    for (size_t i = 0; i < names.size(); i++)
+        names[i] = opcode_table[i].name;
+    return names;
+}
 
-    auto printarg = [&] (u16 arg) {
-        // exclude null args
-        if (arg == 0xffff) return;
+} // namespace
 
-        IR_Base ir = code[arg];
+constexpr std::array<const char*, 256> name_table = build_names();
 
-        if (ir.is<IR_Const32>()) {
-            auto value = ir.cast<IR_Const32>();
-            printf(" %c%i(%i)", value->is_signed ? 's' : 'u', value->num_bits, value->arg_32);
-        }
-        else {
-            printf(" ssa%i", arg);
-        }
-    };
-
-    for (int i = 0; i < code.size(); i++) {
-        IR_Base ir = code[i];
-        if (ir.id < 0x8000) {
-            printf("% 3i: %s", i, OpcodeName(ir.id));
-            printarg(ir.arg_1);
-            printarg(ir.arg_2);
-            printarg(ir.arg_3);
-            printf("\n");
-        } else if (ir.id == 0x8000) {
-            printf("const48 %lx\n", ir.arg_48);
-        } else if (ir.id == Const) {
-            // Don't print consts, because printarg inlines them
-            //printf("const%i %x\n", ir.num_bits, ir.arg_32);
-        }
-    }
+void emit(Emitter& e, u8 opcode) {
+    e.instruction_start = e.CodeAddress();
+
+    // The opcode always gets baked into the IR trace, so we need emit code to check it hasn't changed
+    ssa runtime_opcode = ReadPc(e);
+    e.Assert(runtime_opcode, e.Const<8>(opcode));
 
-}
\ No newline at end of file
+    e.zero_lower.reset();
+
+    opcode_table[opcode].emit(e);
+}
+
+}
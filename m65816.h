@@ -3,6 +3,8 @@
 #include "ir_base.h"
 //#include "m65816_emitter.h"
 
+#include <array>
+
 namespace m65816 {
 
 enum Reg {
@@ -25,11 +27,18 @@ enum Reg {
     Flag_C, // Carry
     Flag_E, // Emulation mode
     CYCLE, // Not a register, but lets pretend.
+    RETIRED, // Neither is this. Instructions run by the last superblock, which might leave early
     NUM_REGS
 };
 
 class Emitter;
 
+// Mnemonics, "" for unimplemented opcodes. Built at compile time along with the emit table
+extern const std::array<const char*, 256> name_table;
+
+// Emits IR for a single instruction
+void emit(Emitter& e, u8 opcode);
+
 // Address Modes
 
 ssa ReadPc(Emitter& e);
@@ -73,7 +73,7 @@ ssa AbsoluteLongX(Emitter& e, bool is_store) {
 
 static ssa Direct16(Emitter & e) {
     ssa offset = ReadPc(e);
-    ssa DL_cycle = e.Neq(e.Const<8>(0), e.Extract(e.state[D], 0, 8));
+    ssa DL_cycle = e.DirectLowIsZero() ? e.Const<1>(0) : e.Neq(e.Const<8>(0), e.Extract(e.state[D], 0, 8));
 
     e.If(DL_cycle, [&] {
         // TODO: Dummy read to PBR,PC+1
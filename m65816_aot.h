@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+
+#include <algorithm>
+#include <utility>
+#include <stddef.h>
+
+namespace m65816 {
+
+// mem[address & 0xffff] held byte when the block was recompiled, like Block::guards
+struct AotGuard {
+    u32 address;
+    u8 byte;
+};
+
+// A block that was recompiled ahead of time by firerecomp.
+// fn has the same signature as JitX64::BlockFn, but doesn't use the slots.
+struct AotBlock {
+    u32 pc;
+    u8 mode;
+    int instructions;
+    void (*fn)(u64* slots, u64* regs, u8* mem);
+    const AotGuard* guards;
+    size_t guard_count;
+};
+
+// Defined by the file firerecomp generates, sorted by pc then mode.
+extern const AotBlock aot_blocks[];
+extern const size_t aot_block_count;
+
+// Returns nullptr if the block wasn't recompiled, the caller should fall back to the runtime path
+inline const AotBlock* FindAotBlock(u32 pc, u8 mode) {
+    const AotBlock* end = aot_blocks + aot_block_count;
+    const AotBlock* it = std::lower_bound(aot_blocks, end, std::make_pair(pc, mode),
+        [] (const AotBlock& block, std::pair<u32, u8> key) {
+            return std::make_pair(block.pc, block.mode) < key;
+        });
+    if (it != end && it->pc == pc && it->mode == mode)
+        return it;
+    return nullptr;
+}
+
+}
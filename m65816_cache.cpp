@@ -0,0 +1,456 @@
+#include "m65816_cache.h"
+#include "m65816_emitter.h"
+#include "ir_passes.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <cassert>
+
+namespace m65816 {
+
+bool print_blocks = false;
+
+// The value of node every time the block runs: constants and what is worked out from them.
+// Register loads are never evaluated, the register file only says what they hold right now.
+static std::optional<u64> Fixed(const std::vector<IR_Base>& ir, ssa node) {
+    static const EvaluateLoadFn no_loads = [] (u64, u64, int) -> std::optional<u64> { return {}; };
+    return evaluate(ir, node, no_loads);
+}
+
+// Works out the block's exits from the PBR and PC it leaves behind.
+// jumped is true if the last instruction jumped to a constant address that wasn't followed.
+static void FindExits(Block& block, const std::vector<IR_Base>& ir, ssa pbr, ssa pc, bool jumped) {
+    auto bank = Fixed(ir, pbr);
+    if (!bank) {
+        block.exits.push_back({ Exit::Computed });
+        return;
+    }
+
+    if (auto target = Fixed(ir, pc)) {
+        block.exits.push_back({ jumped ? Exit::Taken : Exit::FallThrough, u32(*bank << 16 | *target) });
+        return;
+    }
+
+    // Conditional branches leave Ternary(cond, taken, not_taken), see Emitter::If
+    const IR_Base& node = ir[pc.offset];
+    if (node.id == Ternary) {
+        auto taken = Fixed(ir, ssa { u16(node.arg_2) });
+        auto not_taken = Fixed(ir, ssa { u16(node.arg_3) });
+        if (taken && not_taken) {
+            block.exits.push_back({ Exit::Taken, u32(*bank << 16 | *taken) });
+            block.exits.push_back({ Exit::FallThrough, u32(*bank << 16 | *not_taken) });
+            return;
+        }
+    }
+
+    block.exits.push_back({ Exit::Computed });
+}
+
+// Working storage for EmitBlock, kept from one block to the next so emitting stops allocating
+// once it has seen a big enough block. Finished blocks get right-sized copies.
+struct EmitScratch {
+    Emitter e { 0 };
+    std::vector<std::pair<u32, u8>> guards;
+    std::vector<u32> instruction_pcs;
+    std::vector<Exit> side_exits;
+};
+
+// The flat memory array has nothing mapped into it
+static const PlainMemoryFn flat_memory = [] (u64 space, std::optional<u64>) {
+    return space == 1;
+};
+
+Block EmitBlock(u32 pc, u8 mode, int max_instructions, const u8* mem,
+                const ExitPredictor& predict, const PlainMemoryFn& is_plain) {
+    static thread_local EmitScratch scratch;
+
+    // The whole block is emitted before any of it runs, so the optimisation passes see
+    // all of it, even on the first run.
+    Emitter& e = scratch.e;
+    e.Reset(pc);
+    Block block(pc, mode);
+
+    auto& guards = scratch.guards;
+    auto& instruction_pcs = scratch.instruction_pcs;
+    auto& side_exits = scratch.side_exits;
+    guards.clear();
+    instruction_pcs.clear();
+    side_exits.clear();
+
+    // Lookup only returns blocks emitted for the current mode, which is the only guard they need
+    e.Specialize(Flag_E, e.Const<1>(mode & Mode_E ? 1 : 0));
+    e.Specialize(Flag_M, e.Const<1>(mode & Mode_M ? 1 : 0));
+    e.Specialize(Flag_X, e.Const<1>(mode & Mode_X ? 1 : 0));
+    e.assume_dl_zero = mode & Mode_DL0;
+    u32 next_pc = pc;
+    bool jumped = false;
+
+    u32 segment_start = pc; // Where the block, or the code after the last branch we followed, started
+    block.superblock = predict != nullptr;
+
+    // Instruction bytes are baked in as constants, so all of them need guarding
+    struct CodeFetch {
+        const u8* mem;
+        std::vector<std::pair<u32, u8>>& guards;
+    } fetch { mem, guards };
+    e.fetch_code = [] (void* context, u32 address) {
+        CodeFetch& fetch = *static_cast<CodeFetch*>(context);
+        u8 byte = fetch.mem[address & 0xffff];
+        fetch.guards.push_back({ address, byte });
+        return byte;
+    };
+    e.fetch_context = &fetch;
+
+    // Blocks stop before the IR gets anywhere near 16bit node numbers
+    constexpr size_t max_chain_nodes = 0x4000;
+    constexpr int max_side_exits = 8;
+
+    auto seen = [&] (u32 address) {
+        return std::find(instruction_pcs.begin(), instruction_pcs.end(), address) != instruction_pcs.end();
+    };
+
+    // Instructions are at most 4 bytes, so a store this close in front of pc might have changed it
+    auto stored = [&] (u32 pc) {
+        for (u16 address : e.constant_stores) {
+            if (u16(address - pc) < 4)
+                return true;
+        }
+        return false;
+    };
+
+    while (!e.ending && block.instructions < max_instructions) {
+        // Self-modifying code: the next block fetches the instruction once the store has happened
+        if (block.instructions > 0 && stored(next_pc)) {
+            e.MarkBlockEnd();
+            break;
+        }
+
+        u8 opcode = mem[next_pc & 0xffff];
+        if (!*name_table[opcode]) {
+            if (print_blocks)
+                printf("Unimplemented opcode %02X at %06X\n", opcode, next_pc);
+            break;
+        }
+
+        // Instruction decoding depends on E/M/X, so the block must end if they might have changed.
+        ssa old_e = e.state[Flag_E];
+        ssa old_m = e.state[Flag_M];
+        ssa old_x = e.state[Flag_X];
+
+        emit(e, opcode);
+
+        instruction_pcs.push_back(next_pc);
+        block.instructions++;
+
+        bool mode_changed = old_e.offset != e.state[Flag_E].offset ||
+                            old_m.offset != e.state[Flag_M].offset ||
+                            old_x.offset != e.state[Flag_X].offset;
+        if (mode_changed)
+            e.MarkBlockEnd();
+
+        // Jumps to a constant address carry on emitting at the target. The guest registers stay in
+        // SSA, instead of being stored by Finalize and loaded again by the next block.
+        if (e.ending && !mode_changed) {
+            auto target = e.CodeAddress();
+            if (target && !seen(*target) && e.buffer.size() < max_chain_nodes) {
+                e.ending = false;
+                block.jumps_followed++;
+                next_pc = *target;
+                continue;
+            }
+            jumped = target.has_value();
+        }
+
+        // Conditional branches leave PC as Ternary(cond, taken, not_taken), see Emitter::If.
+        // Superblocks carry on along the likely side, the other one becomes a side exit.
+        const IR_Base& pc_node = e.buffer[e.state[PC].offset];
+        if (e.ending && !mode_changed && predict && pc_node.id == Ternary &&
+            block.side_exits < max_side_exits && e.buffer.size() < max_chain_nodes) {
+            auto pbr = Fixed(e.buffer, e.state[PBR]);
+            auto taken = Fixed(e.buffer, ssa { u16(pc_node.arg_2) });
+            auto not_taken = Fixed(e.buffer, ssa { u16(pc_node.arg_3) });
+            auto likely = predict(segment_start, mode, next_pc);
+            if (pbr && taken && not_taken && likely) {
+                u32 taken_pc = *pbr << 16 | *taken;
+                u32 not_taken_pc = *pbr << 16 | *not_taken;
+                bool follow_taken = *likely == taken_pc;
+                if ((follow_taken || *likely == not_taken_pc) && taken_pc != not_taken_pc && !seen(*likely)) {
+                    ssa cond { u16(pc_node.arg_1) };
+                    e.SideExit(follow_taken ? cond : e.Not(cond), block.instructions);
+                    if (follow_taken)
+                        side_exits.push_back({ Exit::FallThrough, not_taken_pc });
+                    else
+                        side_exits.push_back({ Exit::Taken, taken_pc });
+                    block.side_exits++;
+
+                    e.ending = false;
+                    next_pc = segment_start = *likely;
+                    e.state[PBR] = e.Const<8>(*likely >> 16);
+                    e.state[PC] = e.Const<16>(*likely & 0xffff);
+                    continue;
+                }
+            }
+        }
+
+        if (e.ending)
+            break;
+
+        // Work out where the next instruction is. Within a block this only
+        // depends on constants and the E/M/X flags.
+        auto pbr = Fixed(e.buffer, e.state[PBR]);
+        auto pc16 = Fixed(e.buffer, e.state[PC]);
+        if (!pbr || !pc16) {
+            e.MarkBlockEnd();
+        } else {
+            // This block only runs in this mode, so PC is a constant. Keeping it one lets
+            // the next instruction's bytes get baked in.
+            next_pc = *pbr << 16 | *pc16;
+            e.state[PBR] = e.Const<8>(*pbr);
+            e.state[PC] = e.Const<16>(*pc16);
+        }
+
+        // Long runs of straight-line code stop there too, and fall through to the next block
+        if (e.buffer.size() >= max_chain_nodes)
+            e.MarkBlockEnd();
+    }
+
+    block.exits.reserve(2 + side_exits.size());
+    FindExits(block, e.buffer, e.state[PBR], e.state[PC], jumped);
+    block.exits.insert(block.exits.end(), side_exits.begin(), side_exits.end());
+    block.guards.assign(guards.begin(), guards.end());
+    block.instruction_pcs.assign(instruction_pcs.begin(), instruction_pcs.end());
+
+    e.CloseSideExits(block.instructions);
+    e.Finalize();
+    block.complete = e.ending;
+
+    size_t emitted = e.buffer.size();
+
+    const PlainMemoryFn& plain = is_plain ? is_plain : flat_memory;
+    block.loads_forwarded = ForwardMemoryOps(e.buffer, e.widths, plain);
+    block.pairs_merged = CoalesceMemoryOps(e.buffer, e.widths, plain);
+    DeadCodeElimination(e.buffer, e.widths);
+    block.constants = HoistConstants(e.buffer, e.widths);
+    block.ir.assign(e.buffer.begin(), e.buffer.end());
+    block.widths.assign(e.widths.begin(), e.widths.end());
+    block.slots.resize(block.ir.size());
+    for (size_t i = 0; i < block.constants; i++)
+        block.slots[i] = block.ir[i].arg_32;
+    if (print_blocks)
+        printf("%s %06X: %i instructions, %i jumps followed, %i side exits, %zu nodes, %zu after DCE, %zu loads forwarded, %zu memory pairs merged\n",
+        block.superblock ? "Superblock" : "Block", block.pc, block.instructions, block.jumps_followed, block.side_exits, emitted, block.ir.size(), block.loads_forwarded, block.pairs_merged);
+
+    // Every engine takes its masks from the widths, partial_interpret included, so a block that
+    // fails is an emitter bug. Like the asserts the interpreter used to have, it's only checked
+    // in debug builds.
+    assert(VerifyWidths(block.ir, block.widths));
+
+    return block;
+}
+
+bool BlockCache::Unmodified(const Block& block, const u8* mem) {
+    for (auto [addr, byte] : block.guards) {
+        if (mem[addr & 0xffff] != byte)
+            return false;
+    }
+    return true;
+}
+
+Block* BlockCache::Lookup(u32 pc, u8 mode, const u8* mem) {
+    Block*& slot = dispatch[DispatchIndex(pc, mode)];
+    Block* block = slot;
+    bool from_table = block && block->pc == pc && block->mode == mode;
+    if (!from_table) {
+        auto it = blocks.find(Key(pc, mode));
+        if (it == blocks.end()) {
+            stats.misses++;
+            return nullptr;
+        }
+        block = &it->second;
+    }
+
+    if (!Unmodified(*block, mem)) {
+        stats.stale++;
+        stats.misses++;
+        Erase(blocks.find(Key(pc, mode)));
+        return nullptr;
+    }
+
+    stats.hits++;
+    if (from_table)
+        stats.dispatch++;
+    slot = block;
+    Touch(block);
+    return block;
+}
+
+Block* BlockCache::Follow(Block* from, u32 pc, u8 mode, const u8* mem) {
+    for (Exit& exit : from->exits) {
+        if (exit.pc != pc || !exit.target)
+            continue;
+
+        Block* target = exit.target;
+        if (target->mode != mode)
+            return nullptr;
+        if (!Unmodified(*target, mem)) {
+            stats.stale++;
+            Erase(blocks.find(Key(target->pc, target->mode)));
+            return nullptr;
+        }
+
+        stats.linked++;
+        Touch(target);
+        return target;
+    }
+    return nullptr;
+}
+
+std::optional<u32> BlockCache::LikelyExit(u32 start, u8 mode, u32 branch_pc) const {
+    // Not enough runs to tell which way the branch goes
+    constexpr u64 min_samples = 16;
+
+    auto it = blocks.find(Key(start, mode));
+    if (it == blocks.end())
+        return {};
+    const Block& block = it->second;
+    if (block.exits.size() != 2 || block.instruction_pcs.empty() || block.instruction_pcs.back() != branch_pc)
+        return {};
+
+    u64 total = block.exits[0].count + block.exits[1].count;
+    if (total < min_samples)
+        return {};
+    for (const Exit& exit : block.exits) {
+        if (exit.count * 4 >= total * 3)
+            return exit.pc;
+    }
+    return {};
+}
+
+void BlockCache::Link(u32 from_pc, u8 from_mode, Block* target) {
+    auto it = blocks.find(Key(from_pc, from_mode));
+    if (it == blocks.end())
+        return;
+
+    Block& from = it->second;
+    for (Exit& exit : from.exits) {
+        if (exit.kind == Exit::Computed || exit.pc != target->pc || exit.target == target)
+            continue;
+        if (exit.target) {
+            auto& links = exit.target->linked_from;
+            links.erase(std::find(links.begin(), links.end(), &from));
+        }
+        exit.target = target;
+        target->linked_from.push_back(&from);
+    }
+    Chain(&from);
+}
+
+void BlockCache::Chain(Block* block) {
+    if (!jit || !Profiled(*block))
+        return;
+    for (Exit& exit : block->exits) {
+        if (exit.jump && exit.target && exit.target->chain_entry)
+            jit->Patch(exit.jump, exit.target->chain_entry);
+    }
+}
+
+Block* BlockCache::Find(u64 key) {
+    auto it = blocks.find(key);
+    return it == blocks.end() ? nullptr : &it->second;
+}
+
+Block* BlockCache::Insert(Block&& block) {
+    u64 key = Key(block.pc, block.mode);
+
+    auto existing = blocks.find(key);
+    if (existing != blocks.end()) {
+        Erase(existing);
+    }
+
+    used += block.size();
+    while (used > capacity && !lru.empty()) {
+        stats.evictions++;
+        Erase(blocks.find(lru.back()));
+    }
+
+    lru.push_front(key);
+    auto [it, inserted] = blocks.emplace(key, std::move(block));
+    Block* inserted_block = &it->second;
+    inserted_block->serial = next_serial++;
+    inserted_block->lru = lru.begin();
+    dispatch[DispatchIndex(inserted_block->pc, inserted_block->mode)] = inserted_block;
+    return inserted_block;
+}
+
+bool BlockCache::Install(u64 key, u64 serial, JitX64::BlockFn fn) {
+    auto it = blocks.find(key);
+    if (it == blocks.end() || it->second.serial != serial) {
+        stats.discarded++;
+        return false;
+    }
+
+    // The dispatch loop only reads native between blocks, on this thread
+    it->second.native = fn;
+    stats.installed++;
+    return true;
+}
+
+void BlockCache::Erase(std::unordered_map<u64, Block>::iterator it) {
+    Block* block = &it->second;
+
+    // Nothing can be left pointing at the block
+    for (Block* from : block->linked_from) {
+        for (Exit& exit : from->exits) {
+            if (exit.target != block)
+                continue;
+            exit.target = nullptr;
+            if (jit && exit.jump)
+                jit->Patch(exit.jump, nullptr);
+        }
+    }
+    for (Exit& exit : block->exits) {
+        if (exit.target && exit.target != block) {
+            auto& links = exit.target->linked_from;
+            links.erase(std::find(links.begin(), links.end(), block));
+        }
+    }
+    Block*& slot = dispatch[DispatchIndex(block->pc, block->mode)];
+    if (slot == block)
+        slot = nullptr;
+
+    used -= block->size();
+    lru.erase(block->lru);
+    blocks.erase(it);
+}
+
+void BlockCache::SetCapacity(size_t bytes) {
+    capacity = bytes;
+    while (used > capacity && !lru.empty()) {
+        stats.evictions++;
+        Erase(blocks.find(lru.back()));
+    }
+}
+
+void BlockCache::Flush() {
+    blocks.clear();
+    std::fill(dispatch.begin(), dispatch.end(), nullptr);
+    lru.clear();
+    used = 0;
+}
+
+void BlockCache::PrintStats() const {
+    u64 lookups = stats.hits + stats.misses + stats.linked;
+    printf("Block cache: %llu hits, %llu misses (%llu stale), %llu evictions, %.1f%% hit rate\n",
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+        (unsigned long long)stats.stale, (unsigned long long)stats.evictions,
+        lookups ? 100.0 * (stats.hits + stats.linked) / lookups : 0.0);
+    printf("             %llu exits followed through links, %llu hits from the dispatch table\n",
+        (unsigned long long)stats.linked, (unsigned long long)stats.dispatch);
+    printf("             %zu blocks, %zu/%zu bytes\n", blocks.size(), used, capacity);
+    if (stats.installed || stats.discarded) {
+        printf("             %llu blocks given native code in the background, %llu outdated by then\n",
+            (unsigned long long)stats.installed, (unsigned long long)stats.discarded);
+    }
+}
+
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "m65816.h"
+#include "ir_base.h"
+#include "ir_passes.h"
+#include "ir_jit_x64.h"
+#include "ir_threaded.h"
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <functional>
+#include <optional>
+
+namespace m65816 {
+
+// The E/M/X flags change how instructions decode (immediate widths), so they
+// are part of the block key alongside the 24bit PBR:PC. Blocks are emitted with them as
+// constants, so only the 8bit or 16bit version of each instruction is emitted.
+// Direct page accesses take an extra cycle unless the low byte of D is zero, which it
+// almost always is, so that is part of the key too.
+enum ModeFlags : u8 {
+    Mode_E = 1 << 0,
+    Mode_M = 1 << 1,
+    Mode_X = 1 << 2,
+    Mode_DL0 = 1 << 3,
+
+    Mode_Flags = Mode_E | Mode_M | Mode_X, // The ones firerecomp knows about
+};
+
+inline u8 ModeFromRegisters(const u64* regs) {
+    return (regs[Flag_E] & 1 ? Mode_E : 0)
+         | (regs[Flag_M] & 1 ? Mode_M : 0)
+         | (regs[Flag_X] & 1 ? Mode_X : 0)
+         | ((regs[D] & 0xff) == 0 ? Mode_DL0 : 0);
+}
+
+struct Block;
+
+// Where a block can go when it finishes. Exits to a constant address can be linked to the block
+// there, so the dispatch loop doesn't need to look it up. Computed exits (returns, indirect jumps)
+// always go through BlockCache::Lookup.
+struct Exit {
+    enum Kind : u8 {
+        FallThrough, // The next instruction, or a branch not taken
+        Taken,       // A branch or jump to a constant address
+        Computed,    // Only known at runtime
+    };
+
+    Kind kind;
+    u32 pc = 0;              // PBR:PC of the target, unless Computed
+    Block* target = nullptr; // Set by BlockCache::Link
+    u64 count = 0;           // Times the block left through here, for picking superblock paths
+
+    // The native jump taken when the block leaves through here, if it was compiled to chain.
+    // BlockCache points it at target's chain_entry.
+    u8* jump = nullptr;
+};
+
+// Blocks whose branch has been run this many times get emitted again as a superblock
+constexpr u64 superblock_threshold = 64;
+
+// With tiered execution, blocks run this many times on partial_interpret get queued for the JIT
+constexpr u64 tier_up_threshold = 16;
+
+// A finished block of IR (after Emitter::Finalize), which can be re-run
+// from offset 0 with a fresh ssalist.
+struct Block {
+    u32 pc;   // PBR:PC of the first instruction
+    u8 mode;  // ModeFlags the block was emitted under
+    int instructions = 0;
+
+    // Instruction bytes get baked into the IR (see Emitter::fetch_code), so we remember which
+    // byte was at each address. If guest code changes, the block is stale.
+    std::vector<std::pair<u32, u8>> guards;
+
+    std::vector<u32> instruction_pcs; // In the order they were emitted
+    int jumps_followed = 0; // Constant jumps emitted straight through, see EmitBlock
+
+    // Branches emitted along their likely path. If there are any, the block can leave early and
+    // writes the number of instructions it ran to the RETIRED register.
+    int side_exits = 0;
+    bool superblock = false; // Emitted with branch profiles, so it won't be emitted again
+    bool hot = false;        // Should be emitted again as a superblock
+
+    // What the memory passes did to the block, see ForwardMemoryOps and CoalesceMemoryOps
+    size_t loads_forwarded = 0;
+    size_t pairs_merged = 0;
+
+    std::vector<IR_Base> ir;
+    std::vector<u8> widths; // Width of every node in ir
+
+    // Values of every node in ir, for partial_interpret and the JIT. The constants come
+    // first (see HoistConstants) and are filled in once, when the block is emitted.
+    std::vector<u64> slots;
+    size_t constants = 0;
+
+    // True if the block ended at a branch/jump or mode change, rather than being cut short
+    bool complete = false;
+
+    // A branch's taken and fall-through paths, or a single exit, then one for each side exit.
+    // Empty for blocks we have no IR for.
+    std::vector<Exit> exits;
+
+    // Native version of ir, or nullptr if it couldn't be compiled
+    JitX64::BlockFn native = nullptr;
+    u8* chain_entry = nullptr; // Where other blocks' native code jumps in, see JitX64::ChainSpec
+
+    // Pre-decoded version of ir for the threaded interpreter, if that engine is in use
+    std::unique_ptr<ThreadedBlock> threaded;
+
+    u64 runs = 0;        // Times the dispatch loop ran this block
+    bool queued = false; // Sent to a CompileQueue, which fills in native if the JIT can compile it
+
+    // Managed by BlockCache
+    u64 serial = 0; // Different for every block inserted, so a stale CompileQueue result can be spotted
+    std::list<u64>::iterator lru;
+    std::vector<Block*> linked_from; // Blocks with an exit linked to this one
+
+    Block(u32 pc, u8 mode) : pc(pc), mode(mode) {}
+
+    size_t size() const {
+        return sizeof(Block) + ir.size() * (sizeof(IR_Base) + 1) + guards.size() * sizeof(guards[0])
+             + instruction_pcs.size() * sizeof(u32) + exits.size() * sizeof(Exit) + slots.size() * sizeof(u64)
+             + (threaded ? threaded->size() : 0);
+    }
+};
+
+// EmitBlock prints a summary of every block it emits, and unimplemented opcodes it stops at.
+// Off unless firesnes is run with --print-blocks.
+extern bool print_blocks;
+
+// Given the branch at branch_pc, in the run of straight-line code that started at start,
+// returns the PBR:PC it usually goes to, if it has a favourite.
+using ExitPredictor = std::function<std::optional<u32>(u32 start, u8 mode, u32 branch_pc)>;
+
+// Emits, finalizes and optimizes the block starting at pc, stopping after at most max_instructions.
+// Unconditional jumps to constant addresses are followed, so a block can cover several runs of code.
+// With a predictor, conditional branches are followed along their likely path too (see Emitter::SideExit).
+// The block is specialized for mode, see ModeFlags. It doesn't depend on what the registers hold
+// now, so its exits and superblock paths only follow values fixed at emit time.
+// Stops early at unimplemented opcodes, so the block might have 0 instructions.
+// Instructions are read from mem, the memory the block will run against.
+// is_plain says which bus addresses the memory passes may merge or remove accesses to. Without it,
+// all of the bus is plain memory, as it is for the flat memory array.
+Block EmitBlock(u32 pc, u8 mode, int max_instructions, const u8* mem,
+                const ExitPredictor& predict = nullptr, const PlainMemoryFn& is_plain = nullptr);
+
+class BlockCache {
+    std::unordered_map<u64, Block> blocks;
+    std::list<u64> lru; // Most recently used at the front
+
+    // Direct mapped, so Lookup can usually skip hashing. Entries are checked against the block's
+    // pc and mode, and cleared when the block is erased.
+    static constexpr size_t dispatch_size = 0x10000;
+    std::vector<Block*> dispatch;
+
+    size_t capacity;
+    size_t used = 0;
+    u64 next_serial = 1;
+
+    static size_t DispatchIndex(u32 pc, u8 mode) {
+        return (pc ^ (pc >> 16) << 8 ^ u32(mode) << 13) & (dispatch_size - 1);
+    }
+
+    void Touch(Block* block) { lru.splice(lru.begin(), lru, block->lru); }
+    void Erase(std::unordered_map<u64, Block>::iterator it);
+
+    // Blocks still counting which way their branch goes (see Block::hot) have to come back to
+    // the dispatch loop, so their exits aren't patched yet
+    static bool Profiled(const Block& block) {
+        return block.exits.size() != 2 || block.superblock
+            || (block.exits[0].count + block.exits[1].count >= superblock_threshold && !block.hot);
+    }
+
+public:
+    static u64 Key(u32 pc, u8 mode) { return u64(pc & 0xffffff) | u64(mode) << 24; }
+
+    struct Stats {
+        u64 hits = 0;
+        u64 misses = 0;
+        u64 stale = 0;     // lookups that found a block whose guest code had changed
+        u64 evictions = 0;
+
+        u64 linked = 0;    // exits that went straight to a linked block, without a lookup
+        u64 dispatch = 0;  // hits found in the dispatch table, without hashing
+        u64 installed = 0; // native code from a CompileQueue given to a block
+        u64 discarded = 0; // native code for a block that had been replaced or evicted
+    } stats;
+
+    // Linked exits with a native jump get patched to go straight to their target, if set.
+    // Native code from anywhere else doesn't chain.
+    JitX64* jit = nullptr;
+
+    // capacity is the approximate number of bytes of IR we are allowed to keep around
+    explicit BlockCache(size_t capacity = 16 * 1024 * 1024) : dispatch(dispatch_size), capacity(capacity) {}
+
+    // Checks the guest code in mem hasn't been modified since the block was emitted
+    static bool Unmodified(const Block& block, const u8* mem);
+
+    // Returns nullptr on a miss. The pointer is valid until the next Insert or Flush.
+    // mem is the memory the block will run against, for checking its guards.
+    Block* Lookup(u32 pc, u8 mode, const u8* mem);
+
+    // The block with key (see Key), without checking its guards
+    Block* Find(u64 key);
+
+    // The block that from's exit to pc is linked to, if it's still valid for mode.
+    // Returns nullptr if there is no link, and the caller should use Lookup.
+    Block* Follow(Block* from, u32 pc, u8 mode, const u8* mem);
+
+    // For ExitPredictor: the exit taken at least 3/4 of the time by the cached block at start,
+    // if that block ends at branch_pc and has run often enough to tell
+    std::optional<u32> LikelyExit(u32 start, u8 mode, u32 branch_pc) const;
+
+    // Links the exits of the cached block at from_pc/from_mode that go to target->pc.
+    // Takes the key rather than a pointer, as Insert might have evicted the source block.
+    void Link(u32 from_pc, u8 from_mode, Block* target);
+
+    // Patches the native jumps of block's linked exits, if it has finished profiling.
+    // Link does this too, but the dispatch loop needs to once the profile finishes.
+    void Chain(Block* block);
+
+    // Takes ownership of a finished block, evicting the least recently used
+    // blocks until it fits.
+    Block* Insert(Block&& block);
+
+    // Gives the block with key (see Key) native code compiled in the background, if it's
+    // still the block with that serial. Returns false if it's been replaced or evicted.
+    bool Install(u64 key, u64 serial, JitX64::BlockFn fn);
+
+    void SetCapacity(size_t bytes);
+    void Flush();
+
+    size_t Size() const { return used; }
+    size_t Count() const { return blocks.size(); }
+
+    void PrintStats() const;
+};
+
+}
@@ -5,6 +5,23 @@
 namespace m65816 {
 
 Emitter::Emitter(u32 pc) {
+    Reset(pc);
+}
+
+void Emitter::Reset(u32 pc) {
+    BaseEmitter::Reset();
+    ending = false;
+    zero_lower.reset();
+    fetch_code = nullptr;
+    fetch_context = nullptr;
+    instruction_start.reset();
+    constant_stores.clear();
+    assume_dl_zero = false;
+    pending_cycles = 0;
+    side_exits.clear();
+
+    state.fill(untracked);
+
     ssa null = Const<32>(0);
     ssa one  = Const<32>(1);
     regs = push(IR_MemState(null, null, one));
@@ -34,16 +51,17 @@ Emitter::Emitter(u32 pc) {
     state[Flag_E] = flag(Flag_E);
     state[CYCLE]  = reg64(CYCLE);
 
-    //
-    initializer_end_marker = buffer.size();
+    initial_state = state;
 
     bus_a = one;
     memory_conditional = one;
 }
 
 template<u8 bits> void Emitter::finaliseReg(Reg reg) {
-    // We only want to write regs which have changed
-    if (state[reg].offset >= initializer_end_marker) {
+    // We only want to write regs which have changed.
+    // Comparing against the initial state (rather than just checking for new nodes) handles
+    // moves/swaps between regs and values that fold back to constants from the initializer.
+    if (state[reg].offset != initial_state[reg].offset) {
         ssa offset = Const<32>(reg);
 
         if constexpr(bits ==  8) push( IR_Store8(regs, offset, state[reg]));
@@ -53,6 +71,7 @@ template<u8 bits> void Emitter::finaliseReg(Reg reg) {
 }
 
 void Emitter::Finalize() {
+    Cycle();
     finaliseReg<8>(A);
     finaliseReg<8>(B);
     finaliseReg<16>(D);
@@ -72,6 +91,8 @@ void Emitter::Finalize() {
     finaliseReg<64>(Flag_C);
     finaliseReg<64>(Flag_E);
     finaliseReg<64>(CYCLE);
+    if (state[RETIRED].offset != untracked.offset)
+        finaliseReg<64>(RETIRED);
 }
 
 }
\ No newline at end of file
@@ -4,8 +4,7 @@
 #include "ir_base.h"
 
 #include <vector>
-#include <map>
-#include <functional>
+#include <array>
 #include <utility>
 
 #include "ir_emitter.h"
@@ -14,12 +13,19 @@
 namespace m65816 {
 
 class Emitter : public BaseEmitter {
+public:
+    // The current value of every guest register, or untracked for ones the block doesn't
+    // use (RETIRED, outside of superblocks). Small enough that If copies it onto the stack.
+    using State = std::array<ssa, NUM_REGS>;
+    static constexpr ssa untracked = { 0xffff };
+
+private:
     ssa bus_a;
     ssa regs;
 
     ssa memory_conditional;
 
-    size_t initializer_end_marker; // TODO: This is wrong. Doesn't handle moves/swaps.
+    State initial_state; // So Finalize can tell which regs changed
 
     template<u8 bits>
     void finaliseReg(Reg r);
@@ -37,24 +43,83 @@ public:
     Emitter(u32 pc);
     void Finalize();
 
-    std::map<Reg, ssa> state;
+    // Starts emitting a new block at pc, reusing the buffers from the last one
+    void Reset(u32 pc);
+
+    State state;
+
+    // Reads instruction bytes while emitting, so operands become constants like opcodes do.
+    // Whoever sets this must guard the bytes it returns against self-modifying code.
+    // Stores to the block's own instructions aren't noticed until the next time it's looked up,
+    // except for stores to constant addresses, see constant_stores.
+    // Called for every instruction byte, with fetch_context, so it's a plain function pointer.
+    using FetchCodeFn = u8 (*)(void* context, u32 address);
+    FetchCodeFn fetch_code = nullptr;
+    void* fetch_context = nullptr;
+    std::optional<u32> instruction_start; // PBR:PC of the instruction being emitted
+
+    // Low 16 bits of the bus addresses the block has stored to so far, where they were constants
+    // (usually DBR:constant). EmitBlock ends the block before any instruction they might hit,
+    // so its bytes are fetched after the store ran.
+    std::vector<u16> constant_stores;
+
+    // Blocks can be emitted for a known value of a register, which the caller must check before
+    // running them. The value isn't written back by Finalize unless the block changes it.
+    void Specialize(Reg reg, ssa value) {
+        state[reg] = initial_state[reg] = value;
+    }
+
+    // Set if the block only runs with the low byte of D clear
+    bool assume_dl_zero = false;
+    bool DirectLowIsZero() const {
+        return assume_dl_zero && state[D].offset == initial_state[D].offset;
+    }
 
     ssa IncPC() {
         return state[PC] = Add(state[PC], Const<16>(1));
     }
-    ssa IncCycle() {
-        return state[CYCLE] = Add(state[CYCLE], 1);
+    // Cycles are counted while emitting, and only added to state[CYCLE] when something
+    // looks at it: memory operations, Ifs that take extra cycles and the end of the block.
+    void IncCycle(int cycles = 1) {
+        pending_cycles += cycles;
+    }
+    ssa Cycle() {
+        if (pending_cycles) {
+            state[CYCLE] = Add(state[CYCLE], pending_cycles);
+            pending_cycles = 0;
+        }
+        return state[CYCLE];
     }
 
     ssa memState(ssa bus) {
         // state[ALIVE] allows us to disable memory operations when this codepath is dead.
-        return push(IR_MemState(bus, state[CYCLE], memory_conditional));
+        return push(IR_MemState(bus, Cycle(), memory_conditional));
+    }
+
+    // PBR:PC, if it's a constant
+    std::optional<u32> CodeAddress() const {
+        const IR_Base& pbr = buffer[state[PBR].offset];
+        const IR_Base& pc = buffer[state[PC].offset];
+        if (pbr.id != Opcode::Const || pc.id != Opcode::Const)
+            return {};
+        return u32(pbr.arg_32 << 16 | pc.arg_32);
     }
 
     ssa Read(ssa addr) {
+        // Bytes of the current instruction are baked in as constants
+        const IR_Base& node = buffer[addr.offset];
+        auto code = CodeAddress();
+        if (fetch_code && instruction_start && code && node.id == Opcode::Const &&
+            node.arg_32 >= *instruction_start && node.arg_32 <= *code) {
+            return Const<8>(fetch_code(fetch_context, node.arg_32));
+        }
         return push(IR_Load8(memState(bus_a), addr));
     }
     void Write(ssa addr, ssa value) {
+        const IR_Base& node = buffer[addr.offset];
+        const IR_Base& low = node.id == Opcode::Cat ? buffer[node.arg_2] : node;
+        if (low.id == Opcode::Const)
+            constant_stores.push_back(low.arg_32);
         push(IR_Store8(memState(bus_a), addr, value));
     }
 
@@ -62,25 +127,114 @@ public:
     // Can be nested.
     // Unfortunately, only state changes and memory operations are conditional.
     // Any SSA varables that excape the lambda by reference won't be conditional.
-    void If(ssa cond, std::function<void()> then) {
-        std::map<Reg, ssa> old_state = state; // Push a copy of state
+    template<typename Fn>
+    void If(ssa cond, Fn&& then) {
+        // Conditions that folded to a constant (mostly E/M/X, see Specialize) need no merging
+        const IR_Base& cond_node = buffer[cond.offset];
+        if (cond_node.id == Opcode::Const) {
+            if (cond_node.arg_32) {
+                then();
+                return;
+            }
+            State old_state = state;
+            int old_pending = pending_cycles;
+            ssa old_mem_conditional = memory_conditional;
+            memory_conditional = cond; // Memory operations fold away
+            then();
+            state = old_state;
+            pending_cycles = old_pending;
+            memory_conditional = old_mem_conditional;
+            return;
+        }
+
+        State old_state = state; // Push a copy of state
+        int old_pending = pending_cycles;
         ssa old_mem_conditional = memory_conditional; // Push the memory conditional
-        memory_conditional = cond;
+        memory_conditional = AndCondition(cond);
 
         then();
 
+        // If nothing looked at the cycle count inside, extra cycles become a single conditional add.
+        // Otherwise both sides need their count as a node.
+        int extra_cycles = 0;
+        if (state[CYCLE].offset == old_state[CYCLE].offset) {
+            extra_cycles = pending_cycles - old_pending;
+            pending_cycles = old_pending;
+        } else {
+            Cycle();
+            if (old_pending)
+                old_state[CYCLE] = Add(old_state[CYCLE], old_pending);
+        }
+
         // Scan for differences in old and new state
-        for(auto & [key, new_val]: state) {
-            auto &old_val = old_state[key];
+        for (size_t reg = 0; reg < NUM_REGS; reg++) {
+            ssa& new_val = state[reg];
+            ssa old_val = old_state[reg];
             if (old_val.offset != new_val.offset) {
                 // Insert a ternary operation where the state differs.
-                new_val = Ternary(cond, new_val, old_state[key]);
+                new_val = Ternary(cond, new_val, old_val);
             }
         }
 
+        if (extra_cycles)
+            state[CYCLE] = Add(state[CYCLE], Ternary(cond, Const<64>(extra_cycles), Const<64>(0)));
+
         // restore memory conditional
         memory_conditional = old_mem_conditional;
     }
+
+    // Superblocks carry on emitting past a branch, along the path it usually takes.
+    // Everything emitted after a side exit only happens if stay is true, otherwise the block
+    // leaves with the state from the side exit. instructions is the number emitted so far.
+    void SideExit(ssa stay, int instructions) {
+        Cycle();
+        side_exits.push_back({ stay, state, memory_conditional });
+        side_exits.back().state[RETIRED] = Const<64>(instructions);
+        memory_conditional = AndCondition(stay);
+    }
+
+    // Merges the side exits back into state, before Finalize
+    void CloseSideExits(int instructions) {
+        if (side_exits.empty())
+            return;
+
+        Cycle();
+        state[RETIRED] = Const<64>(instructions);
+        for (size_t i = side_exits.size(); i-- > 0; ) {
+            const SideExitState& exit = side_exits[i];
+            for (size_t reg = 0; reg < NUM_REGS; reg++) {
+                ssa& new_val = state[reg];
+                ssa old_val = exit.state[reg];
+                if (old_val.offset != new_val.offset)
+                    new_val = Ternary(exit.stay, new_val, old_val);
+            }
+            memory_conditional = exit.memory_conditional;
+        }
+        side_exits.clear();
+    }
+
+private:
+    int pending_cycles = 0; // Not yet added to state[CYCLE]
+
+    struct SideExitState {
+        ssa stay;
+        State state;
+        ssa memory_conditional;
+    };
+    std::vector<SideExitState> side_exits;
+
+    // Conditions nest, so memory operations inside an If in a superblock still depend on staying on it
+    ssa AndCondition(ssa cond) {
+        auto always = [&] (ssa value) {
+            const IR_Base& node = buffer[value.offset];
+            return node.id == Opcode::Const && node.arg_32 == 1;
+        };
+        if (always(memory_conditional))
+            return cond;
+        if (always(cond))
+            return memory_conditional;
+        return And(memory_conditional, cond);
+    }
 };
 
 };
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include "m65816_lockstep.h"
+#include "m65816_cache.h"
+#include "ir_threaded.h"
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+
+namespace m65816 {
+
+void lockstep_loop(std::vector<LockstepInstance>& instances, int max_lanes, LockstepStats& stats) {
+    BlockCache cache;
+    std::vector<std::pair<u64, LockstepInstance*>> order; // PBR:PC and mode of each instance
+    std::vector<LockstepInstance*> group;
+    std::vector<LockstepInstance*> diverged;
+
+    // The block for instance at pc, or nullptr if there's nothing to run. Blocks cut short by the
+    // instruction count only suit the instance they were emitted for, so they aren't cached.
+    // Other blocks for the same pc and mode might be replaced, so their pointers are invalid afterwards.
+    auto find_block = [&] (LockstepInstance& instance, u32 pc, u8 mode, std::optional<Block>& uncached) {
+        Block* block = cache.Lookup(pc, mode, instance.mem.data());
+        if (block && block->instructions <= instance.count)
+            return block;
+
+        Block new_block = EmitBlock(pc, mode, instance.count, instance.mem.data());
+        if (new_block.instructions == 0)
+            return (Block*)nullptr;
+        new_block.threaded = std::make_unique<ThreadedBlock>();
+        if (!new_block.threaded->Decode(new_block.ir, new_block.widths))
+            new_block.threaded.reset();
+
+        if (new_block.complete)
+            return cache.Insert(std::move(new_block));
+        uncached.emplace(std::move(new_block));
+        return &*uncached;
+    };
+
+    auto run = [&] (Block* block, LockstepInstance** lanes, size_t count) {
+        if (!block->threaded) {
+            // Blocks the threaded interpreter can't decode run on partial_interpret
+            for (size_t lane = 0; lane < count; lane++) {
+                partial_interpret(block->ir, block->widths, block->slots, block->constants,
+                                  lanes[lane]->regs.data(), lanes[lane]->mem.data());
+            }
+            stats.solo_runs += count;
+        } else if (count == 1) {
+            block->threaded->Run(lanes[0]->regs.data(), lanes[0]->mem.data());
+            stats.solo_runs++;
+        } else {
+            std::array<LockstepLane, lockstep_lanes> lane_state;
+            for (size_t lane = 0; lane < count; lane++)
+                lane_state[lane] = { lanes[lane]->regs.data(), lanes[lane]->mem.data() };
+            block->threaded->RunLanes(lane_state, (1 << count) - 1);
+            stats.group_runs++;
+            stats.group_lanes += count;
+        }
+        for (size_t lane = 0; lane < count; lane++)
+            lanes[lane]->count -= block->instructions;
+    };
+
+    max_lanes = std::clamp(max_lanes, 1, lockstep_lanes);
+
+    // Every round runs one block for each instance, with instances sorted by where they are
+    while (true) {
+        order.clear();
+        for (LockstepInstance& instance : instances) {
+            if (instance.count > 0) {
+                u32 pc = instance.regs[PBR] << 16 | instance.regs[PC];
+                order.push_back({ u64(pc) << 8 | ModeFromRegisters(instance.regs.data()), &instance });
+            }
+        }
+        if (order.empty())
+            break;
+        std::sort(order.begin(), order.end());
+
+        for (size_t start = 0, end; start < order.size(); start = end) {
+            u64 key = order[start].first;
+            for (end = start + 1; end < order.size() && order[end].first == key; end++) {}
+
+            u32 pc = key >> 8;
+            u8 mode = key & 0xff;
+            LockstepInstance& lead = *order[start].second;
+            std::optional<Block> uncached;
+            Block* block = find_block(lead, pc, mode, uncached);
+            if (!block) {
+                lead.count = 0; // Hit an unimplemented opcode
+                continue;
+            }
+
+            // Everything else here shares the lead's block if it fits
+            group.clear();
+            diverged.clear();
+            group.push_back(&lead);
+            for (size_t i = start + 1; i < end; i++) {
+                LockstepInstance& instance = *order[i].second;
+                bool fits = !uncached && instance.count >= block->instructions &&
+                            BlockCache::Unmodified(*block, instance.mem.data());
+                (fits ? group : diverged).push_back(&instance);
+            }
+
+            for (size_t first = 0; first < group.size(); first += max_lanes)
+                run(block, &group[first], std::min(group.size() - first, size_t(max_lanes)));
+
+            // The rest go on their own, once the group is done with the lead's block.
+            // Finding their blocks can replace it in the cache.
+            for (LockstepInstance* instance : diverged) {
+                std::optional<Block> own_uncached;
+                Block* own = find_block(*instance, pc, mode, own_uncached);
+                if (own)
+                    run(own, &instance, 1);
+                else
+                    instance->count = 0;
+            }
+        }
+    }
+}
+
+}
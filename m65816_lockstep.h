@@ -0,0 +1,31 @@
+#pragma once
+
+#include "m65816.h"
+#include "ir_lockstep.h"
+
+#include <array>
+#include <vector>
+
+namespace m65816 {
+
+// An emulator instance for lockstep_loop, with its own registers and memory
+struct LockstepInstance {
+    std::array<u64, 32> regs {}; // Indexed by Reg
+    std::array<u8, 0x10000> mem {};
+    int count = 0; // Instructions left to run
+};
+
+struct LockstepStats {
+    u64 group_runs = 0;  // RunLanes calls
+    u64 group_lanes = 0; // Blocks run by those calls
+    u64 solo_runs = 0;   // Blocks run by an instance on its own
+};
+
+// Runs every instance until its instruction count runs out, or it hits an unimplemented opcode.
+// Instances at the same PC and mode run their block together with ThreadedBlock::RunLanes, up to
+// max_lanes (at most lockstep_lanes) at a time. An instance that has wandered off on its own, or
+// whose copy of the code differs, runs its block with ThreadedBlock::Run.
+// The instances share one BlockCache, which only lives for the call.
+void lockstep_loop(std::vector<LockstepInstance>& instances, int max_lanes, LockstepStats& stats);
+
+}
@@ -0,0 +1,342 @@
+#include "m65816_machine.h"
+#include "ir_threaded.h"
+#include "ir_trace.h"
+#include "alloc_counter.h"
+#ifdef HAVE_AOT_BLOCKS
+#include "m65816_aot.h"
+#endif
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+
+namespace m65816 {
+
+const char* EngineName(Engine engine) {
+    switch (engine) {
+    case Engine::Interpreter: return "interpreter";
+    case Engine::Threaded:    return "threaded";
+    case Engine::Jit:         return "jit";
+    case Engine::Tiered:      return "tiered";
+    }
+    return "";
+}
+
+Machine::Machine(Engine engine, unsigned compile_threads) : engine(engine) {
+    // IR tracing happens in partial_interpret
+    if constexpr (trace_level >= TraceLevel::IR)
+        this->engine = Engine::Interpreter;
+
+    if (this->engine == Engine::Jit) {
+        jit.emplace();
+        jit->pinned = { A, X, Y, S, Flag_N, Flag_V, Flag_Z, Flag_C };
+        native_slots.resize(sizeof(JitX64::ChainState) / sizeof(u64) + 0x10000);
+
+        // Instruction tracing needs every block to come back to the dispatch loop
+        if constexpr (trace_level < TraceLevel::Instruction)
+            cache.jit = &*jit;
+    } else if (this->engine == Engine::Tiered)
+        compiler.emplace(compile_threads);
+
+    predict = [this] (u32 start, u8 mode, u32 branch_pc) {
+        return cache.LikelyExit(start, mode, branch_pc);
+    };
+}
+
+void Machine::Reset(u32 pc) {
+    registers.fill(0);
+    registers[Flag_M] = 1;
+    registers[Flag_X] = 1;
+    registers[Flag_E] = 1;
+    registers[Flag_I] = 1;
+    registers[S] = 0x01fd;
+    registers[PC] = pc & 0xffff;
+    registers[PBR] = pc >> 16;
+
+    previous = nullptr;
+    halted = false;
+}
+
+u64 Machine::run_for(u64 cycles) {
+    u64 start = registers[CYCLE];
+    Run(cycles, UINT64_MAX);
+    return registers[CYCLE] - start;
+}
+
+u64 Machine::run_instructions(u64 count) {
+    return Run(UINT64_MAX, count);
+}
+
+void Machine::Trace(u32 pc) {
+    TraceInstruction record;
+    record.opcode = memory[pc & 0xffff];
+    record.pc = pc;
+    record.a = registers[A];
+    record.x = registers[X];
+    record.y = registers[Y];
+    record.s = registers[S];
+    for (int i = 0; i < 8; i++)
+        record.flags[i] = registers[Flag_N + i];
+    record.cycle = registers[CYCLE];
+    trace_sink.Write(record);
+}
+
+u64 Machine::Run(u64 cycles, u64 instructions) {
+    // Instruction tracing needs a record before every instruction
+    constexpr u64 max_block = trace_level >= TraceLevel::Instruction ? 1 : INT_MAX;
+
+    auto start_time = std::chrono::steady_clock::now();
+    u64 start_cycle = registers[CYCLE];
+    u64 count = instructions; // Left to run
+
+    // Chained blocks check the limits themselves. Stopping at an address needs every block to come back.
+    auto* chain = reinterpret_cast<JitX64::ChainState*>(native_slots.data());
+    if (chain)
+        chain->cycle_limit = stop_at ? 0 : start_cycle + std::min(cycles, UINT64_MAX - start_cycle);
+
+    while (!halted && count > 0 && registers[CYCLE] - start_cycle < cycles) {
+        u64 allocations = thread_alloc_stats().allocations;
+        u32 pc = registers[PBR] << 16 | registers[PC];
+        if (stop_at && pc == *stop_at)
+            break;
+        u8 mode = ModeFromRegisters(registers.data());
+
+        // Install whatever the workers have finished, before looking up the next block
+        if (compiler && compiler->Ready()) {
+            compiler->TakeResults(compiled);
+            bool full = false;
+            for (const CompileQueue::Result& result : compiled) {
+                if (result.fn)
+                    cache.Install(result.key, result.serial, result.fn);
+                full |= result.full;
+            }
+            if (full)
+                FlushCode();
+        }
+
+        // Blocks are only run if they fit in the remaining instruction count
+        Block *block = previous ? cache.Follow(previous, pc, mode, memory.data()) : nullptr;
+        if (block && u64(block->instructions) > count)
+            block = nullptr;
+        bool linked = block != nullptr;
+        if (!block)
+            block = cache.Lookup(pc, mode, memory.data());
+        std::optional<Block> uncached;
+
+#ifdef HAVE_AOT_BLOCKS
+        // Blocks recompiled by firerecomp don't need emitting
+        if (!block) {
+            // They are only specialized for E/M/X, so they work for any D.
+            // Code that changed since it was recompiled goes through the runtime path instead.
+            auto aot = FindAotBlock(pc, mode & Mode_Flags);
+            if (aot && u64(aot->instructions) <= count) {
+                Block aot_block(pc, mode);
+                aot_block.instructions = aot->instructions;
+                aot_block.complete = true;
+                aot_block.native = aot->fn;
+                for (size_t i = 0; i < aot->guard_count; i++)
+                    aot_block.guards.push_back({ aot->guards[i].address, aot->guards[i].byte });
+                if (BlockCache::Unmodified(aot_block, memory.data()))
+                    block = cache.Insert(std::move(aot_block));
+            }
+        }
+#endif
+
+        // Hot blocks get emitted again as superblocks, following their branches' likely paths
+        bool retrace = block && block->hot && u64(block->instructions) <= count;
+        bool emitted = !block || u64(block->instructions) > count || retrace;
+
+        if (emitted) {
+            int max_instructions = std::min(count, max_block);
+            Block new_block = EmitBlock(pc, mode, max_instructions, memory.data(),
+                                        retrace ? predict : nullptr, plain_memory);
+            if (new_block.instructions == 0) {
+                halted = true;
+                break;
+            }
+            linked = false;
+            if (new_block.superblock) {
+                stats.superblocks++;
+                stats.side_exits += new_block.side_exits;
+            }
+
+            if (engine == Engine::Jit) {
+                JitX64::ChainSpec spec = ChainSpec(new_block);
+                JitX64::Chained where;
+                new_block.native = jit->Compile(new_block.ir, new_block.widths, new_block.pc, &spec, &where);
+                if (!new_block.native && jit->Full()) {
+                    FlushCode();
+                    new_block.native = jit->Compile(new_block.ir, new_block.widths, new_block.pc, &spec, &where);
+                }
+                if (new_block.native) {
+                    new_block.chain_entry = where.entry;
+                    auto jump = where.exits.begin();
+                    for (Exit& exit : new_block.exits) {
+                        if (exit.kind != Exit::Computed)
+                            exit.jump = *jump++;
+                    }
+                }
+            } else if (engine == Engine::Threaded) {
+                new_block.threaded = std::make_unique<ThreadedBlock>();
+                if (!new_block.threaded->Decode(new_block.ir, new_block.widths))
+                    new_block.threaded.reset();
+            }
+
+            if (new_block.complete) {
+                block = cache.Insert(std::move(new_block));
+            } else {
+                // Blocks cut short by the instruction count aren't complete, run them but don't cache them
+                uncached.emplace(std::move(new_block));
+                block = &*uncached;
+            }
+        }
+
+        // Insert might have evicted the previous block, so it's found again by its key
+        bool linking = previous && !linked && !uncached;
+        if (linking)
+            cache.Link(previous_pc, previous_mode, block);
+        previous = uncached ? nullptr : block;
+        previous_pc = pc;
+        previous_mode = mode;
+
+        if constexpr (trace_level >= TraceLevel::Instruction)
+            Trace(pc);
+
+        if (block->chain_entry) {
+            // Runs until a block leaves through an exit that isn't patched, or the next one doesn't fit
+            chain->last = BlockCache::Key(pc, mode);
+            chain->chained = 0;
+            chain->instructions_left = count;
+            block->native(reinterpret_cast<u64*>(chain + 1), registers.data(), memory.data());
+            count = chain->instructions_left;
+            stats.blocks_run += chain->chained;
+            stats.chained += chain->chained;
+
+            // Uncached blocks are never linked to, so the chain ended at a cached block. That one
+            // gets profiled and linked from next.
+            if (chain->chained) {
+                block = cache.Find(chain->last);
+                previous = block;
+                previous_pc = block->pc;
+                previous_mode = block->mode;
+            }
+        } else {
+            if (block->native) {
+                block->native(block->slots.data(), registers.data(), memory.data());
+            } else if (block->threaded) {
+                block->threaded->Run(registers.data(), memory.data());
+            } else {
+                // Constants were filled in when the block was emitted, unless IR tracing wants to see them
+                size_t first = trace_level >= TraceLevel::IR ? 0 : block->constants;
+                partial_interpret(block->ir, block->widths, block->slots, first, registers.data(), memory.data());
+            }
+            count -= block->side_exits ? registers[RETIRED] : block->instructions;
+        }
+        block->runs++;
+        stats.blocks_run++;
+
+        // Hot blocks get compiled in the background, and keep running on the interpreter meanwhile
+        bool tier_up = compiler && !uncached && !block->native && !block->queued
+                    && block->runs >= tier_up_threshold;
+        if (tier_up) {
+            compiler->Push(BlockCache::Key(block->pc, block->mode), block->serial, block->pc, block->ir, block->widths);
+            block->queued = true;
+        }
+
+        // Finalize wrote all changed state back to registers
+        pc = registers[PBR] << 16 | registers[PC];
+
+        // Count which way branches go, for building superblocks
+        if (block->exits.size() == 2 && !block->superblock && !uncached) {
+            for (Exit& exit : block->exits) {
+                if (exit.pc == pc) {
+                    exit.count++;
+                    break;
+                }
+            }
+            if (block->exits[0].count + block->exits[1].count == superblock_threshold) {
+                block->hot = cache.LikelyExit(block->pc, block->mode, block->instruction_pcs.back()).has_value();
+                cache.Chain(block);
+            }
+        }
+
+        if (!emitted && !linking && !tier_up) {
+            stats.cached_runs++;
+            stats.cached_allocations += thread_alloc_stats().allocations - allocations;
+        }
+    }
+
+    stats.exec_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+    stats.instructions += instructions - count;
+    return instructions - count;
+}
+
+JitX64::ChainSpec Machine::ChainSpec(const Block& block) const {
+    JitX64::ChainSpec spec;
+    spec.key = BlockCache::Key(block.pc, block.mode);
+    spec.instructions = block.instructions;
+    spec.retired = block.side_exits ? RETIRED : -1;
+    spec.cycle = CYCLE;
+
+    // The same checks as the dispatch loop: the mode matches (see ModeFromRegisters) and the code hasn't changed
+    spec.entry = {
+        { Flag_E, 1, u32(block.mode & Mode_E ? 1 : 0) },
+        { Flag_M, 1, u32(block.mode & Mode_M ? 1 : 0) },
+        { Flag_X, 1, u32(block.mode & Mode_X ? 1 : 0) },
+        { D, 0xff, 0, (block.mode & Mode_DL0) != 0 },
+    };
+    spec.guards = block.guards;
+
+    for (const Exit& exit : block.exits) {
+        if (exit.kind != Exit::Computed)
+            spec.exits.push_back({ { PC, 0xffff, exit.pc & 0xffff }, { PBR, 0xff, exit.pc >> 16 } });
+    }
+    return spec;
+}
+
+void Machine::FlushCode() {
+    // Cached blocks might point at the code, so they all go
+    cache.Flush();
+    previous = nullptr;
+    if (jit)
+        jit->Reset();
+    if (compiler)
+        compiler->Reset();
+}
+
+void Machine::PrintStats() const {
+    cache.PrintStats();
+    printf("Heap: %llu allocations in %llu runs of cached blocks, %llu in total\n", (unsigned long long)stats.cached_allocations,
+        (unsigned long long)stats.cached_runs, (unsigned long long)alloc_stats().allocations);
+    printf("Superblocks: %llu emitted, with %llu side exits\n", (unsigned long long)stats.superblocks,
+        (unsigned long long)stats.side_exits);
+    if (jit) {
+        printf("JIT: %llu blocks compiled, %llu left on the interpreter, %zu bytes of code\n",
+            (unsigned long long)jit->stats.compiled, (unsigned long long)jit->stats.unsupported, jit->Used());
+        printf("     %llu of %llu blocks run were chained to from the previous one\n",
+            (unsigned long long)stats.chained, (unsigned long long)stats.blocks_run);
+        printf("     %llu register loads and stores kept in host registers\n", (unsigned long long)jit->stats.pinned);
+        if (jit->stats.exhausted) {
+            printf("     %llu blocks out of code space, flushed %llu times\n",
+                (unsigned long long)jit->stats.exhausted, (unsigned long long)jit->stats.resets);
+        }
+    }
+    if (compiler) {
+        size_t depth = compiler->Depth();
+        CompileQueue::Stats stats = compiler->GetStats();
+        u64 done = stats.compiled + stats.unsupported + stats.exhausted;
+        printf("Tiering: %llu blocks queued on %zu threads, %llu compiled, %llu left on the interpreter, %zu still queued (%zu at most)\n",
+            (unsigned long long)stats.queued, compiler->Threads(), (unsigned long long)stats.compiled,
+            (unsigned long long)stats.unsupported, depth, stats.peak_depth);
+        printf("         %.1f us average latency (%.1f us compiling), %.1f us at most, %zu bytes of code\n",
+            done ? stats.latency_ns / 1e3 / done : 0.0, done ? stats.compile_ns / 1e3 / done : 0.0,
+            stats.max_latency_ns / 1e3, stats.code_bytes);
+        if (stats.exhausted) {
+            printf("         %llu blocks out of code space, flushed %llu times\n",
+                (unsigned long long)stats.exhausted, (unsigned long long)stats.resets);
+        }
+    }
+}
+
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "m65816.h"
+#include "m65816_cache.h"
+#include "ir_jit_x64.h"
+#include "ir_compile_queue.h"
+
+#include <array>
+#include <optional>
+#include <vector>
+
+namespace m65816 {
+
+// How finished blocks get executed
+enum class Engine {
+    Interpreter, // partial_interpret
+    Threaded,    // ThreadedBlock
+    Jit,         // JitX64, falling back to partial_interpret
+    Tiered,      // partial_interpret, until blocks get hot and a CompileQueue has compiled them
+};
+
+const char* EngineName(Engine engine);
+
+// One emulated 65816: its register file, the 64KB of memory it runs against and the blocks
+// emitted for it, along with whatever the engine keeps (JIT code, compile threads).
+//
+// Machines don't share anything that changes. The opcode tables are built at compile time and
+// EmitBlock's scratch space is per thread, so each Machine can run on its own thread.
+// A single Machine must only be used by one thread at a time.
+// Tracing (ir_trace.h) goes to one global sink, so trace builds should only run one Machine.
+class Machine {
+public:
+    std::array<u64, 32> registers {}; // Indexed by Reg
+    std::array<u8, 0x10000> memory {};
+
+    // compile_threads is the size of the Tiered engine's CompileQueue, 0 for its default
+    explicit Machine(Engine engine = Engine::Jit, unsigned compile_threads = 0);
+
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    // Clears the registers and starts at pc in emulation mode, with interrupts disabled and S at 0x1fd.
+    // Memory and the block cache are left alone.
+    void Reset(u32 pc);
+
+    // Runs whole blocks until at least cycles have passed, and returns how many did. Blocks aren't
+    // split, so that can be a few more than asked for. Returns early if the machine halts or stops.
+    u64 run_for(u64 cycles);
+
+    // Runs exactly count instructions, cutting the last block short, unless the machine halts or stops first.
+    // Returns how many ran.
+    u64 run_instructions(u64 count);
+
+    // Stopped at an unimplemented opcode. Reset starts it again
+    bool Halted() const { return halted; }
+
+    // run_for and run_instructions also return when a block is about to start at this PBR:PC.
+    // Jumps inside a block aren't seen, but a loop like JMP * always starts a block of its own.
+    std::optional<u32> stop_at;
+    bool Stopped() const { return stop_at && (registers[PBR] << 16 | registers[PC]) == *stop_at; }
+
+    // Which bus addresses are plain memory, for front ends with MMIO mapped into memory (see
+    // EmitBlock). Set before running anything, blocks already emitted aren't changed.
+    PlainMemoryFn plain_memory;
+
+    u64 Cycles() const { return registers[CYCLE]; }
+
+    struct Stats {
+        u64 exec_ns = 0;            // Time spent in run_for and run_instructions, emitting included
+        u64 blocks_run = 0;
+        u64 chained = 0;            // Blocks the JIT's code jumped to without returning (see BlockCache::Chain)
+        u64 instructions = 0;
+        u64 superblocks = 0;        // Blocks emitted again along their branch profiles
+        u64 side_exits = 0;         // Branches those left off their likely path
+        u64 cached_runs = 0;        // Blocks run without emitting, linking or queueing anything
+        u64 cached_allocations = 0; // Heap allocations during those, which should be none
+    } stats;
+
+    void PrintStats() const;
+
+private:
+    // Stops after whichever limit is reached first
+    u64 Run(u64 cycles, u64 instructions);
+
+    void Trace(u32 pc);
+
+    // Drops every cached block and all the native code, once the JIT runs out of space
+    void FlushCode();
+
+    // What the JIT needs to chain block to the blocks its exits are linked to
+    JitX64::ChainSpec ChainSpec(const Block& block) const;
+
+    Engine engine;
+    BlockCache cache;
+    std::optional<JitX64> jit;
+
+    // The JIT's blocks all share these slots, as chained blocks don't come back to swap them.
+    // A JitX64::ChainState goes first.
+    std::vector<u64> native_slots;
+    std::optional<CompileQueue> compiler;
+    std::vector<CompileQueue::Result> compiled;
+    ExitPredictor predict;
+
+    // The last block run, if it's in the cache, for linking to the next one
+    Block* previous = nullptr;
+    u32 previous_pc = 0;
+    u8 previous_mode = 0;
+
+    bool halted = false;
+};
+
+}
@@ -5,90 +5,6 @@
 
 namespace m65816 {
 
-// Given an address, applies a read or write operation.
-// Applies the operation twice when M = 0
-void ApplyMemoryOperation(Emitter& e, inner_fn operation, ssa address) {
-    operation(e, e.state[A], address);
-    e.IncCycle();
-
-    e.If(e.Not(e.state[Flag_M]), [&] () {
-        ssa address2 = e.Add(address, 1);
-        operation(e, e.state[B], address2);
-        e.IncCycle();
-    });
-}
-
-// Applies an operation with an immediate argument
-// Handles 16bit mode
-void ApplyImmediate(Emitter& e, inner_fn operation) {
-    ssa immediate_address = e.Cat(e.state[PBR], e.state[PC]);
-    e.IncPC();
-    e.IncCycle();
-
-    operation(e, e.state[A], immediate_address);
-
-    e.If(e.Not(e.state[Flag_M]), [&] () {
-        immediate_address = e.Add(immediate_address, e.Const<24>(1));
-        e.IncPC();
-        e.IncCycle();
-        operation(e, e.state[B], immediate_address);
-    });
-}
-
-// Applies an operation directly to the Accumulator (A/B)
-// Handles 16bit mode
-void ApplyAcc(Emitter& e, rmw_fn operation) {
-    e.IncCycle();
-
-    // 8 bit version
-    e.If(e.state[Flag_M], [&] () {
-        e.state[A] = operation(e, e.state[A], 8);
-    });
-
-    // 16 bit version
-    e.If(e.Not(e.state[Flag_M]), [&] () {
-        ssa result = operation(e, e.Cat(e.state[B], e.state[A]), 16);
-        e.state[A] = e.Extract(result, 0, 8);
-        e.state[B] = e.Extract(result, 8, 8);
-        e.IncCycle();
-    });
-}
-
-// Applies a Read-Write-Modify operation
-// Handles 16bit mode
-void ApplyModify(Emitter& e, rmw_fn operation, ssa address) {
-    ssa low = e.Read(address);
-    e.IncCycle();
-
-    // 8 bit version
-    e.If(e.state[Flag_M], [&] () {
-        ssa result = operation(e, low, 8);
-        // TODO: Dummy read to same address as previous=
-        e.IncCycle();
-
-        e.Write(address, result);
-        e.IncCycle();
-    });
-
-    // 16 bit version
-    e.If(e.Not(e.state[Flag_M]), [&] () {
-        ssa high_address = e.Add(address, e.Const<24>(1));
-        ssa high = e.Read(high_address);
-        ssa value = e.Cat(high, low);
-        e.IncCycle();
-
-        ssa result = operation(e, value, 16);
-        // TODO: Dummy read to same address as previous=
-        e.IncCycle();
-
-        e.Write(high_address, e.Extract(result, 8, 8));
-        e.IncCycle();
-
-        e.Write(address, e.Extract(result, 0, 8));
-        e.IncCycle();
-    });
-}
-
 // Calculates zero flag of an 8bit result.
 // Chains to 16bits.
 // For 16bit chaining, calculate the flags for the low 8 bits first
@@ -179,6 +95,14 @@ ssa modifyStack(Emitter& e, int dir) {
     return e.state[S];
 }
 
+// The emulated stack is always in page 1, even while S itself isn't (TXS and XCE don't force it there).
+// modifyStack's results already are, so this mostly matters for the first push of a block, but it
+// lets ForwardMemoryOps see that a push and the pull after it hit the same address.
+ssa stackAddress(Emitter& e) {
+    ssa emulated_stack = e.Cat(e.Const<8>(0x01), e.Extract(e.state[S], 0, 8));
+    return e.Ternary(e.state[Flag_E], emulated_stack, e.state[S]);
+}
+
 // Loads a 16 bit value from a regsiter.
 // Helper function for instructions that don't need to split 16 bit operations into
 // two 8 bit memory operations.
@@ -1,28 +1,101 @@
 #pragma once
 
-#include <functional>
+#include "m65816_emitter.h"
 
 namespace m65816 {
-class Emitter;
 
-using inner_fn = std::function<void(Emitter&, ssa&, ssa)>;
-using rmw_fn = std::function<ssa(Emitter&, ssa, int width)>;
+// Operations are template arguments, so each instruction gets its own copy of the
+// Apply* helpers with the operation inlined.
+using inner_fn = void (*)(Emitter&, ssa&, ssa);
+using rmw_fn = ssa (*)(Emitter&, ssa, int width);
 
 // Given an address, applies a read or write operation.
 // Applies the operation twice when M = 0
-void ApplyMemoryOperation(Emitter& e, inner_fn operation, ssa address);
+template<inner_fn operation>
+void ApplyMemoryOperation(Emitter& e, ssa address) {
+    operation(e, e.state[A], address);
+    e.IncCycle();
+
+    e.If(e.Not(e.state[Flag_M]), [&] () {
+        ssa address2 = e.Add(address, 1);
+        operation(e, e.state[B], address2);
+        e.IncCycle();
+    });
+}
 
 // Applies an operation with an immediate argument
 // Handles 16bit mode
-void ApplyImmediate(Emitter& e, inner_fn operation);
+template<inner_fn operation>
+void ApplyImmediate(Emitter& e) {
+    ssa immediate_address = e.Cat(e.state[PBR], e.state[PC]);
+    e.IncPC();
+    e.IncCycle();
+
+    operation(e, e.state[A], immediate_address);
+
+    e.If(e.Not(e.state[Flag_M]), [&] () {
+        immediate_address = e.Add(immediate_address, e.Const<24>(1));
+        e.IncPC();
+        e.IncCycle();
+        operation(e, e.state[B], immediate_address);
+    });
+}
 
 // Applies an operation directly to the Accumulator (A/B)
 // Handles 16bit mode
-void ApplyAcc(Emitter& e, rmw_fn operation);
+template<rmw_fn operation>
+void ApplyAcc(Emitter& e) {
+    e.IncCycle();
+
+    // 8 bit version
+    e.If(e.state[Flag_M], [&] () {
+        e.state[A] = operation(e, e.state[A], 8);
+    });
+
+    // 16 bit version
+    e.If(e.Not(e.state[Flag_M]), [&] () {
+        ssa result = operation(e, e.Cat(e.state[B], e.state[A]), 16);
+        e.state[A] = e.Extract(result, 0, 8);
+        e.state[B] = e.Extract(result, 8, 8);
+        e.IncCycle();
+    });
+}
 
 // Applies a Read-Write-Modify operation
 // Handles 16bit mode
-void ApplyModify(Emitter& e, rmw_fn operation, ssa address);
+template<rmw_fn operation>
+void ApplyModify(Emitter& e, ssa address) {
+    ssa low = e.Read(address);
+    e.IncCycle();
+
+    // 8 bit version
+    e.If(e.state[Flag_M], [&] () {
+        ssa result = operation(e, low, 8);
+        // TODO: Dummy read to same address as previous=
+        e.IncCycle();
+
+        e.Write(address, result);
+        e.IncCycle();
+    });
+
+    // 16 bit version
+    e.If(e.Not(e.state[Flag_M]), [&] () {
+        ssa high_address = e.Add(address, e.Const<24>(1));
+        ssa high = e.Read(high_address);
+        ssa value = e.Cat(high, low);
+        e.IncCycle();
+
+        ssa result = operation(e, value, 16);
+        // TODO: Dummy read to same address as previous=
+        e.IncCycle();
+
+        e.Write(high_address, e.Extract(result, 8, 8));
+        e.IncCycle();
+
+        e.Write(address, e.Extract(result, 0, 8));
+        e.IncCycle();
+    });
+}
 
 // Calculates zero flag of an 8bit result.
 // Chains to 16bits.
@@ -61,6 +134,10 @@ void compare(Emitter& e, ssa dst, ssa val);
 // Takes into account emulated mode
 ssa modifyStack(Emitter& e, int dir);
 
+// Address the next push writes to
+// Takes into account emulated mode
+ssa stackAddress(Emitter& e);
+
 // Loads a 16 bit value from a regsiter.
 // Helper function for instructions that don't need to split 16 bit operations into
 // two 8 bit memory operations.
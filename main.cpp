@@ -1,8 +1,287 @@
-#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
 #include "m65816.h"
+#include "m65816_emitter.h"
+#include "m65816_cache.h"
+#include "m65816_machine.h"
+#include "m65816_lockstep.h"
+#include "ir_trace.h"
+#include "ir_base.h"
+#include "nes_rom.h"
+
+using m65816::Engine;
+using m65816::EngineName;
+using m65816::LockstepInstance;
+using m65816::LockstepStats;
+
+// The ROM the bench modes run, nestest.nes in the working directory unless another is given
+const char* rom_path = "nestest.nes";
+
+// Loads rom_path, or exits if it can't
+void load_rom(u8* memory) {
+    if (const char* error = LoadNesRom(rom_path, memory)) {
+        printf("%s: %s\n", rom_path, error);
+        exit(1);
+    }
+}
+
+// For checking engines end up in the same state. RETIRED is left out, only superblocks write it.
+u64 state_hash(const u64* registers, const u8* memory) {
+    u64 hash = 1469598103934665603ull;
+    for (size_t i = 0; i < 0x10000; i++) { hash ^= memory[i]; hash *= 1099511628211ull; }
+    for (size_t i = 0; i < 32; i++) {
+        if (i != m65816::RETIRED) { hash ^= registers[i]; hash *= 1099511628211ull; }
+    }
+    return hash;
+}
+
+// Runs count instructions from 0xc000 (nestest's automated mode), on whatever is in the machine's memory.
+// Returns the time spent executing blocks (not emitting them), in nanoseconds
+u64 interpeter_loop(m65816::Machine& machine, int count = 6000) {
+    machine.Reset(0xc000);
+    machine.run_instructions(count);
+
+    trace_sink.Flush();
+    machine.PrintStats();
+    return machine.stats.exec_ns;
+}
+
+// Runs copies of the ROM that start with different A, X and Y registers and instruction counts, one
+// instance at a time and then in lockstep, and checks both ways end in the same states as
+// running each copy on the interpreter. Returns false if they don't.
+bool benchmark_lockstep(int count) {
+    std::array<u8, 0x10000> memory {};
+    load_rom(memory.data());
+
+    std::vector<LockstepInstance> initial(count);
+    for (int i = 0; i < count; i++) {
+        LockstepInstance& instance = initial[i];
+        instance.mem = memory;
+        instance.regs[m65816::Flag_M] = 1;
+        instance.regs[m65816::Flag_X] = 1;
+        instance.regs[m65816::Flag_E] = 1;
+        instance.regs[m65816::Flag_I] = 1;
+        instance.regs[m65816::S] = 0x01fd;
+        instance.regs[m65816::PC] = 0xc000;
+        instance.regs[m65816::A] = i & 0xff;
+        instance.regs[m65816::X] = i * 3 & 0xff;
+        instance.regs[m65816::Y] = i * 7 & 0xff;
+        instance.count = 6000 - i % 5 * 100;
+    }
+
+    auto hash = [] (const std::vector<LockstepInstance>& instances) {
+        u64 h = 0;
+        for (const LockstepInstance& instance : instances)
+            h = h * 31 + state_hash(instance.regs.data(), instance.mem.data());
+        return h;
+    };
+
+    u64 reference = 0;
+    for (const LockstepInstance& instance : initial) {
+        auto machine = std::make_unique<m65816::Machine>(Engine::Interpreter);
+        machine->registers = instance.regs;
+        machine->memory = instance.mem;
+        machine->run_instructions(instance.count);
+        reference = reference * 31 + state_hash(machine->registers.data(), machine->memory.data());
+    }
+
+    bool match = true;
+    for (int lanes : { 1, lockstep_lanes }) {
+        std::vector<LockstepInstance> instances = initial;
+        LockstepStats stats;
+        auto start = std::chrono::steady_clock::now();
+        m65816::lockstep_loop(instances, lanes, stats);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        bool same = hash(instances) == reference;
+        match &= same;
+        printf("%i lanes: %8.3f ms, %llu lockstep runs of %llu blocks, %llu solo runs%s\n", lanes, ms,
+            (unsigned long long)stats.group_runs, (unsigned long long)stats.group_lanes, (unsigned long long)stats.solo_runs,
+            same ? "" : "  (final states don't match the interpreter!)");
+    }
+    printf("Lockstep interpreter is using %s\n", lockstep_avx2() ? "AVX2" : "generic vectors");
+    return match;
+}
+
+// Runs the ROM on every engine and compares how long they spend executing blocks.
+// Each engine gets a fresh block cache per run, so emission isn't included in the timings.
+// Returns false if any engine ends up in a different state to the interpreter.
+bool benchmark(int runs) {
+    u64 reference_hash = 0;
+    bool match = true;
+    for (Engine engine : { Engine::Interpreter, Engine::Threaded, Engine::Jit, Engine::Tiered }) {
+        u64 total_ns = 0;
+        u64 hash = 0;
+        for (int run = 0; run < runs; run++) {
+            auto machine = std::make_unique<m65816::Machine>(engine);
+            load_rom(machine->memory.data());
+            total_ns += interpeter_loop(*machine);
+
+            // All engines should end up in the same state
+            hash = state_hash(machine->registers.data(), machine->memory.data());
+        }
+        if (engine == Engine::Interpreter)
+            reference_hash = hash;
+        match &= hash == reference_hash;
+
+        printf("%-12s %10.3f ms per run%s\n", EngineName(engine), total_ns / 1e6 / runs,
+            hash == reference_hash ? "" : "  (final state doesn't match the interpreter!)");
+    }
+    return match;
+}
+
+// Emits every block reachable through constant exits from the start of the ROM, all in emulation
+// mode, and reports how fast instructions get emitted. Includes the optimisation passes.
+void benchmark_emit(int runs) {
+    std::array<u64, 32> registers {};
+    std::array<u8, 0x10000> memory {};
+    load_rom(memory.data());
+    registers[m65816::Flag_E] = 1;
+    registers[m65816::Flag_M] = 1;
+    registers[m65816::Flag_X] = 1;
+    const u8 mode = m65816::ModeFromRegisters(registers.data());
+
+    std::vector<u32> starts;
+    std::vector<u32> worklist = { 0xc000 };
+    while (!worklist.empty() && starts.size() < 1000) {
+        u32 pc = worklist.back();
+        worklist.pop_back();
+        if (std::find(starts.begin(), starts.end(), pc) != starts.end())
+            continue;
+
+        m65816::Block block = m65816::EmitBlock(pc, mode, 0x7fffffff, memory.data());
+        if (block.instructions == 0)
+            continue;
+        starts.push_back(pc);
+        for (const m65816::Exit& exit : block.exits) {
+            if (exit.kind != m65816::Exit::Computed)
+                worklist.push_back(exit.pc);
+        }
+    }
+
+    u64 instructions = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int run = 0; run < runs; run++) {
+        for (u32 pc : starts)
+            instructions += m65816::EmitBlock(pc, mode, 0x7fffffff, memory.data()).instructions;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%zu blocks, %llu instructions in %.3f s, %.0f instructions per second\n", starts.size(),
+        (unsigned long long)instructions, seconds, instructions / seconds);
+}
+
+// Prints a binary trace from a FIRESNES_TRACE build as text, with instructions in the nestest log format
+bool dump_trace(const char* path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+
+    u8 type;
+    while (fread(&type, 1, 1, f) == 1) {
+        fseek(f, -1, SEEK_CUR);
+        if (type == Trace_Instruction) {
+            TraceInstruction r;
+            if (fread(&r, sizeof(r), 1, f) != 1)
+                break;
+
+            // N V M X D I Z C, with M and X shown as the 6502's unused/break bits
+            u8 p = r.flags[0] << 7 | r.flags[1] << 6 | 1 << 5 | 0 << 4
+                 | r.flags[4] << 3 | r.flags[5] << 2 | r.flags[6] << 1 | r.flags[7] << 0;
+
+            u32 nes_cycle    = (r.cycle * 3) % 341;
+            u32 nes_scanline = ((341 * 242 + (r.cycle * 3)) / 341) % 262 - 1;
+            printf("%04X  %02X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3i SL:%i\n", r.pc & 0xffff, r.opcode,
+                u8(r.a), r.x, r.y, p, u8(r.s), nes_cycle, nes_scanline);
+        } else if (type == Trace_Node) {
+            TraceNode r;
+            if (fread(&r, sizeof(r), 1, f) != 1)
+                break;
+
+            if (r.id == Const) {
+                printf("% 5i: const%i", r.index, r.width);
+            } else {
+                printf("% 5i: %s", r.index, OpcodeName(r.id));
+                for (u16 arg : r.args) {
+                    if (arg != 0xffff)
+                        printf(" ssa%i", arg);
+                }
+            }
+            printf(" = %llx:%i\n", (unsigned long long)r.value, r.width);
+        } else {
+            printf("Bad trace record %02x\n", type);
+            break;
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    // These go before any of the other options, in any order
+    while (argc > 1) {
+        if (strcmp(argv[1], "--print-blocks") == 0)
+            m65816::print_blocks = true;
+        else if (strcmp(argv[1], "--perf-map") == 0)
+            JitX64::EnablePerfMap();
+        else
+            break;
+        argc--;
+        argv++;
+    }
+
+    if (argc > 2 && strcmp(argv[1], "--dump-trace") == 0)
+        return dump_trace(argv[2]) ? 0 : 1;
+
+    // The bench modes take a count and then a ROM, both optional
+    if (argc > 3 && strncmp(argv[1], "--bench", 7) == 0)
+        rom_path = argv[3];
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return benchmark(argc > 2 ? atoi(argv[2]) : 20) ? 0 : 1;
+
+    if (argc > 1 && strcmp(argv[1], "--bench-lockstep") == 0)
+        return benchmark_lockstep(argc > 2 ? atoi(argv[2]) : 64) ? 0 : 1;
+
+    if (argc > 1 && strcmp(argv[1], "--bench-emit") == 0) {
+        benchmark_emit(argc > 2 ? atoi(argv[2]) : 1000);
+        return 0;
+    }
+
+    printf("test\n");
+
+    int count = 255;
+
+
+    printf("     ");
+    for(int i = 0; i<16; i++) {
+        printf("  0x%x ", i);
+    }
+
+    for(int i = 0; i < 16; i++) {
+        printf ("\n0x%x  ", i);
+        for(int j = 0; j < 16; j++) {
+            int op = i << 4 | j;
+            printf("%5s ", m65816::name_table[op]);
+
+            if(!*m65816::name_table[op])
+                count--;
+        }
+    }
+
+    printf("\n\n\t\t%i/255\n", count);
 
-// int main(int, char**) {
-//     m65816 core;
+    m65816::Machine machine;
+    load_rom(machine.memory.data());
 
-//     core.run_for(100);
-// }
+    interpeter_loop(machine);
+    return 0;
+}
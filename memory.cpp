@@ -1,5 +1,35 @@
 #include "memory.h"
 
-void Bus::Attach(BusDevice* ) {
+#include <memory>
 
-}
\ No newline at end of file
+bool BusDevice::MightSelect(BaseEmitter& e, u32 address) const {
+    // Selectors are written as IR, so run them on a constant address and let the emitter fold them
+    e.Reset();
+    ssa selected = select(e, e.Const(address, address > 0xffff ? 24 : 16));
+    const IR_Base& node = e.buffer[selected.offset];
+    return node.id != Const || node.arg_32 != 0;
+}
+
+void Bus::Attach(BusDevice* device) {
+    devices.push_back(device);
+}
+
+PlainMemoryFn Bus::PlainMemory() const {
+    auto plain = std::make_shared<std::vector<bool>>(0x10000);
+    BaseEmitter e;
+    for (u32 address = 0; address < plain->size(); address++) {
+        int count = 0;
+        bool mmio = false;
+        for (BusDevice* device : devices) {
+            if (!device->MightSelect(e, address))
+                continue;
+            mmio |= !device->IsPlainMemory();
+            count++;
+        }
+        (*plain)[address] = count == 1 && !mmio;
+    }
+
+    return [plain] (u64 space, std::optional<u64> address) {
+        return space == 1 && address && *address < plain->size() && (*plain)[*address];
+    };
+}
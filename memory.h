@@ -1,9 +1,13 @@
 
+#pragma once
+
 #include "types.h"
 #include "ir_emitter.h"
+#include "ir_passes.h"
 
 
 #include <functional>
+#include <limits>
 #include <vector>
 
 using SelectorFn = std::function<ssa(BaseEmitter&, ssa)>; // IsSelected(address) -> bool
@@ -21,6 +25,15 @@ class BusDevice {
 
 public:
     BusDevice(SelectorFn select) : select(select) {}
+    virtual ~BusDevice() = default;
+
+    // False only if the selector folds to false for this address.
+    // Selectors that depend on more than the address might select it.
+    // e is scratch space for the selector's IR, and gets reset.
+    bool MightSelect(BaseEmitter& e, u32 address) const;
+
+    // Plain RAM/ROM: Reads have no side effects and return the last value written
+    virtual bool IsPlainMemory() const { return false; }
 };
 
 class Memory;
@@ -36,6 +49,8 @@ class MemoryView : public BusDevice {
 public:
     MemoryView(Memory* mem, SelectorFn select) : BusDevice(select), mem(mem) {}
 
+    bool IsPlainMemory() const override { return true; }
+
 };
 
 class Memory {
@@ -97,4 +112,10 @@ public:
     void Attach(BusDevice *);
     void Attach(BusDevice& device) { Attach(&device); }
     // Combines multiple BusDevice onto a single bus
+
+    // For the memory passes: bus addresses (namespace 1) covered by a single plain memory device,
+    // and nothing else, are plain. Addresses no device covers aren't.
+    // The 64KB of the bus is checked against the devices attached now, so the result is a table
+    // lookup that stays valid after the devices are gone.
+    PlainMemoryFn PlainMemory() const;
 };
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <map>
 
 #include "memory.h"
+#include "nes.h"
 
 std::function<ssa(BaseEmitter&, ssa)> simple_selecter(size_t mask, size_t value) {
      return [mask, value] (BaseEmitter& e, ssa bus_address) {
@@ -54,7 +55,7 @@ public:
             }) {}
 };
 
-void func() {
+PlainMemoryFn NesPlainMemory() {
     Bus ppu_bus;
 
     Bus cpu_bus;
@@ -73,7 +74,7 @@ void func() {
     cpu_bus.Attach(ppuLatch);
 
 
-    PPUWriteFnReg ppuAddr(0x2000,
+    PPUWriteFnReg ppuCtrl(0x2000,
         [] (BaseEmitter& e, ssa bus_address, ssa value) {
             // update t with nametable
             ssa current_t = e.StateRead<16>(offsetof(NesState, ppu_t));
@@ -83,7 +84,7 @@ void func() {
             e.StateWrite<16>(offsetof(NesState, ppu_t), new_t);
 
             // write remaning
-            e.StateWrite<8>(offsetof(NesState, ppuctrl), value));
+            e.StateWrite<8>(offsetof(NesState, ppuctrl), value);
         });
 
     PPUWriteReg ppuControl(0x2000, offsetof(NesState, ppuctrl));
@@ -114,7 +115,7 @@ void func() {
 
 
     PPUWriteReg oamAddr(0x2003, offsetof(NesState, oamaddr));
-    cpu_bus.Attach(ppuMask);
+    cpu_bus.Attach(oamAddr);
 
     //IRDevice oamData(
     //    simple_selecter(0xe007, 0x2004),
@@ -181,5 +182,9 @@ void func() {
 
     // Mapper zero
     Memory pgr_rom(0x8000, false);
-    cpu_bus.Attach(pgr_rom.view(simple_selecter(0xf000, 0x8000)));
+    cpu_bus.Attach(pgr_rom.view(simple_selecter(0x8000, 0x8000)));
+
+    // Nothing is attached for the APU and I/O registers at $4000-$401F, or cartridge space below
+    // $8000, which keeps them from counting as plain memory
+    return cpu_bus.PlainMemory();
 }
\ No newline at end of file
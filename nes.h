@@ -0,0 +1,7 @@
+#pragma once
+
+#include "ir_passes.h"
+
+// Which addresses of the NES CPU bus are plain RAM/ROM, for EmitBlock's memory passes.
+// PPU registers, APU/IO registers and anything unmapped are not, so accesses to them stay put.
+PlainMemoryFn NesPlainMemory();
@@ -0,0 +1,37 @@
+#include "nes_rom.h"
+
+#include <stdio.h>
+#include <vector>
+
+const char* LoadNesRom(const char* path, u8* mem) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return "can't open file";
+
+    u8 header[16];
+    if (fread(header, 1, 16, f) != 16 || header[0] != 'N' || header[1] != 'E' || header[2] != 'S') {
+        fclose(f);
+        return "not an iNES file";
+    }
+
+    int mapper = (header[6] >> 4) | (header[7] & 0xf0);
+    int prg_banks = header[4];
+    if (mapper != 0 || prg_banks < 1 || prg_banks > 2) {
+        fclose(f);
+        return "only NROM (mapper 0) is supported";
+    }
+
+    if (header[6] & 0x04)
+        fseek(f, 512, SEEK_CUR); // Skip trainer
+
+    std::vector<u8> prg(prg_banks * 0x4000);
+    size_t read = fread(prg.data(), 1, prg.size(), f);
+    fclose(f);
+    if (read != prg.size())
+        return "truncated";
+
+    // 16KB roms are mirrored
+    for (int i = 0; i < 0x8000; i++)
+        mem[0x8000 + i] = prg[i % prg.size()];
+    return nullptr;
+}
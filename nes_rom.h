@@ -0,0 +1,7 @@
+#pragma once
+
+#include "types.h"
+
+// Loads the PRG ROM of an iNES file into mem[0x8000-0xffff], mirroring 16KB ROMs.
+// Only NROM (mapper 0) is supported. Returns nullptr, or what went wrong.
+const char* LoadNesRom(const char* path, u8* mem);
@@ -0,0 +1,248 @@
+// Checks on how blocks get emitted, that the ROM tests in cpu_test.manifest can't see from the final
+// state alone. Run by ctest, see CMakeLists.txt.
+
+#include <stdio.h>
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <vector>
+
+#include "ir_emitter.h"
+#include "m65816_cache.h"
+#include "m65816_machine.h"
+
+using namespace m65816;
+
+namespace {
+
+int failures = 0;
+
+void Check(bool ok, const char* test, const char* what) {
+    if (!ok) {
+        printf("%s: %s\n", test, what);
+        failures++;
+    }
+}
+
+// Copies code to mem at address
+void Put(std::array<u8, 0x10000>& mem, u16 address, std::vector<u8> code) {
+    std::copy(code.begin(), code.end(), mem.begin() + address);
+}
+
+const u8 emulation = Mode_E | Mode_M | Mode_X | Mode_DL0;
+
+// A branch on a register is a conditional exit, whichever way it went last time
+void TestRegisterBranchExits() {
+    const char* test = "DEX; BNE exits";
+    std::array<u8, 0x10000> mem {};
+    Put(mem, 0xc000, {
+        0xca,       // DEX
+        0xd0, 0xfd, // BNE $C000
+    });
+
+    Block block = EmitBlock(0xc000, emulation, INT_MAX, mem.data());
+    Check(block.instructions == 2, test, "should have 2 instructions");
+    Check(block.exits.size() == 2, test, "should have 2 exits");
+    if (block.exits.size() != 2)
+        return;
+
+    auto has = [&] (Exit::Kind kind, u32 pc) {
+        return std::any_of(block.exits.begin(), block.exits.end(), [&] (const Exit& exit) {
+            return exit.kind == kind && exit.pc == pc;
+        });
+    };
+    Check(has(Exit::Taken, 0xc000), test, "should be taken to C000");
+    Check(has(Exit::FallThrough, 0xc003), test, "should fall through to C003");
+}
+
+// Operations on constants become constants as they are emitted, except shifts past the operand
+void TestConstantFolding() {
+    const char* test = "constant folding";
+    BaseEmitter e;
+    ssa cat = e.Cat(e.Const<8>(0x12), e.Const<8>(0x34));
+    Check(e.buffer[cat.offset].id == Const && e.buffer[cat.offset].arg_32 == 0x1234, test, "Cat should fold to 1234");
+    Check(e.widths[cat.offset] == 16, test, "Cat should be 16 bits");
+
+    ssa shift = e.ShiftRight(e.Const<8>(0x80), 8);
+    Check(e.buffer[shift.offset].id == ShiftRight, test, "a shift by the operand width shouldn't fold");
+}
+
+// Identical pure nodes are shared, reads of state aren't
+void TestValueNumbering() {
+    const char* test = "value numbering";
+    BaseEmitter e;
+    ssa x = e.StateRead<8>(0);
+    ssa a = e.Add(x, e.Const<8>(1));
+    ssa b = e.Add(x, e.Const<8>(1));
+    Check(a.offset == b.offset, test, "the same Add twice should be one node");
+    Check(e.StateRead<8>(0).offset != x.offset, test, "reads of state shouldn't be shared");
+}
+
+// SEC and LDX overwrite every flag CMP set, so its 9 bit subtraction is dead. The load stays,
+// it might be MMIO.
+void TestDeadCode() {
+    const char* test = "dead code";
+    std::array<u8, 0x10000> mem {};
+    Put(mem, 0xc000, {
+        0xc5, 0x10, // CMP $10
+        0x38,       // SEC
+        0xa2, 0x00, // LDX #0
+    });
+    Block block = EmitBlock(0xc000, emulation, 3, mem.data());
+    Check(std::find(block.widths.begin(), block.widths.end(), 9) == block.widths.end(), test,
+        "CMP's subtraction should be removed");
+    Check(std::any_of(block.ir.begin(), block.ir.end(), [] (const IR_Base& node) { return node.id == load8; }),
+        test, "CMP's load should stay");
+}
+
+// With M clear, the two bytes of LDA $1234 are one 16 bit load. Loading them again reuses it.
+void TestMemoryPasses() {
+    const char* test = "memory passes";
+    std::array<u8, 0x10000> mem {};
+    Put(mem, 0xc000, {
+        0xad, 0x34, 0x12, // LDA $1234
+    });
+    Block block = EmitBlock(0xc000, Mode_X | Mode_DL0, 1, mem.data());
+    Check(block.pairs_merged == 1, test, "LDA $1234 should merge one pair");
+    Check(block.loads_forwarded == 0, test, "LDA $1234 has nothing to forward");
+
+    Put(mem, 0xc003, {
+        0xad, 0x34, 0x12, // LDA $1234
+    });
+    block = EmitBlock(0xc000, Mode_X | Mode_DL0, 2, mem.data());
+    Check(block.loads_forwarded == 2, test, "the second LDA $1234 should reuse both bytes");
+    Check(block.pairs_merged == 1, test, "only the first LDA $1234 should be left to merge");
+}
+
+// Pulls get the value of the push before them, through S plus a constant, without knowing what S holds
+void TestStackForwarding() {
+    const char* test = "stack forwarding";
+    std::array<u8, 0x10000> mem {};
+    Put(mem, 0xc000, {
+        0x48, // PHA
+        0x68, // PLA
+    });
+    Block block = EmitBlock(0xc000, emulation, 2, mem.data());
+    Check(block.loads_forwarded == 1, test, "PLA should get the value PHA pushed");
+
+    Put(mem, 0xc000, {
+        0x20, 0x10, 0xc0, // JSR $C010
+    });
+    Put(mem, 0xc010, {
+        0x60,             // RTS
+    });
+    block = EmitBlock(0xc000, emulation, INT_MAX, mem.data());
+    Check(block.instructions == 2, test, "JSR should be followed to the RTS");
+    Check(block.loads_forwarded == 2, test, "RTS should get both bytes JSR pushed");
+}
+
+// Adds 200 down to 1 into $11:$10, then spins at C015. The DEX; BNE at C012 is nearly always taken,
+// the BCC at C00E only usually.
+void PutSumLoop(std::array<u8, 0x10000>& mem) {
+    Put(mem, 0xc000, {
+        0xa9, 0x00,       // LDA #0
+        0x85, 0x10,       // STA $10
+        0x85, 0x11,       // STA $11
+        0xa2, 200,        // LDX #200
+        0x8a,             // C008: TXA
+        0x18,             // CLC
+        0x65, 0x10,       // ADC $10
+        0x85, 0x10,       // STA $10
+        0x90, 0x02,       // BCC $C012
+        0xe6, 0x11,       // INC $11
+        0xca,             // C012: DEX
+        0xd0, 0xf3,       // BNE $C008
+        0x4c, 0x15, 0xc0, // C015: JMP $C015
+    });
+}
+
+// Following the likely side of a branch leaves a side exit for the other
+void TestSuperblockSideExit() {
+    const char* test = "DEX; BNE superblock";
+    std::array<u8, 0x10000> mem {};
+    PutSumLoop(mem);
+
+    ExitPredictor predict = [] (u32, u8, u32 branch_pc) -> std::optional<u32> {
+        if (branch_pc == 0xc013)
+            return 0xc008;
+        return {};
+    };
+    Block block = EmitBlock(0xc012, emulation, INT_MAX, mem.data(), predict);
+    Check(block.superblock, test, "should be a superblock");
+    Check(block.side_exits == 1, test, "should have 1 side exit");
+
+    // DEX, BNE, then the loop body up to the BCC, which has no favourite
+    Check(block.instructions == 7, test, "should have 7 instructions");
+    Check(std::any_of(block.exits.begin(), block.exits.end(), [] (const Exit& exit) {
+        return exit.kind == Exit::FallThrough && exit.pc == 0xc015;
+    }), test, "should side exit to C015");
+}
+
+// Constants come first, so their slots are filled in once
+void TestHoistConstants() {
+    const char* test = "hoisted constants";
+    std::array<u8, 0x10000> mem {};
+    PutSumLoop(mem);
+    Block block = EmitBlock(0xc000, emulation, INT_MAX, mem.data());
+    Check(block.constants > 0, test, "should have constants");
+    for (size_t i = 0; i < block.ir.size(); i++) {
+        if ((block.ir[i].id == Const) != (i < block.constants)) {
+            Check(false, test, "constants should all be at the start");
+            break;
+        }
+    }
+    Check(std::equal(block.slots.begin(), block.slots.begin() + block.constants, block.ir.begin(),
+        [] (u64 slot, const IR_Base& node) { return slot == node.arg_32; }), test, "constant slots should be filled in");
+}
+
+// The loop gets hot enough on every engine to form superblocks, and ends up where interpreting it
+// one instruction at a time, without a cache, does
+void TestHotLoop() {
+    const char* test = "hot DEX; BNE loop";
+    Machine reference(Engine::Interpreter);
+    PutSumLoop(reference.memory);
+    reference.Reset(0xc000);
+    u64* regs = reference.registers.data();
+    while ((regs[PBR] << 16 | regs[PC]) != 0xc015) {
+        Block block = EmitBlock(regs[PBR] << 16 | regs[PC], ModeFromRegisters(regs), 1, reference.memory.data());
+        interpret(block.ir, block.widths, regs, reference.memory.data());
+    }
+    Check(reference.memory[0x10] == 0x84 && reference.memory[0x11] == 0x4e, test, "reference should sum to 4E84");
+
+    for (Engine engine : { Engine::Interpreter, Engine::Threaded, Engine::Jit, Engine::Tiered }) {
+        Machine machine(engine, 1);
+        PutSumLoop(machine.memory);
+        machine.Reset(0xc000);
+        machine.stop_at = 0xc015;
+        machine.run_for(1000000);
+
+        char what[64];
+        snprintf(what, sizeof(what), "%s should form a superblock with a side exit", EngineName(engine));
+        Check(machine.stats.superblocks > 0 && machine.stats.side_exits > 0, test, what);
+        snprintf(what, sizeof(what), "%s should match the reference registers", EngineName(engine));
+        Check(std::equal(machine.registers.begin(), machine.registers.begin() + CYCLE, reference.registers.begin()), test, what);
+        snprintf(what, sizeof(what), "%s should match the reference memory", EngineName(engine));
+        Check(machine.memory == reference.memory, test, what);
+    }
+}
+
+}
+
+int main() {
+    TestConstantFolding();
+    TestValueNumbering();
+    TestDeadCode();
+    TestMemoryPasses();
+    TestHoistConstants();
+    TestRegisterBranchExits();
+    TestStackForwarding();
+    TestSuperblockSideExit();
+    TestHotLoop();
+
+    if (failures) {
+        printf("%i checks failed\n", failures);
+        return 1;
+    }
+    printf("All block checks passed\n");
+    return 0;
+}
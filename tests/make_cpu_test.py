@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+# Builds cpu_test.nes, the NROM program tests/cpu_test.manifest runs on every engine.
+# There's no 6502 assembler in the build, so the program is written here as (label, bytes) lines
+# and the generated ROM is checked in. Run it again after changing the program:
+#
+#     python3 tests/make_cpu_test.py tests/cpu_test.nes
+#
+# The program sticks to emulation mode and opcodes firesnes implements. It covers what the engines
+# have to agree on: branchy loops that get hot (superblocks, tiering), JSR/RTS, the stack, carries,
+# (zp),Y and abs,X addressing, and code in RAM that gets rewritten while it's cached.
+# Results land in zero page, then it loops at done. Expected values are worked out below too.
+
+import sys
+
+ORIGIN = 0xC000
+
+
+def program():
+    lo = lambda v: v & 0xFF
+    hi = lambda v: v >> 8 & 0xFF
+    return [
+        ("reset", [0x78]),                   # SEI
+        (None,    [0xD8]),                   # CLD
+        (None,    [0xA2, 0xFF]),             # LDX #$FF
+        (None,    [0x9A]),                   # TXS
+
+        # $11:$10 = 1 + 2 + ... + 200
+        (None,    [0xA9, 0x00]),             # LDA #0
+        (None,    [0x85, 0x10]),             # STA $10
+        (None,    [0x85, 0x11]),             # STA $11
+        (None,    [0xA2, 200]),              # LDX #200
+        ("sum",   [0x8A]),                   # TXA
+        (None,    [0x18]),                   # CLC
+        (None,    [0x65, 0x10]),             # ADC $10
+        (None,    [0x85, 0x10]),             # STA $10
+        (None,    [0x90, ("rel", "sum_nc")]),  # BCC sum_nc
+        (None,    [0xE6, 0x11]),             # INC $11
+        ("sum_nc", [0xCA]),                  # DEX
+        (None,    [0xD0, ("rel", "sum")]),   # BNE sum
+
+        # $0200 + y = (y * 3) ^ $5A, through the pointer at $20
+        (None,    [0xA9, 0x00]),             # LDA #<$0200
+        (None,    [0x85, 0x20]),             # STA $20
+        (None,    [0xA9, 0x02]),             # LDA #>$0200
+        (None,    [0x85, 0x21]),             # STA $21
+        (None,    [0xA0, 0x00]),             # LDY #0
+        ("fill",  [0x98]),                   # TYA
+        (None,    [0x0A]),                   # ASL A
+        (None,    [0x85, 0x12]),             # STA $12
+        (None,    [0x98]),                   # TYA
+        (None,    [0x18]),                   # CLC
+        (None,    [0x65, 0x12]),             # ADC $12
+        (None,    [0x49, 0x5A]),             # EOR #$5A
+        (None,    [0x91, 0x20]),             # STA ($20),Y
+        (None,    [0xC8]),                   # INY
+        (None,    [0xD0, ("rel", "fill")]),  # BNE fill
+
+        # $13 = the table added up with carries, $14 = the carry left over
+        (None,    [0x20, ("abs", "checksum")]),  # JSR checksum
+        (None,    [0x85, 0x13]),             # STA $13
+        (None,    [0xA9, 0x00]),             # LDA #0
+        (None,    [0x2A]),                   # ROL A
+        (None,    [0x85, 0x14]),             # STA $14
+
+        # Copies LDA #$00 / RTS to $0300, then for x = 1..40 patches the operand to x, calls it,
+        # and adds what it returned to $17
+        (None,    [0xA9, 0xA9]),             # LDA #$A9 (LDA #)
+        (None,    [0x8D, 0x00, 0x03]),       # STA $0300
+        (None,    [0xA9, 0x00]),             # LDA #0
+        (None,    [0x8D, 0x01, 0x03]),       # STA $0301
+        (None,    [0x85, 0x17]),             # STA $17
+        (None,    [0xA9, 0x60]),             # LDA #$60 (RTS)
+        (None,    [0x8D, 0x02, 0x03]),       # STA $0302
+        (None,    [0xA2, 0x01]),             # LDX #1
+        ("patch", [0x8E, 0x01, 0x03]),       # STX $0301
+        (None,    [0x20, 0x00, 0x03]),       # JSR $0300
+        (None,    [0x18]),                   # CLC
+        (None,    [0x65, 0x17]),             # ADC $17
+        (None,    [0x85, 0x17]),             # STA $17
+        (None,    [0xE8]),                   # INX
+        (None,    [0xE0, 41]),               # CPX #41
+        (None,    [0xD0, ("rel", "patch")]), # BNE patch
+
+        # $18 = 1 + ... + 10, pushed and then pulled off the stack
+        (None,    [0xA2, 10]),               # LDX #10
+        ("push",  [0x8A]),                   # TXA
+        (None,    [0x48]),                   # PHA
+        (None,    [0xCA]),                   # DEX
+        (None,    [0xD0, ("rel", "push")]),  # BNE push
+        (None,    [0xA9, 0x00]),             # LDA #0
+        (None,    [0x85, 0x18]),             # STA $18
+        (None,    [0xA0, 10]),               # LDY #10
+        ("pull",  [0x68]),                   # PLA
+        (None,    [0x18]),                   # CLC
+        (None,    [0x65, 0x18]),             # ADC $18
+        (None,    [0x85, 0x18]),             # STA $18
+        (None,    [0x88]),                   # DEY
+        (None,    [0xD0, ("rel", "pull")]),  # BNE pull
+
+        # Leaves A = $13, X = $11, Y = $17
+        (None,    [0xA5, 0x13]),             # LDA $13
+        (None,    [0xA6, 0x11]),             # LDX $11
+        (None,    [0xA4, 0x17]),             # LDY $17
+        ("done",  [0x4C, ("abs", "done")]),  # JMP done
+
+        ("checksum", [0xA2, 0x00]),          # LDX #0
+        (None,    [0x8A]),                   # TXA
+        (None,    [0x18]),                   # CLC
+        ("add",   [0x7D, 0x00, 0x02]),       # ADC $0200,X
+        (None,    [0xE8]),                   # INX
+        (None,    [0xD0, ("rel", "add")]),   # BNE add
+        (None,    [0x60]),                   # RTS
+
+        ("nmi",   [0x40]),                   # RTI
+    ]
+
+
+def assemble(lines):
+    # First pass finds the labels, the second fills in the operands
+    labels = {}
+    pc = ORIGIN
+    for label, code in lines:
+        if label:
+            labels[label] = pc
+        pc += sum(2 if isinstance(b, tuple) and b[0] == "abs" else 1 for b in code)
+
+    out = bytearray()
+    pc = ORIGIN
+    for label, code in lines:
+        size = sum(2 if isinstance(b, tuple) and b[0] == "abs" else 1 for b in code)
+        for b in code:
+            if isinstance(b, tuple) and b[0] == "abs":
+                out += bytes([labels[b[1]] & 0xFF, labels[b[1]] >> 8])
+            elif isinstance(b, tuple):
+                offset = labels[b[1]] - (pc + size)
+                assert -128 <= offset < 128, b
+                out.append(offset & 0xFF)
+            else:
+                out.append(b)
+        pc += size
+    return out, labels
+
+
+def expected(labels):
+    table = [(y * 3 & 0xFF) ^ 0x5A for y in range(256)]
+    a, c = 0, 0
+    for byte in table:
+        total = a + byte + c
+        a, c = total & 0xFF, total >> 8
+    total = sum(range(1, 201))
+    return {
+        "pc": labels["done"], "a": a, "x": total >> 8, "y": sum(range(1, 41)) & 0xFF, "s": 0x1FF,
+        0x10: total & 0xFF, 0x11: total >> 8, 0x13: a, 0x14: c,
+        0x17: sum(range(1, 41)) & 0xFF, 0x18: 55,
+        0x0200: table[0], 0x0255: table[0x55], 0x02FF: table[0xFF], 0x0301: 40,
+    }
+
+
+def main():
+    code, labels = assemble(program())
+    prg = bytearray([0xFF] * 0x4000)
+    prg[:len(code)] = code
+    for vector, label in ((0xFFFA, "nmi"), (0xFFFC, "reset"), (0xFFFE, "nmi")):
+        prg[vector - 0xC000] = labels[label] & 0xFF
+        prg[vector - 0xC000 + 1] = labels[label] >> 8
+
+    header = b"NES\x1a" + bytes([1, 0, 0, 0]) + bytes(8) # One 16KB PRG bank, mapper 0
+    with open(sys.argv[1], "wb") as f:
+        f.write(header + prg)
+
+    # What cpu_test.manifest should expect
+    words = []
+    for key, value in expected(labels).items():
+        words.append(f"{key}={value:X}" if isinstance(key, str) else f"mem[{key:04X}]={value:02X}")
+    print(f"done at {labels['done']:04X}:", " ".join(words))
+
+
+main()